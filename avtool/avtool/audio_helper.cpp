@@ -5,17 +5,109 @@
 //  Created by zhanwang-sky on 2023/11/24.
 //
 
+#include <cstring>
+#include <new>
 #include "audio_helper.hpp"
 
 using namespace AVTool;
 
+namespace {
+
+void apply_preset(struct SwrContext* swr, ResamplerPreset preset) {
+  switch (preset) {
+    case ResamplerPreset::Fast:
+      av_opt_set_int(swr, "filter_size", 8, 0);
+      av_opt_set_int(swr, "phase_shift", 6, 0);
+      av_opt_set_int(swr, "linear_interp", 1, 0);
+      break;
+    case ResamplerPreset::HighQuality:
+      av_opt_set(swr, "resampler", "soxr", 0);
+      av_opt_set_double(swr, "precision", 28, 0);
+      break;
+    default:
+      break;
+  }
+}
+
+// HighQuality without libsoxr
+void apply_hq_fallback(struct SwrContext* swr) {
+  av_opt_set(swr, "resampler", "swr", 0);
+  av_opt_set_int(swr, "filter_size", 64, 0);
+  av_opt_set_int(swr, "phase_shift", 14, 0);
+  av_opt_set_double(swr, "cutoff", 0.97, 0);
+}
+
+}
+
+bool AVTool::parse_resampler_preset(const char* name, ResamplerPreset& preset) {
+  if (!strcmp(name, "fast")) {
+    preset = ResamplerPreset::Fast;
+  } else if (!strcmp(name, "default")) {
+    preset = ResamplerPreset::Default;
+  } else if (!strcmp(name, "hq")) {
+    preset = ResamplerPreset::HighQuality;
+  } else {
+    return false;
+  }
+  return true;
+}
+
 SamplesBuffer::SamplesBuffer(int channels, int samples,
                              enum AVSampleFormat fmt) noexcept {
-  av_samples_alloc_array_and_samples(&buf_, NULL, channels, samples, fmt, 0);
+  if (av_samples_alloc_array_and_samples(&buf_, NULL, channels, samples, fmt, 0) >= 0) {
+    channels_ = channels;
+    samples_ = samples;
+    fmt_ = fmt;
+  }
+}
+
+SamplesBuffer::SamplesBuffer(SamplesArena& arena, int channels, int samples,
+                             enum AVSampleFormat fmt) noexcept {
+  int planes = av_sample_fmt_is_planar(fmt) ? channels : 1;
+  int bps = av_get_bytes_per_sample(fmt);
+  size_t plane_size = 0;
+  size_t mark = arena.mark();
+  uint8_t** buf = NULL;
+
+  // sanity check
+  if (channels <= 0 || samples <= 0 || bps <= 0) {
+    return;
+  }
+
+  plane_size = static_cast<size_t>(samples) * bps * (channels / planes);
+
+  buf = reinterpret_cast<uint8_t**>(arena.allocate(sizeof(uint8_t*) * planes));
+  if (!buf) {
+    return;
+  }
+  for (int i = 0; i < planes; i++) {
+    buf[i] = arena.allocate(plane_size);
+    if (!buf[i]) {
+      arena.rewind(mark);
+      return;
+    }
+  }
+
+  buf_ = buf;
+  channels_ = channels;
+  samples_ = samples;
+  fmt_ = fmt;
+  owned_ = false;
+}
+
+size_t SamplesBuffer::arena_size(int channels, int samples, enum AVSampleFormat fmt) {
+  int planes = av_sample_fmt_is_planar(fmt) ? channels : 1;
+  size_t bytes = static_cast<size_t>(samples) * av_get_bytes_per_sample(fmt) * channels;
+
+  return SamplesArena::footprint(sizeof(uint8_t*) * planes + bytes, planes + 1);
 }
 
 SamplesBuffer::SamplesBuffer(SamplesBuffer&& rhs) noexcept
-    : buf_(rhs.buf_) {
+    : buf_(rhs.buf_),
+      channels_(rhs.channels_),
+      samples_(rhs.samples_),
+      fmt_(rhs.fmt_),
+      owned_(rhs.owned_) {
   rhs.reset();
 }
 
@@ -24,6 +116,10 @@ SamplesBuffer& SamplesBuffer::operator=(SamplesBuffer&& rhs) noexcept {
     clean();
 
     buf_ = rhs.buf_;
+    channels_ = rhs.channels_;
+    samples_ = rhs.samples_;
+    fmt_ = rhs.fmt_;
+    owned_ = rhs.owned_;
 
     rhs.reset();
   }
@@ -43,7 +139,7 @@ uint8_t** SamplesBuffer::get() {
 }
 
 void SamplesBuffer::clean() {
-  if (buf_) {
+  if (buf_ && owned_) {
     if (buf_[0]) {
       av_freep(&buf_[0]);
     }
@@ -53,10 +149,106 @@ void SamplesBuffer::clean() {
 
 void SamplesBuffer::reset() {
   buf_ = NULL;
+  channels_ = 0;
+  samples_ = 0;
+  fmt_ = AV_SAMPLE_FMT_NONE;
+  owned_ = true;
+}
+
+FramePool::FramePool(enum AVSampleFormat fmt, const AVChannelLayout& chlayout, int sample_rate,
+                     int max_samples) noexcept
+    : fmt_(fmt),
+      sample_rate_(sample_rate),
+      max_samples_(max_samples) {
+  int size = 0;
+
+  // sanity check
+  if (max_samples <= 0 || (av_sample_fmt_is_planar(fmt) && chlayout.nb_channels > AV_NUM_DATA_POINTERS)) {
+    return;
+  }
+
+  if (av_channel_layout_copy(&chlayout_, &chlayout) < 0) {
+    return;
+  }
+
+  // all planes in one buffer, laid out for max_samples
+  size = av_samples_get_buffer_size(NULL, chlayout_.nb_channels, max_samples, fmt, 0);
+  if (size < 0) {
+    clean();
+    return;
+  }
+
+  pool_ = av_buffer_pool_init(size, NULL);
+  if (!pool_) {
+    clean();
+  }
+}
+
+FramePool::~FramePool() {
+  clean();
+}
+
+bool FramePool::operator!() const {
+  return !pool_;
+}
+
+int FramePool::get(AVFrame* frame, int nb_samples) {
+  int rc = 0;
+
+  // sanity check
+  if (!pool_ || !frame || nb_samples <= 0 || nb_samples > max_samples_) {
+    return -1;
+  }
+
+  av_frame_unref(frame);
+
+  frame->buf[0] = av_buffer_pool_get(pool_);
+  if (!frame->buf[0]) {
+    return -2;
+  }
+
+  // plane offsets as for max_samples, only nb_samples are used
+  rc = av_samples_fill_arrays(frame->data, frame->linesize, frame->buf[0]->data,
+                              chlayout_.nb_channels, max_samples_, fmt_, 0);
+  if (rc < 0) {
+    av_frame_unref(frame);
+    return -3;
+  }
+  frame->extended_data = frame->data;
+
+  rc = av_channel_layout_copy(&frame->ch_layout, &chlayout_);
+  if (rc < 0) {
+    av_frame_unref(frame);
+    return -4;
+  }
+  frame->format = fmt_;
+  frame->sample_rate = sample_rate_;
+  frame->nb_samples = nb_samples;
+
+  return 0;
+}
+
+AVFrame* FramePool::get(int nb_samples) {
+  AVFrame* frame = av_frame_alloc();
+
+  if (frame && get(frame, nb_samples) < 0) {
+    av_frame_free(&frame);
+  }
+
+  return frame;
+}
+
+void FramePool::clean() {
+  // buffers still out keep the pool alive until they come back
+  if (pool_) {
+    av_buffer_pool_uninit(&pool_);
+  }
+  av_channel_layout_uninit(&chlayout_);
 }
 
 Resampler::Resampler(enum AVSampleFormat in_sample_fmt,  const AVChannelLayout& in_chlayout,  int in_sample_rate,
-                     enum AVSampleFormat out_sample_fmt, const AVChannelLayout& out_chlayout, int out_sample_rate)
+                     enum AVSampleFormat out_sample_fmt, const AVChannelLayout& out_chlayout, int out_sample_rate,
+                     ResamplerPreset preset)
   noexcept
     : in_sample_fmt_(in_sample_fmt),
       in_channels_(in_chlayout.nb_channels),
@@ -64,6 +256,15 @@ Resampler::Resampler(enum AVSampleFormat in_sample_fmt,  const AVChannelLayout&
       out_sample_fmt_(out_sample_fmt),
       out_channels_(out_chlayout.nb_channels),
       out_sample_rate_(out_sample_rate) {
+  if (in_sample_rate == out_sample_rate
+      && av_channel_layout_compare(&in_chlayout, &out_chlayout) == 0) {
+    // nothing but a format change, no need for swr
+    convert_ = find_sample_converter(in_sample_fmt, out_sample_fmt);
+    if (convert_) {
+      return;
+    }
+  }
+
   // create resampler context
   swr_ = swr_alloc();
   if (!swr_) {
@@ -79,8 +280,45 @@ Resampler::Resampler(enum AVSampleFormat in_sample_fmt,  const AVChannelLayout&
   av_opt_set_chlayout(swr_, "out_chlayout", &out_chlayout, 0);
   av_opt_set_int(swr_, "out_sample_rate", out_sample_rate, 0);
 
+  apply_preset(swr_, preset);
+
   // initialize the resampling context
   if (swr_init(swr_) < 0) {
+    if (preset != ResamplerPreset::HighQuality) {
+      goto err_exit;
+    }
+    apply_hq_fallback(swr_);
+    if (swr_init(swr_) < 0) {
+      goto err_exit;
+    }
+  }
+
+  return;
+
+err_exit:
+  clean();
+}
+
+Resampler::Resampler(const Resampler& tmpl, bool)
+  noexcept
+    : in_sample_fmt_(tmpl.in_sample_fmt_),
+      in_channels_(tmpl.in_channels_),
+      in_sample_rate_(tmpl.in_sample_rate_),
+      out_sample_fmt_(tmpl.out_sample_fmt_),
+      out_channels_(tmpl.out_channels_),
+      out_sample_rate_(tmpl.out_sample_rate_),
+      convert_(tmpl.convert_) {
+  if (convert_ || !tmpl.swr_) {
+    return;
+  }
+
+  swr_ = swr_alloc();
+  if (!swr_) {
+    goto err_exit;
+  }
+
+  // formats, layouts, rates and the (resolved) preset in one go
+  if (av_opt_copy(swr_, tmpl.swr_) < 0 || swr_init(swr_) < 0) {
     goto err_exit;
   }
 
@@ -98,6 +336,7 @@ Resampler::Resampler(Resampler&& rhs) noexcept
       out_channels_(rhs.out_channels_),
       out_sample_rate_(rhs.out_sample_rate_),
       swr_(rhs.swr_),
+      convert_(rhs.convert_),
       audio_data_(rhs.audio_data_),
       max_samples_(rhs.max_samples_) {
   rhs.reset();
@@ -116,6 +355,7 @@ Resampler& Resampler::operator=(Resampler&& rhs) noexcept {
     out_sample_rate_ = rhs.out_sample_rate_;
 
     swr_ = rhs.swr_;
+    convert_ = rhs.convert_;
     audio_data_ = rhs.audio_data_;
     max_samples_ = rhs.max_samples_;
 
@@ -129,7 +369,7 @@ Resampler::~Resampler() {
 }
 
 bool Resampler::operator!() const {
-  return !swr_;
+  return !swr_ && !convert_;
 }
 
 int Resampler::resample(AVAudioFifo* af,
@@ -148,40 +388,22 @@ int Resampler::resample(AVAudioFifo* af,
   }
 
   // calculate max output samples
-  max_samples = swr_get_out_samples(swr_, nb_samples);
+  max_samples = max_out_samples(nb_samples);
   if (max_samples < 0) {
     return -1;
   } else if (max_samples == 0) {
     return 0;
   }
 
-  // realloc buffer
+  // grow buffer, doubling so it settles after a few calls
   if (max_samples_ < max_samples) {
-    if (audio_data_ && audio_data_[0]) {
-      av_freep(&audio_data_[0]);
-    }
-  }
-
-  if (!audio_data_ || !audio_data_[0]) {
-    int linesize = 0;
-    if (!audio_data_) {
-      rc = av_samples_alloc_array_and_samples(&audio_data_, &linesize,
-                                              out_channels_, max_samples,
-                                              out_sample_fmt_, 0);
-    } else {
-      rc = av_samples_alloc(&audio_data_[0], &linesize,
-                            out_channels_, max_samples, out_sample_fmt_, 0);
-    }
-    if (rc < 0) {
+    if (reserve(std::max(max_samples, 2 * max_samples_)) < 0) {
       return -2;
     }
-    max_samples_ = max_samples;
   }
 
   // resample
-  out_samples = swr_convert(swr_,
-                            audio_data_, max_samples,
-                            const_cast<const uint8_t**>(audio_data), nb_samples);
+  out_samples = resample(audio_data_, max_samples_, audio_data, nb_samples);
   if (out_samples < 0) {
     return -3;
   }
@@ -197,6 +419,148 @@ int Resampler::resample(AVAudioFifo* af,
   return out_samples;
 }
 
+int Resampler::resample(uint8_t* const* out, int out_samples,
+                        const uint8_t* const* audio_data, int nb_samples) {
+  int max_samples = 0;
+  int rc = 0;
+
+  // sanity check
+  if (!out || out_samples < 0 || nb_samples < 0) {
+    return INT_MIN;
+  }
+
+  if (!(*this)) {
+    return INT_MIN + 1;
+  }
+
+  max_samples = max_out_samples(nb_samples);
+  if (max_samples < 0) {
+    return -1;
+  } else if (max_samples == 0) {
+    return 0;
+  }
+
+  if (out_samples < max_samples) {
+    // buffer too short
+    return -2;
+  }
+
+  if (convert_) {
+    // no filter, nothing delayed, flushing is a no-op
+    if (audio_data) {
+      convert_(out, audio_data, out_channels_, nb_samples);
+    }
+    return audio_data ? nb_samples : 0;
+  }
+
+  rc = swr_convert(swr_,
+                   const_cast<uint8_t**>(out), out_samples,
+                   const_cast<const uint8_t**>(audio_data), nb_samples);
+  if (rc < 0) {
+    return -3;
+  }
+
+  return rc;
+}
+
+int Resampler::resample(SamplesBuffer& out,
+                        const uint8_t* const* audio_data, int nb_samples) {
+  if (!out || out.format() != out_sample_fmt_ || out.channels() != out_channels_) {
+    return -2;
+  }
+
+  return resample(out.get(), out.samples(), audio_data, nb_samples);
+}
+
+int Resampler::resample(AVFrame* frame,
+                        const uint8_t* const* audio_data, int nb_samples) {
+  int rc = 0;
+
+  // sanity check
+  if (!frame || !frame->extended_data) {
+    return INT_MIN;
+  }
+
+  if (frame->format != out_sample_fmt_ || frame->ch_layout.nb_channels != out_channels_) {
+    return -2;
+  }
+
+  if (av_frame_make_writable(frame) < 0) {
+    return -4;
+  }
+
+  rc = resample(frame->extended_data, frame->nb_samples, audio_data, nb_samples);
+  if (rc >= 0) {
+    frame->nb_samples = rc;
+  }
+
+  return rc;
+}
+
+int Resampler::max_out_samples(int nb_samples) const {
+  if (!(*this)) {
+    return INT_MIN + 1;
+  }
+
+  if (convert_) {
+    return nb_samples;
+  }
+
+  return swr_get_out_samples(swr_, nb_samples);
+}
+
+int Resampler::reserve(int max_samples) {
+  int linesize = 0;
+  int rc = 0;
+
+  if (!(*this)) {
+    return INT_MIN + 1;
+  }
+
+  if (audio_data_ && audio_data_[0] && max_samples <= max_samples_) {
+    return 0;
+  }
+
+  if (audio_data_ && audio_data_[0]) {
+    av_freep(&audio_data_[0]);
+  }
+  max_samples_ = 0;
+
+  if (!audio_data_) {
+    rc = av_samples_alloc_array_and_samples(&audio_data_, &linesize,
+                                            out_channels_, max_samples,
+                                            out_sample_fmt_, 0);
+  } else {
+    rc = av_samples_alloc(&audio_data_[0], &linesize,
+                          out_channels_, max_samples, out_sample_fmt_, 0);
+  }
+  if (rc < 0) {
+    return -1;
+  }
+  max_samples_ = max_samples;
+
+  return 0;
+}
+
+int Resampler::restart() {
+  if (!(*this)) {
+    return INT_MIN + 1;
+  }
+
+  if (convert_) {
+    // stateless
+    return 0;
+  }
+
+  swr_close(swr_);
+
+  return (swr_init(swr_) < 0) ? -1 : 0;
+}
+
+std::unique_ptr<Resampler> Resampler::clone() const {
+  return std::unique_ptr<Resampler>(new(std::nothrow) Resampler(*this, true));
+}
+
 void Resampler::clean() {
   if (swr_) {
     swr_free(&swr_);
@@ -211,5 +575,98 @@ void Resampler::clean() {
 
 void Resampler::reset() {
   swr_ = NULL;
+  convert_ = NULL;
   audio_data_ = NULL;
 }
+
+struct ResamplerCache::Entry {
+  std::unique_ptr<Resampler> tmpl;  // never handed out
+  std::vector<std::unique_ptr<Resampler>> idle;
+};
+
+void ResamplerCache::Recycler::operator()(Resampler* r) const {
+  if (cache) {
+    cache->recycle(entry, r);
+  } else {
+    delete r;
+  }
+}
+
+ResamplerCache::ResamplerCache(int max_idle)
+    : max_idle_(max_idle) { }
+
+ResamplerCache::~ResamplerCache() = default;
+
+ResamplerCache& ResamplerCache::shared() {
+  static ResamplerCache cache;
+  return cache;
+}
+
+ResamplerCache::Handle ResamplerCache::acquire(enum AVSampleFormat in_sample_fmt,  const AVChannelLayout& in_chlayout,  int in_sample_rate,
+                                               enum AVSampleFormat out_sample_fmt, const AVChannelLayout& out_chlayout, int out_sample_rate,
+                                               ResamplerPreset preset) {
+  std::unique_ptr<Resampler> r;
+  Entry* entry = NULL;
+
+  if (in_chlayout.order != AV_CHANNEL_ORDER_NATIVE || out_chlayout.order != AV_CHANNEL_ORDER_NATIVE) {
+    // custom layouts do not fit in a key, not cached
+    r.reset(new(std::nothrow) Resampler(in_sample_fmt, in_chlayout, in_sample_rate,
+                                        out_sample_fmt, out_chlayout, out_sample_rate, preset));
+    if (!r || !(*r)) {
+      return Handle();
+    }
+    return Handle(r.release(), Recycler());
+  }
+
+  std::vector<int64_t> key = {
+    in_sample_fmt, in_chlayout.nb_channels, static_cast<int64_t>(in_chlayout.u.mask), in_sample_rate,
+    out_sample_fmt, out_chlayout.nb_channels, static_cast<int64_t>(out_chlayout.u.mask), out_sample_rate,
+    static_cast<int64_t>(preset)
+  };
+
+  {
+    std::lock_guard<std::mutex> lk(mtx_);
+    std::unique_ptr<Entry>& slot = entries_[key];
+    if (!slot) {
+      slot.reset(new Entry);
+    }
+    entry = slot.get();
+
+    if (!entry->idle.empty()) {
+      r = std::move(entry->idle.back());
+      entry->idle.pop_back();
+      return Handle(r.release(), Recycler{this, entry});
+    }
+
+    if (!entry->tmpl) {
+      // first use of this conversion, parse and validate the options once
+      entry->tmpl.reset(new(std::nothrow) Resampler(in_sample_fmt, in_chlayout, in_sample_rate,
+                                                    out_sample_fmt, out_chlayout, out_sample_rate, preset));
+      if (!entry->tmpl || !(*entry->tmpl)) {
+        entry->tmpl.reset();
+        return Handle();
+      }
+    }
+  }
+
+  // the template is immutable once set, clone outside the lock
+  r = entry->tmpl->clone();
+  if (!r || !(*r)) {
+    return Handle();
+  }
+
+  return Handle(r.release(), Recycler{this, entry});
+}
+
+void ResamplerCache::recycle(Entry* entry, Resampler* r) {
+  std::unique_ptr<Resampler> owned(r);
+
+  if (owned->restart() < 0) {
+    return;
+  }
+
+  std::lock_guard<std::mutex> lk(mtx_);
+  if (static_cast<int>(entry->idle.size()) < max_idle_) {
+    entry->idle.push_back(std::move(owned));
+  }
+}
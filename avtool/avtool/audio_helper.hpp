@@ -8,12 +8,25 @@
 #ifndef audio_helper_hpp
 #define audio_helper_hpp
 
+#include <algorithm>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <span>
+#include <stdexcept>
+#include <vector>
+
 extern "C" {
 #include <libavutil/audio_fifo.h>
+#include <libavutil/buffer.h>
+#include <libavutil/frame.h>
 #include <libavutil/opt.h>
 #include <libswresample/swresample.h>
 }
 
+#include "sample_convert.hpp"
+#include "samples_arena.hpp"
+
 namespace AVTool {
 
 class SamplesBuffer {
@@ -23,6 +36,13 @@ class SamplesBuffer {
 
   SamplesBuffer(int channels, int samples, enum AVSampleFormat fmt) noexcept;
 
+  // carved out of |arena|, planes 64-byte aligned, no heap call.
+  // the arena must outlive the buffer
+  SamplesBuffer(SamplesArena& arena, int channels, int samples, enum AVSampleFormat fmt) noexcept;
+
+  // arena bytes taken by the constructor above
+  static size_t arena_size(int channels, int samples, enum AVSampleFormat fmt);
+
   SamplesBuffer(SamplesBuffer&& rhs) noexcept;
 
   SamplesBuffer& operator=(SamplesBuffer&& rhs) noexcept;
@@ -33,6 +53,13 @@ class SamplesBuffer {
 
   uint8_t** get();
 
+  int channels() const { return channels_; }
+
+  // capacity, per channel
+  int samples() const { return samples_; }
+
+  enum AVSampleFormat format() const { return fmt_; }
+
  protected:
   void clean();
 
@@ -40,15 +67,158 @@ class SamplesBuffer {
 
  private:
   uint8_t** buf_ = NULL;
+  int channels_ = 0;
+  int samples_ = 0;
+  enum AVSampleFormat fmt_ = AV_SAMPLE_FMT_NONE;
+  bool owned_ = true;  // false if carved from an arena
+};
+
+template <typename T> struct SampleFormatOf;
+
+template <> struct SampleFormatOf<int16_t> {
+  static constexpr enum AVSampleFormat packed = AV_SAMPLE_FMT_S16;
+  static constexpr enum AVSampleFormat planar = AV_SAMPLE_FMT_S16P;
+};
+
+template <> struct SampleFormatOf<int32_t> {
+  static constexpr enum AVSampleFormat packed = AV_SAMPLE_FMT_S32;
+  static constexpr enum AVSampleFormat planar = AV_SAMPLE_FMT_S32P;
+};
+
+template <> struct SampleFormatOf<float> {
+  static constexpr enum AVSampleFormat packed = AV_SAMPLE_FMT_FLT;
+  static constexpr enum AVSampleFormat planar = AV_SAMPLE_FMT_FLTP;
+};
+
+// Typed, non-owning view of planar (one span per channel) or interleaved
+// samples. Spans are sized to the view, at() throws std::out_of_range.
+template <typename T, bool Planar>
+class SampleView {
+ public:
+  static constexpr enum AVSampleFormat format = Planar ? SampleFormatOf<T>::planar
+                                                       : SampleFormatOf<T>::packed;
+
+  SampleView() = default;
+
+  SampleView(uint8_t* const* data, int channels, int samples)
+      : data_(data), channels_(channels), samples_(samples) { }
+
+  // empty view if |buf| holds another format
+  explicit SampleView(SamplesBuffer& buf) {
+    if (!buf || buf.format() != format) {
+      return;
+    }
+    data_ = buf.get();
+    channels_ = buf.channels();
+    samples_ = buf.samples();
+  }
+
+  bool empty() const { return !data_ || channels_ <= 0 || samples_ <= 0; }
+
+  int channels() const { return channels_; }
+
+  int samples() const { return samples_; }
+
+  // planar: the samples of channel |ch|, empty if out of range
+  std::span<T> channel(int ch) const requires Planar {
+    if (empty() || ch < 0 || ch >= channels_) {
+      return std::span<T>();
+    }
+    return std::span<T>(reinterpret_cast<T*>(data_[ch]), static_cast<size_t>(samples_));
+  }
+
+  // interleaved: all channels, frame after frame
+  std::span<T> frames() const requires (!Planar) {
+    if (empty()) {
+      return std::span<T>();
+    }
+    return std::span<T>(reinterpret_cast<T*>(data_[0]), static_cast<size_t>(samples_) * channels_);
+  }
+
+  T& at(int ch, int i) const {
+    if (empty() || ch < 0 || ch >= channels_ || i < 0 || i >= samples_) {
+      throw std::out_of_range("SampleView::at");
+    }
+    return Planar ? reinterpret_cast<T*>(data_[ch])[i]
+                  : reinterpret_cast<T*>(data_[0])[static_cast<size_t>(i) * channels_ + ch];
+  }
+
+  // the first |n| samples, e.g. what a stage actually produced
+  SampleView first(int n) const {
+    return SampleView(data_, channels_, std::clamp(n, 0, samples_));
+  }
+
+  // for FFmpeg / libopus / RubberBand style APIs
+  T* const* planes() const { return reinterpret_cast<T* const*>(data_); }
+
+  uint8_t* const* data() const { return data_; }
+
+ private:
+  uint8_t* const* data_ = NULL;
+  int channels_ = 0;
+  int samples_ = 0;
+};
+
+typedef SampleView<float, true> FloatPlanes;
+typedef SampleView<int16_t, false> S16Frames;
+
+// Refcounted audio frames backed by an av_buffer_pool. A frame filled in
+// place can be handed to avcodec_send_frame(), which only takes a reference,
+// and its buffer goes back to the pool when the last reference is dropped:
+// no copy, and no allocation once the pool is warm.
+class FramePool {
+ public:
+  FramePool(const FramePool&) = delete;
+  FramePool& operator=(const FramePool&) = delete;
+
+  FramePool(enum AVSampleFormat fmt, const AVChannelLayout& chlayout, int sample_rate,
+            int max_samples) noexcept;
+
+  virtual ~FramePool();
+
+  bool operator!() const;
+
+  // unrefs |frame| and attaches a pooled buffer for |nb_samples| (at most
+  // max_samples()), format / layout / rate set. < 0 on error
+  int get(AVFrame* frame, int nb_samples);
+
+  // same on a new frame, NULL on error. av_frame_free() recycles it
+  AVFrame* get(int nb_samples);
+
+  int max_samples() const { return max_samples_; }
+
+ protected:
+  void clean();
+
+ private:
+  enum AVSampleFormat fmt_;
+  AVChannelLayout chlayout_ = {};
+  int sample_rate_;
+  int max_samples_;
+
+  AVBufferPool* pool_ = NULL;
+};
+
+enum class ResamplerPreset {
+  Fast,         // short filter, few phases, linear interpolation
+  Default,      // swresample defaults
+  HighQuality,  // soxr if available, otherwise a long swr filter
 };
 
+// "fast", "default" or "hq", returns false if unknown
+bool parse_resampler_preset(const char* name, ResamplerPreset& preset);
+
+// swresample wrapper. A pure sample format change (same rate and layout)
+// between S16/S32/FLT skips swr entirely and runs a SIMD kernel instead,
+// see find_sample_converter().
 class Resampler {
  public:
   Resampler(const Resampler&) = delete;
   Resampler& operator=(const Resampler&) = delete;
 
   Resampler(enum AVSampleFormat in_sample_fmt,  const AVChannelLayout& in_chlayout,  int in_sample_rate,
-            enum AVSampleFormat out_sample_fmt, const AVChannelLayout& out_chlayout, int out_sample_rate) noexcept;
+            enum AVSampleFormat out_sample_fmt, const AVChannelLayout& out_chlayout, int out_sample_rate,
+            ResamplerPreset preset = ResamplerPreset::Default) noexcept;
 
   Resampler(Resampler&& rhs) noexcept;
 
@@ -58,14 +228,53 @@ class Resampler {
 
   bool operator!() const;
 
+  // converts through the internal scratch buffer and appends to |af|,
+  // for callers that need to re-frame the output
   int resample(AVAudioFifo* af, const uint8_t* const* audio_data, int nb_samples);
 
+  // zero-copy variants, convert straight into the caller's buffer.
+  // returns the converted samples, -2 if the buffer could be too short
+  // (see max_out_samples()) or does not match the output format
+  int resample(uint8_t* const* out, int out_samples, const uint8_t* const* audio_data, int nb_samples);
+
+  int resample(SamplesBuffer& out, const uint8_t* const* audio_data, int nb_samples);
+
+  // |frame| must have its buffers allocated in the output format,
+  // nb_samples is the capacity on input and the converted count on return
+  int resample(AVFrame* frame, const uint8_t* const* audio_data, int nb_samples);
+
+  // flush the samples still delayed in the filter at end of stream
+  int drain(AVAudioFifo* af) { return resample(af, NULL, 0); }
+
+  int drain(SamplesBuffer& out) { return resample(out, NULL, 0); }
+
+  int drain(AVFrame* frame) { return resample(frame, NULL, 0); }
+
+  // upper bound of the output for |nb_samples| more input, < 0 on error
+  int max_out_samples(int nb_samples) const;
+
+  // size the scratch buffer of the FIFO variant up front, it otherwise
+  // grows (geometrically) on demand
+  int reserve(int max_samples);
+
+  // true if no swr context is involved, see find_sample_converter()
+  bool is_passthrough() const { return convert_ != NULL; }
+
+  // drop buffered samples and filter history, e.g. before a new stream
+  int restart();
+
+  // same conversion and options on a fresh context, without parsing the
+  // options again. check the result with operator!
+  std::unique_ptr<Resampler> clone() const;
+
  protected:
   void clean();
 
   void reset();
 
  private:
+  Resampler(const Resampler& tmpl, bool) noexcept;
+
   enum AVSampleFormat in_sample_fmt_;
   int in_channels_;
   int in_sample_rate_;
@@ -75,10 +284,55 @@ class Resampler {
   int out_sample_rate_;
 
   struct SwrContext* swr_ = NULL;
+  SampleConvertFn convert_ = NULL;
   uint8_t** audio_data_ = NULL;
   int max_samples_ = 0;
 };
 
+// Hands out initialised Resamplers per (formats, layouts, rates, preset).
+// The first request for a conversion configures a template that later ones
+// are cloned from, and released resamplers are restarted and kept for the
+// next request: swr_init() keeps the filter bank of a context whose
+// parameters did not change, so recycled ones skip the filter-table setup.
+class ResamplerCache {
+ public:
+  struct Entry;
+
+  // returns the resampler to its entry instead of deleting it
+  struct Recycler {
+    ResamplerCache* cache = NULL;
+    Entry* entry = NULL;
+
+    void operator()(Resampler* r) const;
+  };
+
+  typedef std::unique_ptr<Resampler, Recycler> Handle;
+
+  static constexpr int default_max_idle = 16;
+
+  ResamplerCache(const ResamplerCache&) = delete;
+  ResamplerCache& operator=(const ResamplerCache&) = delete;
+
+  explicit ResamplerCache(int max_idle = default_max_idle);
+
+  virtual ~ResamplerCache();
+
+  // process wide instance
+  static ResamplerCache& shared();
+
+  // thread safe, empty handle on failure
+  Handle acquire(enum AVSampleFormat in_sample_fmt,  const AVChannelLayout& in_chlayout,  int in_sample_rate,
+                 enum AVSampleFormat out_sample_fmt, const AVChannelLayout& out_chlayout, int out_sample_rate,
+                 ResamplerPreset preset = ResamplerPreset::Default);
+
+ private:
+  void recycle(Entry* entry, Resampler* r);
+
+  int max_idle_;
+  std::mutex mtx_;
+  std::map<std::vector<int64_t>, std::unique_ptr<Entry>> entries_;
+};
+
 }
 
 #endif /* audio_helper_hpp */
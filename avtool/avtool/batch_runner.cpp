@@ -0,0 +1,116 @@
+//
+//  batch_runner.cpp
+//  avtool
+//
+//  Created by zhanwang-sky on 2023/11/20.
+//
+
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <glob.h>
+#include "batch_runner.hpp"
+#include "work_pool.hpp"
+
+using namespace AVTool;
+
+double BatchReport::packets_per_sec() const {
+  return (wall_secs > 0) ? stats.packets / wall_secs : 0;
+}
+
+double BatchReport::realtime_factor(int sample_rate) const {
+  return (wall_secs > 0 && sample_rate > 0)
+         ? (static_cast<double>(stats.samples) / sample_rate) / wall_secs : 0;
+}
+
+int AVTool::load_batch_jobs(const std::string& source, const std::string& out_ext,
+                            std::vector<BatchJob>& jobs) {
+  if (source.find_first_of("*?[") != std::string::npos) {
+    glob_t g;
+    if (glob(source.c_str(), 0, NULL, &g) != 0) {
+      globfree(&g);
+      return 0;
+    }
+    for (size_t i = 0; i < g.gl_pathc; i++) {
+      std::string input = g.gl_pathv[i];
+      size_t slash = input.find_last_of('/');
+      size_t dot = input.find_last_of('.');
+      std::string stem = (dot != std::string::npos && (slash == std::string::npos || dot > slash))
+                         ? input.substr(0, dot) : input;
+      jobs.push_back({input, stem + "." + out_ext});
+    }
+    globfree(&g);
+    return static_cast<int>(jobs.size());
+  }
+
+  std::ifstream manifest(source);
+  if (!manifest) {
+    return -1;
+  }
+
+  std::string line;
+  while (std::getline(manifest, line)) {
+    size_t hash = line.find('#');
+    if (hash != std::string::npos) {
+      line.resize(hash);
+    }
+    std::istringstream iss(line);
+    BatchJob job;
+    if (iss >> job.input >> job.output) {
+      jobs.push_back(job);
+    }
+  }
+
+  return static_cast<int>(jobs.size());
+}
+
+BatchReport AVTool::run_batch(const std::vector<BatchJob>& jobs, const BatchConfig& cfg) {
+  BatchReport report;
+  std::mutex mtx;
+  av_opus_pool_t* opus_pool = NULL;
+  auto start = std::chrono::steady_clock::now();
+
+  {
+    WorkPool pool(cfg.nr_workers, cfg.pin_cpus);
+    // one transcoder per worker, created lazily on the worker itself
+    std::vector<std::unique_ptr<Transcoder>> transcoders(pool.size());
+
+    // their decoders side by side in one allocation. NULL: each allocates its own
+    opus_pool = av_opus_pool_create(pool.size(), Transcoder::decode_rate(cfg.sample_rate), cfg.channels);
+
+    for (const BatchJob& job : jobs) {
+      pool.submit([&, job](int worker) {
+        TranscodeStats stats;
+        bool ok = true;
+
+        try {
+          if (!transcoders[worker]) {
+            transcoders[worker].reset(new Transcoder(cfg.sample_rate, cfg.channels, cfg.resample_preset,
+                                                     opus_pool));
+          }
+          stats = transcoders[worker]->run(job.input, job.output, cfg.opts);
+        } catch (std::exception& e) {
+          std::lock_guard<std::mutex> lk(mtx);
+          std::cerr << "Error: '" << job.input << "': " << e.what() << "\n";
+          ok = false;
+        }
+
+        std::lock_guard<std::mutex> lk(mtx);
+        report.jobs++;
+        report.failed += ok ? 0 : 1;
+        report.stats += stats;
+      });
+    }
+
+    pool.wait();
+  }
+  // every context is back
+  av_opus_pool_destroy(opus_pool);
+
+  report.wall_secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+  return report;
+}
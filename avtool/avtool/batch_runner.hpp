@@ -0,0 +1,55 @@
+//
+//  batch_runner.hpp
+//  avtool
+//
+//  Created by zhanwang-sky on 2023/11/20.
+//
+
+#ifndef batch_runner_hpp
+#define batch_runner_hpp
+
+#include <string>
+#include <vector>
+
+#include "transcoder.hpp"
+
+namespace AVTool {
+
+struct BatchJob {
+  std::string input;
+  std::string output;
+};
+
+struct BatchConfig {
+  int sample_rate = 16000;
+  int channels = 1;
+  int nr_workers = 0;  // 0: one per hardware thread
+  bool pin_cpus = false;
+  ResamplerPreset resample_preset = ResamplerPreset::Default;
+  TranscodeOptions opts;
+};
+
+struct BatchReport {
+  int jobs = 0;
+  int failed = 0;
+  double wall_secs = 0;
+  TranscodeStats stats;
+
+  double packets_per_sec() const;
+
+  // seconds of audio decoded per wall-clock second
+  double realtime_factor(int sample_rate) const;
+};
+
+// |source| is either a manifest (one "input output" pair per line, '#' starts
+// a comment) or, if it contains a wildcard, a glob of dumps whose outputs are
+// named after the input with the extension replaced by |out_ext|.
+// returns < 0 if the manifest cannot be read
+int load_batch_jobs(const std::string& source, const std::string& out_ext,
+                    std::vector<BatchJob>& jobs);
+
+BatchReport run_batch(const std::vector<BatchJob>& jobs, const BatchConfig& cfg);
+
+}
+
+#endif /* batch_runner_hpp */
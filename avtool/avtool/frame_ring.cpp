@@ -0,0 +1,149 @@
+//
+//  frame_ring.cpp
+//  avtool
+//
+//  Created by zhanwang-sky on 2023/11/24.
+//
+
+#include <algorithm>
+#include "frame_ring.hpp"
+
+using namespace AVTool;
+
+FrameRing::FrameRing(int capacity) noexcept {
+  uint64_t size = 1;
+
+  while (size < static_cast<uint64_t>(std::max(capacity, 1))) {
+    size <<= 1;
+  }
+
+  try {
+    slots_.resize(size, NULL);
+  } catch (...) {
+    return;
+  }
+
+  mask_ = size - 1;
+}
+
+FrameRing::~FrameRing() {
+  uint64_t w = write_pos_.load(std::memory_order_acquire);
+
+  for (uint64_t r = read_pos_.load(std::memory_order_acquire); r != w; r++) {
+    av_frame_free(&slots_[r & mask_]);
+  }
+}
+
+bool FrameRing::operator!() const {
+  return slots_.empty();
+}
+
+int FrameRing::write_begin(int n, AVFrame**& slots) {
+  uint64_t w = write_pos_.load(std::memory_order_relaxed);
+  uint64_t size = mask_ + 1;
+  uint64_t off = w & mask_;
+
+  if (slots_.empty() || n <= 0) {
+    return 0;
+  }
+
+  if (size - (w - cached_read_) < static_cast<uint64_t>(n)) {
+    // only touch the consumer's line when the cached index runs short
+    cached_read_ = read_pos_.load(std::memory_order_acquire);
+  }
+
+  slots = &slots_[off];
+  return static_cast<int>(std::min({size - (w - cached_read_), size - off, static_cast<uint64_t>(n)}));
+}
+
+void FrameRing::write_commit(int n) {
+  write_pos_.store(write_pos_.load(std::memory_order_relaxed) + n, std::memory_order_release);
+  write_event_.fetch_add(1, std::memory_order_release);
+  write_event_.notify_one();
+}
+
+bool FrameRing::push(AVFrame* frame) {
+  AVFrame** slot = NULL;
+
+  if (write_begin(1, slot) < 1) {
+    return false;
+  }
+
+  *slot = frame;
+  write_commit(1);
+
+  return true;
+}
+
+bool FrameRing::wait_for_write() {
+  while (true) {
+    // read the event first, a pop in between changes it and wait() returns
+    uint32_t ev = read_event_.load(std::memory_order_acquire);
+    if (aborted()) {
+      return false;
+    }
+    cached_read_ = read_pos_.load(std::memory_order_acquire);
+    if (write_pos_.load(std::memory_order_relaxed) - cached_read_ <= mask_) {
+      return true;
+    }
+    read_event_.wait(ev, std::memory_order_acquire);
+  }
+}
+
+int FrameRing::read_begin(int n, AVFrame**& slots) {
+  uint64_t r = read_pos_.load(std::memory_order_relaxed);
+  uint64_t off = r & mask_;
+
+  if (slots_.empty() || n <= 0) {
+    return 0;
+  }
+
+  if (cached_write_ - r < static_cast<uint64_t>(n)) {
+    cached_write_ = write_pos_.load(std::memory_order_acquire);
+  }
+
+  slots = &slots_[off];
+  return static_cast<int>(std::min({cached_write_ - r, mask_ + 1 - off, static_cast<uint64_t>(n)}));
+}
+
+void FrameRing::read_commit(int n) {
+  read_pos_.store(read_pos_.load(std::memory_order_relaxed) + n, std::memory_order_release);
+  read_event_.fetch_add(1, std::memory_order_release);
+  read_event_.notify_one();
+}
+
+bool FrameRing::pop(AVFrame*& frame) {
+  AVFrame** slot = NULL;
+
+  if (read_begin(1, slot) < 1) {
+    return false;
+  }
+
+  frame = *slot;
+  *slot = NULL;
+  read_commit(1);
+
+  return true;
+}
+
+bool FrameRing::wait_for_read() {
+  while (true) {
+    uint32_t ev = write_event_.load(std::memory_order_acquire);
+    if (aborted()) {
+      return false;
+    }
+    cached_write_ = write_pos_.load(std::memory_order_acquire);
+    if (cached_write_ != read_pos_.load(std::memory_order_relaxed)) {
+      return true;
+    }
+    write_event_.wait(ev, std::memory_order_acquire);
+  }
+}
+
+void FrameRing::abort() {
+  aborted_.store(true, std::memory_order_release);
+  write_event_.fetch_add(1, std::memory_order_release);
+  write_event_.notify_all();
+  read_event_.fetch_add(1, std::memory_order_release);
+  read_event_.notify_all();
+}
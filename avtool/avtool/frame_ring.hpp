@@ -0,0 +1,99 @@
+//
+//  frame_ring.hpp
+//  avtool
+//
+//  Created by zhanwang-sky on 2023/11/24.
+//
+
+#ifndef frame_ring_hpp
+#define frame_ring_hpp
+
+#include <atomic>
+#include <cstdint>
+#include <vector>
+
+extern "C" {
+#include <libavutil/frame.h>
+}
+
+namespace AVTool {
+
+// Single-producer / single-consumer ring of AVFrame references, the blocks
+// themselves are never copied. Either side reserves a contiguous run of
+// slots, fills / takes them in place and commits, push() / pop() do that
+// for one. All of it is wait-free (one acquire load of the other side's
+// index when the cached one is exhausted, one release store per commit);
+// wait_for_write() / wait_for_read() block on a futex-backed atomic for
+// back-pressure. NULL is a valid entry, e.g. an end of stream marker.
+class FrameRing {
+ public:
+  // Apple silicon has 128-byte lines, x86 prefetches pairs of 64
+  static constexpr size_t cache_line = 128;
+
+  FrameRing(const FrameRing&) = delete;
+  FrameRing& operator=(const FrameRing&) = delete;
+
+  // |capacity| is rounded up to a power of 2
+  explicit FrameRing(int capacity) noexcept;
+
+  // frees what is still queued, both sides must be done
+  virtual ~FrameRing();
+
+  bool operator!() const;
+
+  int capacity() const { return static_cast<int>(mask_ + 1); }
+
+  // producer: up to |n| free slots from |slots| on, contiguous, maybe
+  // fewer (ring end) or none. returns how many
+  int write_begin(int n, AVFrame**& slots);
+
+  // producer: the first |n| reserved slots are filled, the ring owns them
+  void write_commit(int n);
+
+  // producer: queues |frame| and takes ownership, false if full
+  bool push(AVFrame* frame);
+
+  // producer: block until there is room, false if aborted
+  bool wait_for_write();
+
+  // consumer: up to |n| queued entries from |slots| on, oldest first,
+  // contiguous, maybe fewer or none. returns how many
+  int read_begin(int n, AVFrame**& slots);
+
+  // consumer: the first |n| reserved entries are taken, ownership went to
+  // the caller
+  void read_commit(int n);
+
+  // consumer: the oldest entry, ownership goes to the caller. false if empty
+  bool pop(AVFrame*& frame);
+
+  // consumer: block until there is an entry, false if aborted
+  bool wait_for_read();
+
+  // either side: wakes and fails both, queued entries are left for the
+  // destructor
+  void abort();
+
+  bool aborted() const { return aborted_.load(std::memory_order_acquire); }
+
+ private:
+  uint64_t mask_ = 0;
+  std::vector<AVFrame*> slots_;
+
+  // producer side
+  alignas(cache_line) std::atomic<uint64_t> write_pos_{0};
+  uint64_t cached_read_ = 0;
+
+  // consumer side
+  alignas(cache_line) std::atomic<uint64_t> read_pos_{0};
+  uint64_t cached_write_ = 0;
+
+  // bumped on every push / pop / abort, waited on
+  alignas(cache_line) std::atomic<uint32_t> write_event_{0};
+  alignas(cache_line) std::atomic<uint32_t> read_event_{0};
+  std::atomic<bool> aborted_{false};
+};
+
+}
+
+#endif /* frame_ring_hpp */
@@ -0,0 +1,43 @@
+//
+//  log_limiter.cpp
+//  avtool
+//
+//  Created by zhanwang-sky on 2023/11/27.
+//
+
+#include <algorithm>
+#include "log_limiter.hpp"
+
+using namespace AVTool;
+
+LogLimiter::LogLimiter(int rate)
+    : rate_(std::max(rate, 1)),
+      tokens_(rate_),
+      last_(std::chrono::steady_clock::now()) { }
+
+bool LogLimiter::allow() {
+  auto now = std::chrono::steady_clock::now();
+
+  tokens_ = std::min<double>(rate_, tokens_ + std::chrono::duration<double>(now - last_).count() * rate_);
+  last_ = now;
+
+  if (tokens_ < 1) {
+    suppressed_++;
+    return false;
+  }
+  tokens_ -= 1;
+
+  return true;
+}
+
+uint64_t LogLimiter::take_suppressed() {
+  uint64_t n = suppressed_;
+  suppressed_ = 0;
+  return n;
+}
+
+void LogLimiter::reset() {
+  tokens_ = rate_;
+  last_ = std::chrono::steady_clock::now();
+  suppressed_ = 0;
+}
@@ -0,0 +1,45 @@
+//
+//  log_limiter.hpp
+//  avtool
+//
+//  Created by zhanwang-sky on 2023/11/27.
+//
+
+#ifndef log_limiter_hpp
+#define log_limiter_hpp
+
+#include <chrono>
+#include <cstdint>
+
+namespace AVTool {
+
+enum class LogLevel {
+  Quiet,
+  Info,   // one line per run
+  Debug,  // per packet, rate limited
+};
+
+// Token bucket for chatty log lines: up to |rate| lines per second, bursts
+// of as many. What does not fit is counted, not printed.
+class LogLimiter {
+ public:
+  explicit LogLimiter(int rate = 50);
+
+  // true if a line may go out now
+  bool allow();
+
+  // lines refused since the last call
+  uint64_t take_suppressed();
+
+  void reset();
+
+ private:
+  int rate_;
+  double tokens_;
+  std::chrono::steady_clock::time_point last_;
+  uint64_t suppressed_ = 0;
+};
+
+}
+
+#endif /* log_limiter_hpp */
@@ -5,10 +5,22 @@
 //  Created by zhanwang-sky on 2023/11/26.
 //
 
+#include <climits>
+#include <cmath>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <iomanip>
 #include <new>
 #include <sstream>
 #include <stdexcept>
+#include <thread>
+#include <unistd.h>
 #include "media_dumper.hpp"
+#include "metrics.hpp"
 
 #define check_exit(rc, ecode) \
 do { \
@@ -20,31 +32,218 @@ do { \
 
 using namespace AVTool;
 
+namespace {
+
+// the input format if the encoder takes it, else its planar / packed
+// twin (a plain interleave), else the encoder's first choice
+enum AVSampleFormat native_sample_fmt(const AVCodec* codec, enum AVSampleFormat in_fmt) {
+  enum AVSampleFormat twin = av_sample_fmt_is_planar(in_fmt)
+                             ? av_get_packed_sample_fmt(in_fmt) : av_get_planar_sample_fmt(in_fmt);
+  const enum AVSampleFormat* p = codec->sample_fmts;
+
+  if (!p) {
+    return AV_SAMPLE_FMT_FLTP;
+  }
+
+  for (; *p != AV_SAMPLE_FMT_NONE; p++) {
+    if (*p == in_fmt) {
+      return in_fmt;
+    }
+  }
+
+  for (p = codec->sample_fmts; *p != AV_SAMPLE_FMT_NONE; p++) {
+    if (*p == twin) {
+      return twin;
+    }
+  }
+
+  return codec->sample_fmts[0];
+}
+
+bool parse_int(const std::string& str, int64_t& val) {
+  char* end = NULL;
+  double d = strtod(str.c_str(), &end);
+
+  if (end == str.c_str()) {
+    return false;
+  }
+  if (*end == 'k' || *end == 'K') {
+    d *= 1000;
+    end++;
+  } else if (*end == 'M') {
+    d *= 1000000;
+    end++;
+  }
+  if (*end != '\0' || !(std::fabs(d) < 1e15)) {
+    return false;
+  }
+  val = std::llround(d);
+
+  return true;
+}
+
+void append_opt(std::string& opts, const std::string& key, const std::string& value) {
+  if (!opts.empty()) {
+    opts += ':';
+  }
+  opts += key + '=' + value;
+}
+
+}
+
+bool AVTool::parse_encoder_options(const char* spec, EncoderOptions& opts) {
+  std::istringstream iss(spec);
+  std::string item;
+
+  while (std::getline(iss, item, ':')) {
+    size_t eq = item.find('=');
+    std::string key;
+    std::string value;
+    int64_t n = 0;
+
+    if (item.empty()) {
+      continue;
+    }
+    if (eq == std::string::npos || eq == 0) {
+      return false;
+    }
+    key = item.substr(0, eq);
+    value = item.substr(eq + 1);
+
+    if (key == "codec") {
+      opts.codec = value;
+    } else if (key == "b") {
+      if (!parse_int(value, n) || n < 0) {
+        return false;
+      }
+      opts.bit_rate = n;
+    } else if (key == "level") {
+      if (!parse_int(value, n) || n < -1 || n > INT_MAX) {
+        return false;
+      }
+      opts.compression_level = static_cast<int>(n);
+    } else if (key == "threads") {
+      if (!parse_int(value, n) || n < 0 || n > INT_MAX) {
+        return false;
+      }
+      opts.threads = static_cast<int>(n);
+    } else if (key == "fmt") {
+      if (value == "native") {
+        opts.native_sample_fmt = true;
+      } else if (value == "first") {
+        opts.native_sample_fmt = false;
+      } else {
+        return false;
+      }
+    } else if (key.compare(0, 4, "mux.") == 0 && key.size() > 4) {
+      append_opt(opts.format_opts, key.substr(4), value);
+    } else {
+      append_opt(opts.codec_opts, key, value);
+    }
+  }
+
+  return true;
+}
+
+struct AudioDumper::Writer {
+  struct Job {
+    int block = -1;    // index into pool, -1 for a flush marker
+    AVFrame* frame = NULL;  // dump(frame), block only counts the slot
+    int samples = 0;
+    bool eos = false;  // flush marker that also drains the encoder
+    std::promise<int> done;
+  };
+
+  AsyncDumpOptions opts;
+
+  // fixed pool, blocks go free -> jobs -> free
+  std::unique_ptr<SamplesArena> arena;
+  std::vector<std::unique_ptr<SamplesBuffer>> pool;
+  std::vector<int> free;
+  std::deque<Job> jobs;
+
+  std::mutex mtx;
+  std::condition_variable job_cv;
+  std::condition_variable free_cv;
+  bool stop = false;
+  int error = 0;         // first encode / mux error, sticky
+  uint64_t dropped = 0;
+
+  std::thread thread;
+};
+
 AudioDumper::AudioDumper(const std::string& filename,
                          enum AVSampleFormat sample_fmt,
                          const AVChannelLayout& channel_layout,
-                         int sample_rate)
+                         int sample_rate,
+                         const AsyncDumpOptions& async,
+                         const EncoderOptions& enc)
+    : AudioDumper(NULL, NULL, filename, sample_fmt, channel_layout, sample_rate, async, enc) { }
+
+AudioDumper::AudioDumper(OutputSink& sink,
+                         const std::string& format_name,
+                         enum AVSampleFormat sample_fmt,
+                         const AVChannelLayout& channel_layout,
+                         int sample_rate,
+                         const AsyncDumpOptions& async,
+                         const EncoderOptions& enc)
+    : AudioDumper(&sink, format_name.c_str(), format_name, sample_fmt, channel_layout,
+                  sample_rate, async, enc) { }
+
+AudioDumper::AudioDumper(OutputSink* sink,
+                         const char* format_name,
+                         const std::string& filename,
+                         enum AVSampleFormat sample_fmt,
+                         const AVChannelLayout& channel_layout,
+                         int sample_rate,
+                         const AsyncDumpOptions& async,
+                         const EncoderOptions& enc)
     : filename_(filename),
       in_sample_fmt_(sample_fmt),
       in_channels_(channel_layout.nb_channels),
       in_sample_rate_(sample_rate) {
   std::ostringstream oss;
+  AVDictionary* opts = NULL;
+  AVDictionaryEntry* unused = NULL;
   int rc = 0;
 
+  // sanity check
+  if (sink && !(*sink)) {
+    oss << "Invalid output sink";
+    goto err_exit;
+  }
+
   // allocate the output media context
-  avformat_alloc_output_context2(&oc_, NULL, NULL, filename.c_str());
+  avformat_alloc_output_context2(&oc_, NULL, format_name, sink ? NULL : filename.c_str());
   if (!oc_) {
-    oss << "Could not deduce output format from file extension";
+    if (format_name) {
+      oss << "Unknown output format '" << format_name << "'";
+    } else {
+      oss << "Could not deduce output format from file extension";
+    }
     goto err_exit;
   }
 
   fmt_ = oc_->oformat;
 
   // find the encoder
-  codec_ = avcodec_find_encoder(fmt_->audio_codec);
-  if (!codec_) {
-    oss << "Could not find encoder for '" << avcodec_get_name(fmt_->audio_codec) << "'";
-    goto err_exit;
+  if (enc.codec.empty()) {
+    codec_ = avcodec_find_encoder(fmt_->audio_codec);
+    if (!codec_) {
+      oss << "Could not find encoder for '" << avcodec_get_name(fmt_->audio_codec) << "'";
+      goto err_exit;
+    }
+  } else {
+    codec_ = avcodec_find_encoder_by_name(enc.codec.c_str());
+    if (!codec_ || codec_->type != AVMEDIA_TYPE_AUDIO) {
+      oss << "Unknown audio encoder '" << enc.codec << "'";
+      goto err_exit;
+    }
+    // < 0: the muxer does not say, let avformat_write_header() decide
+    if (avformat_query_codec(fmt_, codec_->id, FF_COMPLIANCE_NORMAL) == 0) {
+      oss << "'" << fmt_->name << "' cannot hold '" << enc.codec << "'";
+      goto err_exit;
+    }
   }
 
   // alloc codec context
@@ -53,19 +252,43 @@ AudioDumper::AudioDumper(const std::string& filename,
     oss << "Could not alloc encoding context";
     goto err_exit;
   }
-  c_->sample_fmt = codec_->sample_fmts ? codec_->sample_fmts[0] : AV_SAMPLE_FMT_FLTP;
+  c_->sample_fmt = enc.native_sample_fmt ? native_sample_fmt(codec_, sample_fmt)
+                  : (codec_->sample_fmts ? codec_->sample_fmts[0] : AV_SAMPLE_FMT_FLTP);
   av_channel_layout_copy(&c_->ch_layout, &channel_layout);
   c_->sample_rate = sample_rate;
   if (fmt_->flags & AVFMT_GLOBALHEADER) {
     c_->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
   }
+  if (enc.bit_rate > 0) {
+    c_->bit_rate = enc.bit_rate;
+  }
+  if (enc.compression_level >= 0) {
+    c_->compression_level = enc.compression_level;
+  }
+  if (codec_->capabilities & (AV_CODEC_CAP_FRAME_THREADS | AV_CODEC_CAP_SLICE_THREADS
+                              | AV_CODEC_CAP_OTHER_THREADS)) {
+    c_->thread_count = enc.threads;
+    c_->thread_type = FF_THREAD_FRAME | FF_THREAD_SLICE;
+  } else {
+    c_->thread_count = 1;
+  }
 
   // open the codec
-  rc = avcodec_open2(c_, codec_, NULL);
+  if (av_dict_parse_string(&opts, enc.codec_opts.c_str(), "=", ":", 0) < 0) {
+    oss << "Invalid encoder options '" << enc.codec_opts << "'";
+    goto err_exit;
+  }
+  rc = avcodec_open2(c_, codec_, &opts);
   if (rc < 0) {
     oss << "Could not open audio codec: " << av_err2str(rc);
     goto err_exit;
   }
+  unused = av_dict_get(opts, "", NULL, AV_DICT_IGNORE_SUFFIX);
+  if (unused) {
+    oss << "Unknown encoder option '" << unused->key << "'";
+    goto err_exit;
+  }
+  av_dict_free(&opts);
 
   // add stream
   st_ = avformat_new_stream(oc_, NULL);
@@ -85,20 +308,20 @@ AudioDumper::AudioDumper(const std::string& filename,
 
   av_dump_format(oc_, 0, filename.c_str(), 1);
 
-  // alloc frame
+  frame_size_ = (codec_->capabilities & AV_CODEC_CAP_VARIABLE_FRAME_SIZE)
+                ? max_frame_size : c_->frame_size;
+
+  // alloc frames, buffers come from the pools
   frame_ = av_frame_alloc();
-  if (!frame_) {
+  ref_frame_ = av_frame_alloc();
+  if (!frame_ || !ref_frame_) {
     oss << "Error allocating audio frame";
     goto err_exit;
   }
-  frame_->format = c_->sample_fmt;
-  av_channel_layout_copy(&frame_->ch_layout, &c_->ch_layout);
-  frame_->sample_rate = c_->sample_rate;
-  frame_->nb_samples = (codec_->capabilities & AV_CODEC_CAP_VARIABLE_FRAME_SIZE)
-                       ? max_frame_size : c_->frame_size;
-  rc = av_frame_get_buffer(frame_, 0);
-  if (rc < 0) {
-    oss << "Could not allocate frame data";
+  frame_pool_.reset(new FramePool(c_->sample_fmt, c_->ch_layout, c_->sample_rate, frame_size_));
+  in_pool_.reset(new FramePool(sample_fmt, channel_layout, sample_rate, max_frame_size));
+  if (!(*frame_pool_) || !(*in_pool_)) {
+    oss << "Could not allocate frame pool";
     goto err_exit;
   }
 
@@ -109,8 +332,6 @@ AudioDumper::AudioDumper(const std::string& filename,
     goto err_exit;
   }
 
-  frame_size_ = frame_->nb_samples;
-
   // Alloc AVFifo & Resampler
   if (!(codec_->capabilities & AV_CODEC_CAP_VARIABLE_FRAME_SIZE)
       || (c_->sample_fmt != sample_fmt)) {
@@ -120,9 +341,10 @@ AudioDumper::AudioDumper(const std::string& filename,
       goto err_exit;
     }
     if (c_->sample_fmt != sample_fmt) {
-      resampler_ = new(std::nothrow) Resampler(sample_fmt, channel_layout, sample_rate,
-                                               c_->sample_fmt, c_->ch_layout, c_->sample_rate);
-      if (!resampler_ || !(*resampler_)) {
+      // one dumper per output file, reuse contexts across files
+      resampler_ = ResamplerCache::shared().acquire(sample_fmt, channel_layout, sample_rate,
+                                                    c_->sample_fmt, c_->ch_layout, c_->sample_rate);
+      if (!resampler_ || resampler_->reserve(resampler_->max_out_samples(max_frame_size)) < 0) {
         oss << "Could not create resampler";
         goto err_exit;
       }
@@ -130,55 +352,63 @@ AudioDumper::AudioDumper(const std::string& filename,
   }
 
   // open the output file, if needed
-  if (!(fmt_->flags & AVFMT_NOFILE)) {
-    rc = avio_open(&oc_->pb, filename.c_str(), AVIO_FLAG_WRITE);
-    if (rc < 0) {
-      oss << "Could not open '" << filename << "': " << av_err2str(rc);
+  if (sink) {
+    sink_ = sink;
+  } else if (!(fmt_->flags & AVFMT_NOFILE)) {
+    // few large writes, avio_open() would flush every 32KB
+    file_sink_.reset(new FileSink(filename));
+    if (!(*file_sink_)) {
+      oss << "Could not open '" << filename << "'";
       goto err_exit;
     }
-    need_close_ = true;
+    sink_ = file_sink_.get();
+  }
+  if (sink_) {
+    oc_->pb = sink_->avio();
+    oc_->flags |= AVFMT_FLAG_CUSTOM_IO;
   }
 
-  rc = avformat_write_header(oc_, NULL);
+  if (av_dict_parse_string(&opts, enc.format_opts.c_str(), "=", ":", 0) < 0) {
+    oss << "Invalid muxer options '" << enc.format_opts << "'";
+    goto err_exit;
+  }
+  rc = avformat_write_header(oc_, &opts);
   if (rc < 0) {
     oss << "Error occurred when opening output file: " << av_err2str(rc);
     goto err_exit;
   }
   need_trailer_ = true;
+  unused = av_dict_get(opts, "", NULL, AV_DICT_IGNORE_SUFFIX);
+  if (unused) {
+    oss << "Unknown muxer option '" << unused->key << "'";
+    goto err_exit;
+  }
+  av_dict_free(&opts);
+
+  if (async.queue_depth > 0 && start_writer(async) < 0) {
+    oss << "Could not start writer thread";
+    goto err_exit;
+  }
 
   return;
 
 err_exit:
+  av_dict_free(&opts);
   clean();
   throw std::runtime_error(oss.str());
 }
 
-AudioDumper::AudioDumper(AudioDumper&& rhs)
-  noexcept
-    : filename_(rhs.filename_),
-      in_sample_fmt_(rhs.in_sample_fmt_),
-      in_channels_(rhs.in_channels_),
-      in_sample_rate_(rhs.in_sample_rate_),
-      fmt_(rhs.fmt_),
-      codec_(rhs.codec_),
-      oc_(rhs.oc_),
-      c_(rhs.c_),
-      st_(rhs.st_),
-      frame_(rhs.frame_),
-      pkt_(rhs.pkt_),
-      frame_size_(rhs.frame_size_),
-      af_(rhs.af_),
-      resampler_(rhs.resampler_),
-      need_close_(rhs.need_close_),
-      need_trailer_(rhs.need_trailer_),
-      samples_count_(rhs.samples_count_) {
-  rhs.reset();
+AudioDumper::AudioDumper(AudioDumper&& rhs) noexcept {
+  *this = std::move(rhs);
 }
 
 AudioDumper& AudioDumper::operator=(AudioDumper&& rhs) noexcept {
   if (this != &rhs) {
     clean();
 
+    // the writer thread works on |rhs|, let it finish first
+    rhs.stop_writer();
+
     filename_ = rhs.filename_;
     in_sample_fmt_ = rhs.in_sample_fmt_;
     in_channels_ = rhs.in_channels_;
@@ -191,18 +421,32 @@ AudioDumper& AudioDumper::operator=(AudioDumper&& rhs) noexcept {
     st_ = rhs.st_;
 
     frame_ = rhs.frame_;
+    ref_frame_ = rhs.ref_frame_;
     pkt_ = rhs.pkt_;
     frame_size_ = rhs.frame_size_;
 
+    frame_pool_ = std::move(rhs.frame_pool_);
+    in_pool_ = std::move(rhs.in_pool_);
+
     af_ = rhs.af_;
-    resampler_ = rhs.resampler_;
+    resampler_ = std::move(rhs.resampler_);
+
+    sink_ = rhs.sink_;
+    file_sink_ = std::move(rhs.file_sink_);
 
-    need_close_ = rhs.need_close_;
     need_trailer_ = rhs.need_trailer_;
 
     samples_count_ = rhs.samples_count_;
+    bytes_.store(rhs.bytes_.load());
+
+    AsyncDumpOptions async = rhs.async_;
 
     rhs.reset();
+
+    if (async.queue_depth > 0) {
+      // falls back to writing inline if it cannot be restarted
+      start_writer(async);
+    }
   }
   return *this;
 }
@@ -212,13 +456,127 @@ AudioDumper::~AudioDumper() {
 }
 
 int AudioDumper::dump(const uint8_t* const* audio_data, int nb_samples) {
-  int rc = 0;
-
   // sanity check
   if (nb_samples < 0 || nb_samples > max_frame_size) {
     return INT_MIN;
   }
 
+  if (!writer_) {
+    return encode(audio_data, nb_samples);
+  }
+
+  if (!audio_data) {
+    // same meaning as inline: the encoder is drained when this returns
+    return post_flush(true).get();
+  }
+
+  return queue(audio_data, NULL, nb_samples);
+}
+
+int AudioDumper::dump(const AVFrame* frame) {
+  // sanity check
+  if (!frame || frame->format != in_sample_fmt_ || frame->ch_layout.nb_channels != in_channels_
+      || frame->sample_rate != in_sample_rate_
+      || frame->nb_samples <= 0 || frame->nb_samples > max_frame_size) {
+    return INT_MIN;
+  }
+
+  if (!writer_) {
+    return encode(frame);
+  }
+
+  return queue(NULL, frame, frame->nb_samples);
+}
+
+int AudioDumper::get_frame(AVFrame* frame, int nb_samples) {
+  if (!in_pool_) {
+    return INT_MIN + 1;
+  }
+
+  return in_pool_->get(frame, nb_samples);
+}
+
+int AudioDumper::queue(const uint8_t* const* audio_data, const AVFrame* frame, int nb_samples) {
+  Writer& w = *writer_;
+  AVFrame* ref = NULL;
+  int block = -1;
+
+  if (nb_samples == 0) {
+    return 0;
+  }
+
+  std::unique_lock<std::mutex> lk(w.mtx);
+
+  if (w.error < 0) {
+    return w.error;
+  }
+
+  // a frame only takes a slot, the block itself stays unused
+  if (w.free.empty()) {
+    if (w.opts.drop_on_full) {
+      w.dropped++;
+      return 0;
+    }
+    w.free_cv.wait(lk, [&w] { return !w.free.empty(); });
+  }
+  block = w.free.back();
+  w.free.pop_back();
+
+  // the block is ours until it is queued, copy / ref without the lock
+  lk.unlock();
+  if (frame) {
+    ref = av_frame_clone(frame);
+  } else {
+    av_samples_copy(w.pool[block]->get(), const_cast<uint8_t* const*>(audio_data),
+                    0, 0, nb_samples, in_channels_, in_sample_fmt_);
+  }
+  lk.lock();
+
+  if (frame && !ref) {
+    w.free.push_back(block);
+    return -1;
+  }
+
+  Writer::Job job;
+  job.block = block;
+  job.frame = ref;
+  job.samples = nb_samples;
+  w.jobs.push_back(std::move(job));
+  lk.unlock();
+  w.job_cv.notify_one();
+
+  return 0;
+}
+
+std::future<int> AudioDumper::flush() {
+  std::promise<int> done;
+  int rc = 0;
+
+  if (writer_) {
+    return post_flush(false);
+  }
+
+  if (oc_ && oc_->pb) {
+    avio_flush(oc_->pb);
+    rc = oc_->pb->error;
+  }
+  done.set_value(rc);
+
+  return done.get_future();
+}
+
+uint64_t AudioDumper::dropped() const {
+  if (!writer_) {
+    return 0;
+  }
+
+  std::lock_guard<std::mutex> lk(writer_->mtx);
+  return writer_->dropped;
+}
+
+int AudioDumper::encode(const uint8_t* const* audio_data, int nb_samples) {
+  int rc = 0;
+
   if (af_) {
     // 1. caching
     if (resampler_) {
@@ -240,14 +598,14 @@ int AudioDumper::dump(const uint8_t* const* audio_data, int nb_samples) {
       if (fifo_sz < min_frame_sz) {
         break;
       }
-      rc = av_frame_make_writable(frame_);
+      rc = frame_pool_->get(frame_, frame_size_);
       check_exit(rc, -3);
       rc = av_audio_fifo_read(af_, reinterpret_cast<void**>(frame_->extended_data), frame_size_);
       check_exit(rc, -4);
       frame_->nb_samples = rc;
       frame_->pts = samples_count_;
       samples_count_ += rc;
-      rc = avcodec_send_frame(c_, frame_);
+      rc = send_frame(frame_);
       check_exit(rc, -5);
       rc = receive_n_write_packet();
       check_exit(rc, -6);
@@ -256,19 +614,19 @@ int AudioDumper::dump(const uint8_t* const* audio_data, int nb_samples) {
     // 3. flushing
     if (!audio_data) {
       while (av_audio_fifo_size(af_) > 0) {
-        rc = av_frame_make_writable(frame_);
+        rc = frame_pool_->get(frame_, frame_size_);
         check_exit(rc, -7);
         rc = av_audio_fifo_read(af_, reinterpret_cast<void**>(frame_->extended_data), frame_size_);
         check_exit(rc, -8);
         frame_->nb_samples = rc;
         frame_->pts = samples_count_;
         samples_count_ += rc;
-        rc = avcodec_send_frame(c_, frame_);
+        rc = send_frame(frame_);
         check_exit(rc, -9);
         rc = receive_n_write_packet();
         check_exit(rc, -10);
       }
-      rc = avcodec_send_frame(c_, NULL);
+      rc = send_frame(NULL);
       check_exit(rc, -11);
       rc = receive_n_write_packet();
       check_exit(rc, -12);
@@ -276,8 +634,11 @@ int AudioDumper::dump(const uint8_t* const* audio_data, int nb_samples) {
   } else {
     AVFrame* pframe = NULL;
     // caching & framing & flushing
+    if (audio_data && nb_samples == 0) {
+      return 0;
+    }
     if (audio_data) {
-      rc = av_frame_make_writable(frame_);
+      rc = frame_pool_->get(frame_, nb_samples);
       check_exit(rc, -13);
       rc = av_samples_copy(frame_->extended_data, const_cast<uint8_t* const*>(audio_data),
                            0, 0, nb_samples, in_channels_, in_sample_fmt_);
@@ -287,7 +648,7 @@ int AudioDumper::dump(const uint8_t* const* audio_data, int nb_samples) {
       samples_count_ += nb_samples;
       pframe = frame_;
     }
-    rc = avcodec_send_frame(c_, pframe);
+    rc = send_frame(pframe);
     check_exit(rc, -15);
     rc = receive_n_write_packet();
     check_exit(rc, -16);
@@ -299,7 +660,35 @@ exit:
   return rc;
 }
 
+int AudioDumper::encode(const AVFrame* frame) {
+  int rc = 0;
+
+  if (af_) {
+    // re-framed or converted anyway, the FIFO takes a copy
+    return encode(frame->extended_data, frame->nb_samples);
+  }
+
+  // a reference, av_frame_ref() only copies if |frame| is not refcounted
+  rc = av_frame_ref(ref_frame_, frame);
+  check_exit(rc, -17);
+  ref_frame_->pts = samples_count_;
+  samples_count_ += ref_frame_->nb_samples;
+  rc = send_frame(ref_frame_);
+  av_frame_unref(ref_frame_);
+  check_exit(rc, -18);
+  rc = receive_n_write_packet();
+  check_exit(rc, -19);
+
+  return 0;
+
+exit:
+  return rc;
+}
+
 void AudioDumper::clean() {
+  // whatever is still queued goes out before the trailer
+  stop_writer();
+
   if (need_trailer_) {
     av_write_trailer(oc_);
     need_trailer_ = false;
@@ -313,24 +702,33 @@ void AudioDumper::clean() {
     av_frame_free(&frame_);
   }
 
+  if (ref_frame_) {
+    av_frame_free(&ref_frame_);
+  }
+
+  // frames the encoder released above are back, the rest free themselves
+  frame_pool_.reset();
+  in_pool_.reset();
+
   if (pkt_) {
     av_packet_free(&pkt_);
   }
 
-  if (resampler_) {
-    delete resampler_;
-    resampler_ = NULL;
-  }
+  // back to the cache
+  resampler_.reset();
 
   if (af_) {
     av_audio_fifo_free(af_);
     af_ = NULL;
   }
 
-  if (need_close_) {
-    avio_closep(&oc_->pb);
-    need_close_ = false;
+  if (sink_) {
+    // the trailer may still sit in the AVIOContext buffer
+    sink_->flush();
+    oc_->pb = NULL;
+    sink_ = NULL;
   }
+  file_sink_.reset();
 
   if (oc_) {
     avformat_free_context(oc_);
@@ -348,16 +746,25 @@ void AudioDumper::reset() {
   st_ = NULL;
 
   frame_ = NULL;
+  ref_frame_ = NULL;
   pkt_ = NULL;
   frame_size_ = 0;
 
   af_ = NULL;
-  resampler_ = NULL;
 
-  need_close_ = false;
+  sink_ = NULL;
+
   need_trailer_ = false;
 
   samples_count_ = 0;
+  bytes_.store(0);
+
+  async_ = AsyncDumpOptions();
+}
+
+int AudioDumper::send_frame(const AVFrame* frame) {
+  avtool_time_scope(Metric::Encode);
+  return avcodec_send_frame(c_, frame);
 }
 
 int AudioDumper::receive_n_write_packet() {
@@ -365,7 +772,10 @@ int AudioDumper::receive_n_write_packet() {
 
   do {
     // receive packet
-    rc = avcodec_receive_packet(c_, pkt_);
+    {
+      avtool_time_scope(Metric::Encode);
+      rc = avcodec_receive_packet(c_, pkt_);
+    }
     if (rc == AVERROR(EAGAIN) || rc == AVERROR_EOF) {
       rc = 0;
       break;
@@ -374,7 +784,11 @@ int AudioDumper::receive_n_write_packet() {
       break;
     }
     // write packet
-    rc = av_interleaved_write_frame(oc_, pkt_);
+    bytes_.fetch_add(pkt_->size, std::memory_order_relaxed);
+    {
+      avtool_time_scope(Metric::Mux);
+      rc = av_interleaved_write_frame(oc_, pkt_);
+    }
     if (rc < 0) {
       rc = -2;
       break;
@@ -383,3 +797,678 @@ int AudioDumper::receive_n_write_packet() {
 
   return rc;
 }
+
+int AudioDumper::start_writer(const AsyncDumpOptions& async) {
+  std::unique_ptr<Writer> w(new (std::nothrow) Writer);
+  size_t block_size = SamplesBuffer::arena_size(in_channels_, max_frame_size, in_sample_fmt_);
+
+  if (!w) {
+    return -1;
+  }
+
+  w->opts = async;
+
+  // all blocks up front, nothing is allocated per dump()
+  w->arena.reset(new (std::nothrow) SamplesArena(block_size * async.queue_depth));
+  if (!w->arena || !(*w->arena)) {
+    return -1;
+  }
+  try {
+    for (int i = 0; i < async.queue_depth; i++) {
+      w->pool.emplace_back(new SamplesBuffer(*w->arena, in_channels_, max_frame_size, in_sample_fmt_));
+      if (!(*w->pool.back())) {
+        return -1;
+      }
+      w->free.push_back(i);
+    }
+  } catch (...) {
+    return -1;
+  }
+
+  writer_ = std::move(w);
+  try {
+    writer_->thread = std::thread(&AudioDumper::write_loop, this);
+  } catch (...) {
+    writer_.reset();
+    return -2;
+  }
+  async_ = async;
+
+  return 0;
+}
+
+void AudioDumper::stop_writer() {
+  if (!writer_) {
+    return;
+  }
+
+  {
+    std::lock_guard<std::mutex> lk(writer_->mtx);
+    writer_->stop = true;
+  }
+  writer_->job_cv.notify_one();
+  writer_->thread.join();
+  writer_.reset();
+}
+
+std::future<int> AudioDumper::post_flush(bool eos) {
+  Writer::Job job;
+  std::future<int> done = job.done.get_future();
+
+  job.eos = eos;
+  {
+    std::lock_guard<std::mutex> lk(writer_->mtx);
+    writer_->jobs.push_back(std::move(job));
+  }
+  writer_->job_cv.notify_one();
+
+  return done;
+}
+
+void AudioDumper::write_loop() {
+  Writer& w = *writer_;
+  std::unique_lock<std::mutex> lk(w.mtx);
+
+  while (true) {
+    w.job_cv.wait(lk, [&w] { return w.stop || !w.jobs.empty(); });
+    if (w.jobs.empty()) {
+      // stopped and drained
+      break;
+    }
+
+    Writer::Job job = std::move(w.jobs.front());
+    w.jobs.pop_front();
+    int rc = w.error;
+    lk.unlock();
+
+    if (job.frame) {
+      if (rc == 0) {
+        rc = encode(job.frame);
+      }
+      av_frame_free(&job.frame);
+    } else if (job.block >= 0) {
+      if (rc == 0) {
+        rc = encode(w.pool[job.block]->get(), job.samples);
+      }
+    } else {
+      if (rc == 0 && job.eos) {
+        rc = encode(NULL, 0);
+      }
+      if (rc == 0 && oc_->pb) {
+        avio_flush(oc_->pb);
+        rc = (oc_->pb->error < 0) ? oc_->pb->error : 0;
+      }
+      job.done.set_value(rc);
+    }
+
+    lk.lock();
+    if (rc < 0 && w.error == 0) {
+      w.error = rc;
+    }
+    if (job.block >= 0) {
+      w.free.push_back(job.block);
+      w.free_cv.notify_one();
+    }
+  }
+}
+
+SegmentedDumper::SegmentedDumper(const std::string& pattern,
+                                 enum AVSampleFormat sample_fmt,
+                                 const AVChannelLayout& channel_layout,
+                                 int sample_rate,
+                                 const SegmentOptions& segment,
+                                 const AsyncDumpOptions& async,
+                                 const EncoderOptions& enc)
+    : in_sample_fmt_(sample_fmt),
+      in_sample_rate_(sample_rate),
+      opts_(segment),
+      async_(async),
+      enc_(enc) {
+  // sanity check
+  if (av_sample_fmt_is_planar(sample_fmt) && channel_layout.nb_channels > AV_NUM_DATA_POINTERS) {
+    throw std::runtime_error("Too many channels to segment");
+  }
+
+  parse_pattern(pattern);
+
+  if (av_channel_layout_copy(&chlayout_, &channel_layout) < 0) {
+    throw std::runtime_error("Could not copy channel layout");
+  }
+
+  limit_ = std::llround(opts_.segment_secs * sample_rate);
+  next_roll_ = limit_;
+  next_bytes_ = opts_.segment_bytes;
+
+  try {
+    current_ = open_segment(0);
+  } catch (...) {
+    av_channel_layout_uninit(&chlayout_);
+    throw;
+  }
+
+  prepare_next();
+}
+
+SegmentedDumper::~SegmentedDumper() {
+  // the pre-opened segment was never used
+  if (next_.valid()) {
+    try {
+      next_.get().reset();
+    } catch (std::exception&) { }
+    unlink(segment_name(index_ + 1).c_str());
+  }
+
+  if (closing_.valid()) {
+    closing_.get();
+  }
+
+  if (current_) {
+    if (!flushed_) {
+      current_->dump(NULL, 0);
+    }
+    current_.reset();
+    if (seg_samples_ > 0) {
+      entries_.push_back({segment_name(index_), static_cast<double>(seg_samples_) / in_sample_rate_});
+    } else {
+      // rolled right at the end, nothing in it
+      unlink(segment_name(index_).c_str());
+    }
+  }
+
+  if (!opts_.manifest.empty()) {
+    write_manifest(true);
+  }
+
+  av_channel_layout_uninit(&chlayout_);
+}
+
+int SegmentedDumper::dump(const uint8_t* const* audio_data, int nb_samples) {
+  int bps = av_get_bytes_per_sample(in_sample_fmt_);
+  bool planar = av_sample_fmt_is_planar(in_sample_fmt_);
+  int done = 0;
+  int rc = 0;
+
+  // sanity check
+  if (nb_samples < 0 || nb_samples > AudioDumper::max_frame_size) {
+    return INT_MIN;
+  }
+
+  if (!audio_data) {
+    flushed_ = true;
+    return current_->dump(NULL, 0);
+  }
+
+  while (done < nb_samples) {
+    int n = nb_samples - done;
+    if (limit_ > 0) {
+      n = static_cast<int>(std::min<int64_t>(n, next_roll_ - seg_samples_));
+    }
+
+    // the part that still fits into this segment
+    for (int ch = 0; ch < (planar ? chlayout_.nb_channels : 1); ch++) {
+      planes_[ch] = audio_data[ch] + static_cast<size_t>(done) * bps * (planar ? 1 : chlayout_.nb_channels);
+    }
+    rc = current_->dump(planes_, n);
+    if (rc < 0) {
+      return rc;
+    }
+    done += n;
+    seg_samples_ += n;
+
+    if (should_rotate()) {
+      rc = rotate();
+      if (rc < 0) {
+        return rc;
+      }
+    }
+  }
+
+  return 0;
+}
+
+int SegmentedDumper::dump(const AVFrame* frame) {
+  int rc = 0;
+
+  // sanity check
+  if (!frame) {
+    return INT_MIN;
+  }
+
+  if (limit_ > 0 && seg_samples_ + frame->nb_samples > next_roll_) {
+    // crosses a segment boundary, split it
+    return dump(frame->extended_data, frame->nb_samples);
+  }
+
+  rc = current_->dump(frame);
+  if (rc < 0) {
+    return rc;
+  }
+  seg_samples_ += frame->nb_samples;
+
+  return should_rotate() ? rotate() : 0;
+}
+
+void SegmentedDumper::parse_pattern(const std::string& pattern) {
+  std::string* part = &name_head_;
+  bool has_index = false;
+
+  // never handed to printf, the only conversion is the index
+  for (size_t i = 0; i < pattern.size(); i++) {
+    size_t pos = i + 1;
+    int width = 0;
+
+    if (pattern[i] != '%') {
+      part->push_back(pattern[i]);
+      continue;
+    }
+
+    if (pos < pattern.size() && pattern[pos] == '%') {
+      part->push_back('%');
+      i = pos;
+      continue;
+    }
+
+    if (pos < pattern.size() && pattern[pos] == '0') {
+      pos++;
+      while (pos < pattern.size() && pattern[pos] >= '0' && pattern[pos] <= '9' && width < 100) {
+        width = width * 10 + (pattern[pos++] - '0');
+      }
+    }
+
+    if (has_index || pos >= pattern.size() || pattern[pos] != 'd' || width >= 100) {
+      std::ostringstream oss;
+      oss << "Bad segment pattern '" << pattern << "', expected one %d or %0Nd";
+      throw std::runtime_error(oss.str());
+    }
+
+    has_index = true;
+    name_width_ = width;
+    part = &name_tail_;
+    i = pos;
+  }
+
+  if (!has_index) {
+    size_t dot = name_head_.find_last_of('.');
+    size_t slash = name_head_.find_last_of('/');
+
+    // "_00000" before the extension
+    if (dot != std::string::npos && (slash == std::string::npos || dot > slash)) {
+      name_tail_ = name_head_.substr(dot);
+      name_head_.resize(dot);
+    }
+    name_head_ += '_';
+    name_width_ = 5;
+  }
+}
+
+std::string SegmentedDumper::segment_name(int index) const {
+  std::string digits = std::to_string(index);
+
+  if (index >= 0 && static_cast<int>(digits.size()) < name_width_) {
+    digits.insert(0, name_width_ - digits.size(), '0');
+  }
+
+  return name_head_ + digits + name_tail_;
+}
+
+std::unique_ptr<AudioDumper> SegmentedDumper::open_segment(int index) const {
+  return std::unique_ptr<AudioDumper>(new AudioDumper(segment_name(index), in_sample_fmt_, chlayout_,
+                                                      in_sample_rate_, async_, enc_));
+}
+
+void SegmentedDumper::prepare_next() {
+  int index = index_ + 1;
+
+  // codec open, header write, resampler setup: all off the caller's thread
+  next_ = std::async(std::launch::async, [this, index] {
+    return open_segment(index);
+  });
+}
+
+bool SegmentedDumper::should_rotate() const {
+  return (limit_ > 0 && seg_samples_ >= next_roll_)
+         || (opts_.segment_bytes > 0 && current_->bytes() >= next_bytes_);
+}
+
+int SegmentedDumper::rotate() {
+  std::unique_ptr<AudioDumper> next;
+  int rc = 0;
+
+  try {
+    next = next_.get();
+  } catch (std::exception&) {
+    // keep filling this one, nothing is lost, try again at the next boundary
+    next_roll_ += limit_;
+    next_bytes_ = current_->bytes() + opts_.segment_bytes;
+    prepare_next();
+    return 0;
+  }
+
+  // one segment is closed at a time, the manifest stays in order
+  if (closing_.valid()) {
+    rc = closing_.get();
+  }
+
+  Entry entry = {segment_name(index_), static_cast<double>(seg_samples_) / in_sample_rate_};
+  closing_ = std::async(std::launch::async, [this, entry, old = std::move(current_)]() mutable {
+    int ret = old->dump(NULL, 0);
+    // trailer, then the segment is complete
+    old.reset();
+    entries_.push_back(entry);
+    if (!opts_.manifest.empty() && write_manifest(false) < 0) {
+      ret = (ret < 0) ? ret : -2;
+    }
+    return ret;
+  });
+
+  current_ = std::move(next);
+  index_++;
+  seg_samples_ = 0;
+  next_roll_ = limit_;
+  next_bytes_ = opts_.segment_bytes;
+  prepare_next();
+
+  // an error from closing the previous segment shows up here
+  return rc;
+}
+
+int SegmentedDumper::write_manifest(bool final) {
+  std::string tmp = opts_.manifest + ".tmp";
+  std::string dir;
+  size_t slash = opts_.manifest.find_last_of('/');
+  bool hls = opts_.manifest.size() >= 5
+             && opts_.manifest.compare(opts_.manifest.size() - 5, 5, ".m3u8") == 0;
+  double target = 0;
+
+  if (slash != std::string::npos) {
+    dir = opts_.manifest.substr(0, slash + 1);
+  }
+
+  std::ofstream out(tmp, std::ios::trunc);
+  out << std::fixed << std::setprecision(3);
+
+  if (hls) {
+    for (const Entry& e : entries_) {
+      target = std::max(target, e.secs);
+    }
+    out << "#EXTM3U\n"
+        << "#EXT-X-VERSION:3\n"
+        << "#EXT-X-PLAYLIST-TYPE:EVENT\n"
+        << "#EXT-X-TARGETDURATION:" << static_cast<int>(std::ceil(target)) << "\n"
+        << "#EXT-X-MEDIA-SEQUENCE:0\n";
+  }
+
+  for (const Entry& e : entries_) {
+    // relative to the manifest when next to it
+    std::string name = (!dir.empty() && e.name.compare(0, dir.size(), dir) == 0)
+                       ? e.name.substr(dir.size()) : e.name;
+    if (hls) {
+      out << "#EXTINF:" << e.secs << ",\n" << name << "\n";
+    } else {
+      out << name << " " << e.secs << "\n";
+    }
+  }
+
+  if (hls && final) {
+    out << "#EXT-X-ENDLIST\n";
+  }
+
+  out.close();
+  if (!out) {
+    return -1;
+  }
+
+  // readers never see a half-written manifest
+  if (rename(tmp.c_str(), opts_.manifest.c_str()) < 0) {
+    return -2;
+  }
+
+  return 0;
+}
+
+AudioFanout::AudioFanout(enum AVSampleFormat sample_fmt,
+                         const AVChannelLayout& channel_layout,
+                         int sample_rate)
+    : in_sample_fmt_(sample_fmt),
+      in_channels_(channel_layout.nb_channels),
+      pool_(sample_fmt, channel_layout, sample_rate, AudioDumper::max_frame_size) {
+  if (!pool_) {
+    throw std::runtime_error("Could not allocate frame pool");
+  }
+
+  frame_ = av_frame_alloc();
+  if (!frame_) {
+    throw std::runtime_error("Error allocating audio frame");
+  }
+}
+
+AudioFanout::~AudioFanout() {
+  av_frame_free(&frame_);
+}
+
+void AudioFanout::add(std::unique_ptr<AudioOutput> output) {
+  outputs_.push_back(std::move(output));
+  ok_.push_back(true);
+}
+
+int AudioFanout::dump(const uint8_t* const* audio_data, int nb_samples) {
+  bool shared = false;
+  int rc = 0;
+
+  // sanity check
+  if (nb_samples < 0 || nb_samples > AudioDumper::max_frame_size) {
+    return INT_MIN;
+  }
+
+  if (audio_data && nb_samples > 0 && outputs_.size() > 1) {
+    // one copy, every output takes a reference
+    if (pool_.get(frame_, nb_samples) < 0) {
+      return -1;
+    }
+    av_samples_copy(frame_->extended_data, const_cast<uint8_t* const*>(audio_data),
+                    0, 0, nb_samples, in_channels_, in_sample_fmt_);
+    shared = true;
+  }
+
+  for (size_t i = 0; i < outputs_.size(); i++) {
+    if (!ok_[i]) {
+      continue;
+    }
+    int ret = shared ? outputs_[i]->dump(frame_) : outputs_[i]->dump(audio_data, nb_samples);
+    if (ret < 0) {
+      ok_[i] = false;
+      failed_++;
+      rc = ret;
+    }
+  }
+
+  if (shared) {
+    av_frame_unref(frame_);
+  }
+
+  return rc;
+}
+
+int AudioFanout::dump(const AVFrame* frame) {
+  int rc = 0;
+
+  // sanity check
+  if (!frame || frame->format != in_sample_fmt_ || frame->ch_layout.nb_channels != in_channels_) {
+    return INT_MIN;
+  }
+
+  for (size_t i = 0; i < outputs_.size(); i++) {
+    if (!ok_[i]) {
+      continue;
+    }
+    int ret = outputs_[i]->dump(frame);
+    if (ret < 0) {
+      ok_[i] = false;
+      failed_++;
+      rc = ret;
+    }
+  }
+
+  return rc;
+}
+
+PacketDumper::PacketDumper(const std::string& filename, int channels, int input_sample_rate)
+    : filename_(filename) {
+  std::ostringstream oss;
+  uint8_t* head = NULL;
+  int rc = 0;
+
+  // sanity check
+  if (channels < 1 || channels > 2) {
+    oss << "Unsupported channel count " << channels;
+    goto err_exit;
+  }
+
+  // allocate the output media context
+  avformat_alloc_output_context2(&oc_, NULL, NULL, filename.c_str());
+  if (!oc_) {
+    oss << "Could not deduce output format from file extension";
+    goto err_exit;
+  }
+
+  if (avformat_query_codec(oc_->oformat, AV_CODEC_ID_OPUS, FF_COMPLIANCE_NORMAL) != 1) {
+    oss << "'" << oc_->oformat->name << "' cannot carry Opus";
+    goto err_exit;
+  }
+
+  // add stream
+  st_ = avformat_new_stream(oc_, NULL);
+  if (!st_) {
+    oss << "Could not allocate stream";
+    goto err_exit;
+  }
+  st_->id = oc_->nb_streams - 1;
+  st_->time_base = {1, opus_rate};
+
+  st_->codecpar->codec_type = AVMEDIA_TYPE_AUDIO;
+  st_->codecpar->codec_id = AV_CODEC_ID_OPUS;
+  st_->codecpar->sample_rate = opus_rate;
+  av_channel_layout_default(&st_->codecpar->ch_layout, channels);
+
+  // OpusHead (RFC 7845 5.1), mapping family 0. the encoder's pre-skip is
+  // unknown, leave it 0 and keep the original timing
+  head = static_cast<uint8_t*>(av_mallocz(19 + AV_INPUT_BUFFER_PADDING_SIZE));
+  if (!head) {
+    oss << "Could not allocate OpusHead";
+    goto err_exit;
+  }
+  memcpy(head, "OpusHead", 8);
+  head[8] = 1;
+  head[9] = static_cast<uint8_t>(channels);
+  head[12] = input_sample_rate & 0xff;
+  head[13] = (input_sample_rate >> 8) & 0xff;
+  head[14] = (input_sample_rate >> 16) & 0xff;
+  head[15] = (input_sample_rate >> 24) & 0xff;
+  st_->codecpar->extradata = head;
+  st_->codecpar->extradata_size = 19;
+
+  av_dump_format(oc_, 0, filename.c_str(), 1);
+
+  // alloc pkt
+  pkt_ = av_packet_alloc();
+  if (!pkt_) {
+    oss << "Could not allocate AVPacket";
+    goto err_exit;
+  }
+
+  // open the output file, if needed
+  if (!(oc_->oformat->flags & AVFMT_NOFILE)) {
+    rc = avio_open(&oc_->pb, filename.c_str(), AVIO_FLAG_WRITE);
+    if (rc < 0) {
+      oss << "Could not open '" << filename << "': " << av_err2str(rc);
+      goto err_exit;
+    }
+    need_close_ = true;
+  }
+
+  // may change st_->time_base (e.g. 1/1000 for Matroska)
+  rc = avformat_write_header(oc_, NULL);
+  if (rc < 0) {
+    oss << "Error occurred when opening output file: " << av_err2str(rc);
+    goto err_exit;
+  }
+  need_trailer_ = true;
+
+  return;
+
+err_exit:
+  clean();
+  throw std::runtime_error(oss.str());
+}
+
+PacketDumper::~PacketDumper() {
+  clean();
+}
+
+int PacketDumper::dump(const uint8_t* data, int size, int64_t pts, int duration) {
+  int rc = 0;
+
+  // sanity check
+  if (!data || size <= 0 || pts < 0 || duration <= 0) {
+    return INT_MIN;
+  }
+
+  if (!need_trailer_) {
+    // not opened
+    return INT_MIN + 1;
+  }
+
+  // not refcounted, av_write_frame() copies what the muxer keeps
+  pkt_->buf = NULL;
+  pkt_->data = const_cast<uint8_t*>(data);
+  pkt_->size = size;
+  pkt_->pts = pts;
+  pkt_->dts = pts;
+  pkt_->duration = duration;
+  pkt_->stream_index = st_->index;
+  pkt_->flags = AV_PKT_FLAG_KEY;
+  av_packet_rescale_ts(pkt_, {1, opus_rate}, st_->time_base);
+
+  // single stream, nothing to interleave
+  {
+    avtool_time_scope(Metric::Mux);
+    rc = av_write_frame(oc_, pkt_);
+  }
+  pkt_->data = NULL;
+  pkt_->size = 0;
+
+  return (rc < 0) ? -1 : 0;
+}
+
+void PacketDumper::clean() {
+  if (need_trailer_) {
+    av_write_trailer(oc_);
+    need_trailer_ = false;
+  }
+
+  if (pkt_) {
+    av_packet_free(&pkt_);
+  }
+
+  if (need_close_) {
+    avio_closep(&oc_->pb);
+    need_close_ = false;
+  }
+
+  if (oc_) {
+    // also frees the stream and its extradata
+    avformat_free_context(oc_);
+    oc_ = NULL;
+  }
+
+  reset();
+}
+
+void PacketDumper::reset() {
+  oc_ = NULL;
+  st_ = NULL;
+  pkt_ = NULL;
+
+  need_close_ = false;
+  need_trailer_ = false;
+}
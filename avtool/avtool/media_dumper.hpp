@@ -8,7 +8,12 @@
 #ifndef media_dumper_hpp
 #define media_dumper_hpp
 
+#include <atomic>
+#include <cstdint>
+#include <future>
+#include <memory>
 #include <string>
+#include <vector>
 
 extern "C" {
 #include <libavcodec/avcodec.h>
@@ -19,27 +24,106 @@ extern "C" {
 }
 
 #include "audio_helper.hpp"
+#include "output_sink.hpp"
 
 namespace AVTool {
 
-class AudioDumper {
+// What AudioFanout feeds, a single file or a segmented recording.
+class AudioOutput {
+ public:
+  virtual ~AudioOutput() = default;
+
+  // |audio_data| NULL: end of stream
+  virtual int dump(const uint8_t* const* audio_data, int nb_samples) = 0;
+
+  // refcounted frame in the input format, see AudioDumper::dump(frame)
+  virtual int dump(const AVFrame* frame) = 0;
+};
+
+// AudioDumper async mode: dump() copies the samples into a pooled block and
+// queues it, a writer thread does the framing, encoding and muxing
+struct AsyncDumpOptions {
+  int queue_depth = 0;        // blocks in flight, 0: write on the caller's thread
+  bool drop_on_full = false;  // drop a block rather than wait for the writer
+};
+
+// AudioDumper encoder / muxer tuning, the defaults leave it all to FFmpeg
+struct EncoderOptions {
+  std::string codec;           // encoder name, e.g. "pcm_f32le". empty: the container's default
+  int64_t bit_rate = 0;        // bits/s, 0: encoder default
+  int compression_level = -1;  // encoder specific speed / size trade-off, -1: default
+  int threads = 1;             // encoder threads, 0: auto. ignored by encoders without threading
+  // take a sample format the encoder accepts natively, preferably the
+  // input's, so no conversion is needed. false: the encoder's first one
+  bool native_sample_fmt = true;
+  // "key=value:key=value", AVOptions of the encoder (avcodec_open2()) and of
+  // the muxer (avformat_write_header(), e.g. "fflags=+bitexact"). an option
+  // neither one knows is an error
+  std::string codec_opts;
+  std::string format_opts;
+};
+
+// "codec=libopus:b=24k:level=0:threads=2:fmt=first:mux.fflags=+bitexact:vbr=off"
+// into |opts|: codec, b (k/M suffixes), level, threads and fmt (native or
+// first) are the fields above, "mux." goes to format_opts, anything else to
+// codec_opts. returns false if malformed
+bool parse_encoder_options(const char* spec, EncoderOptions& opts);
+
+class AudioDumper : public AudioOutput {
  public:
   static constexpr int max_frame_size = 16384;
 
   AudioDumper(const AudioDumper&) = delete;
   AudioDumper& operator=(const AudioDumper&) = delete;
 
+  // the container is deduced from the extension, written through a FileSink
   AudioDumper(const std::string& filename,
               enum AVSampleFormat sample_fmt,
               const AVChannelLayout& channel_layout,
-              int sample_rate);
+              int sample_rate,
+              const AsyncDumpOptions& async = AsyncDumpOptions(),
+              const EncoderOptions& enc = EncoderOptions());
+
+  // |format_name| as in av_guess_format(), e.g. "wav". the bytes go to
+  // |sink|, which must outlive the dumper (the trailer goes out in clean())
+  AudioDumper(OutputSink& sink,
+              const std::string& format_name,
+              enum AVSampleFormat sample_fmt,
+              const AVChannelLayout& channel_layout,
+              int sample_rate,
+              const AsyncDumpOptions& async = AsyncDumpOptions(),
+              const EncoderOptions& enc = EncoderOptions());
 
+  // an async writer is drained and restarted for the new owner
   AudioDumper(AudioDumper&&) noexcept;
   AudioDumper& operator=(AudioDumper&&) noexcept;
 
   virtual ~AudioDumper();
 
-  int dump(const uint8_t* const* audio_data, int nb_samples);
+  // |audio_data| NULL flushes the encoder, in async mode this waits for the
+  // writer and returns its result. otherwise async errors are sticky and
+  // show up on a later call
+  int dump(const uint8_t* const* audio_data, int nb_samples) override;
+
+  // zero-copy variant: |frame| (input format, refcounted, e.g. from
+  // get_frame()) is passed to the encoder by reference when no re-framing
+  // or conversion is needed, otherwise it goes the way of the copy above
+  int dump(const AVFrame* frame) override;
+
+  // unrefs |frame| and attaches a pooled buffer in the input format, to be
+  // filled in place and passed to dump(frame). < 0 on error
+  int get_frame(AVFrame* frame, int nb_samples);
+
+  // resolves once everything dumped so far is muxed and handed to the
+  // AVIOContext, with the first error if any
+  std::future<int> flush();
+
+  // async mode, blocks dropped because the queue was full
+  uint64_t dropped() const;
+
+  // encoded bytes handed to the muxer so far, container overhead aside.
+  // safe to read while the writer thread runs
+  int64_t bytes() const { return bytes_.load(std::memory_order_relaxed); }
 
  protected:
   void clean();
@@ -47,8 +131,38 @@ class AudioDumper {
   void reset();
 
  private:
+  struct Writer;
+
+  // |sink| NULL: open |filename|
+  AudioDumper(OutputSink* sink,
+              const char* format_name,
+              const std::string& filename,
+              enum AVSampleFormat sample_fmt,
+              const AVChannelLayout& channel_layout,
+              int sample_rate,
+              const AsyncDumpOptions& async,
+              const EncoderOptions& enc);
+
+  int encode(const uint8_t* const* audio_data, int nb_samples);
+
+  int encode(const AVFrame* frame);
+
+  // async mode, |frame| is referenced, |audio_data| copied into a block
+  int queue(const uint8_t* const* audio_data, const AVFrame* frame, int nb_samples);
+
+  // avcodec_send_frame(), timed
+  int send_frame(const AVFrame* frame);
+
   int receive_n_write_packet();
 
+  int start_writer(const AsyncDumpOptions& async);
+
+  void stop_writer();
+
+  std::future<int> post_flush(bool eos);
+
+  void write_loop();
+
   std::string filename_;
   enum AVSampleFormat in_sample_fmt_;
   int in_channels_;
@@ -61,16 +175,197 @@ class AudioDumper {
   AVStream* st_ = NULL;
 
   AVFrame* frame_ = NULL;
+  AVFrame* ref_frame_ = NULL;  // dump(frame) reference, pts set on it
   AVPacket* pkt_ = NULL;
   int frame_size_ = 0;
 
+  // encoder format, frame_ buffers. a buffer the encoder still holds is
+  // left to it instead of copied by av_frame_make_writable()
+  std::unique_ptr<FramePool> frame_pool_;
+  std::unique_ptr<FramePool> in_pool_;  // input format, get_frame()
+
   AVAudioFifo* af_ = NULL;
-  Resampler* resampler_ = NULL;
+  ResamplerCache::Handle resampler_;  // format conversion, recycled per conversion
+
+  OutputSink* sink_ = NULL;                // oc_->pb comes from here
+  std::unique_ptr<OutputSink> file_sink_;  // when opened by filename
 
-  bool need_close_ = false;
   bool need_trailer_ = false;
 
   uint64_t samples_count_ = 0;
+  std::atomic<int64_t> bytes_{0};
+
+  AsyncDumpOptions async_;
+  std::unique_ptr<Writer> writer_;  // only in async mode
+};
+
+struct SegmentOptions {
+  double segment_secs = 0;    // roll every N seconds of audio, 0: off
+  int64_t segment_bytes = 0;  // roll once a segment holds N encoded bytes, 0: off
+  // rewritten (atomically) as segments are finished. *.m3u8: HLS playlist,
+  // otherwise one "file seconds" line per segment. empty: none
+  std::string manifest;
+};
+
+// Rolling AudioDumper for long captures, every segment is a complete file
+// as soon as the next one starts. Time based rolls are sample exact, byte
+// based ones happen between dump() calls. The next segment is opened in
+// the background ahead of time and the finished one is flushed and closed
+// in the background, so a roll costs the caller no header / trailer I/O.
+class SegmentedDumper : public AudioOutput {
+ public:
+  SegmentedDumper(const SegmentedDumper&) = delete;
+  SegmentedDumper& operator=(const SegmentedDumper&) = delete;
+
+  // |pattern| names the segments, with one %d or %0Nd for the index
+  // ("rec_%05d.wav", "%%" for a literal '%'), or a plain name that gets
+  // "_00000" before the extension. throws std::runtime_error on any other
+  // conversion or if the first segment cannot be opened
+  SegmentedDumper(const std::string& pattern,
+                  enum AVSampleFormat sample_fmt,
+                  const AVChannelLayout& channel_layout,
+                  int sample_rate,
+                  const SegmentOptions& segment,
+                  const AsyncDumpOptions& async = AsyncDumpOptions(),
+                  const EncoderOptions& enc = EncoderOptions());
+
+  // closes the last segment and finalizes the manifest
+  virtual ~SegmentedDumper();
+
+  int dump(const uint8_t* const* audio_data, int nb_samples) override;
+
+  int dump(const AVFrame* frame) override;
+
+  std::string segment_name(int index) const;
+
+  // segments started so far
+  int segments() const { return index_ + 1; }
+
+ private:
+  struct Entry {
+    std::string name;
+    double secs;
+  };
+
+  std::unique_ptr<AudioDumper> open_segment(int index) const;
+
+  void prepare_next();
+
+  // finish the current segment, switch to the pre-opened one
+  int rotate();
+
+  // after a dump() into the current segment
+  bool should_rotate() const;
+
+  int write_manifest(bool final);
+
+  // splits |pattern| around the index, throws std::runtime_error
+  void parse_pattern(const std::string& pattern);
+
+  // segment names are name_head_ + index (zero padded to name_width_) + name_tail_
+  std::string name_head_;
+  std::string name_tail_;
+  int name_width_ = 0;
+  enum AVSampleFormat in_sample_fmt_;
+  AVChannelLayout chlayout_ = {};
+  int in_sample_rate_;
+  SegmentOptions opts_;
+  AsyncDumpOptions async_;
+  EncoderOptions enc_;
+
+  int64_t limit_ = 0;      // segment_secs in samples
+  int64_t next_roll_ = 0;  // samples into the current segment
+  int64_t seg_samples_ = 0;
+  int64_t next_bytes_ = 0;  // bytes into the current segment, moved on by a failed roll
+  int index_ = 0;
+  bool flushed_ = false;
+
+  std::unique_ptr<AudioDumper> current_;
+  std::future<std::unique_ptr<AudioDumper>> next_;
+  std::future<int> closing_;  // previous segment's trailer + manifest
+  std::vector<Entry> entries_;
+
+  const uint8_t* planes_[AV_NUM_DATA_POINTERS] = {};
+};
+
+// One stream of processed samples to several outputs (AudioDumper,
+// SegmentedDumper), each with a format, codec and options of its own. The
+// samples are copied once into a pooled frame and every output takes a
+// reference, an output in async mode encodes on its own writer thread. An
+// output that fails is dropped, the others go on.
+class AudioFanout {
+ public:
+  AudioFanout(const AudioFanout&) = delete;
+  AudioFanout& operator=(const AudioFanout&) = delete;
+
+  // throws std::runtime_error if the frame pool cannot be set up
+  AudioFanout(enum AVSampleFormat sample_fmt,
+              const AVChannelLayout& channel_layout,
+              int sample_rate);
+
+  virtual ~AudioFanout();
+
+  // |output| must take the input format above
+  void add(std::unique_ptr<AudioOutput> output);
+
+  int size() const { return static_cast<int>(outputs_.size()); }
+
+  AudioOutput& at(int i) { return *outputs_.at(i); }
+
+  // outputs dropped after an error
+  int failed() const { return failed_; }
+
+  // as AudioDumper::dump(), < 0 if an output failed during this call
+  int dump(const uint8_t* const* audio_data, int nb_samples);
+
+  // refcounted frame in the input format, no copy at all
+  int dump(const AVFrame* frame);
+
+ private:
+  enum AVSampleFormat in_sample_fmt_;
+  int in_channels_;
+
+  std::vector<std::unique_ptr<AudioOutput>> outputs_;
+  std::vector<bool> ok_;
+  int failed_ = 0;
+
+  FramePool pool_;
+  AVFrame* frame_ = NULL;
+};
+
+// Writes already encoded Opus packets into an Ogg (.ogg/.opus) or Matroska
+// (.webm/.mka) container, no decoding and no re-encoding.
+class PacketDumper {
+ public:
+  // Opus timestamps are always 48kHz (RFC 7845)
+  static constexpr int opus_rate = 48000;
+
+  PacketDumper(const PacketDumper&) = delete;
+  PacketDumper& operator=(const PacketDumper&) = delete;
+
+  // |input_sample_rate| only goes into the OpusHead, informative
+  PacketDumper(const std::string& filename, int channels, int input_sample_rate = opus_rate);
+
+  virtual ~PacketDumper();
+
+  // |pts| and |duration| in opus_rate ticks, |pts| must not go backwards.
+  // |data| is only referenced during the call
+  int dump(const uint8_t* data, int size, int64_t pts, int duration);
+
+ protected:
+  void clean();
+
+  void reset();
+
+ private:
+  std::string filename_;
+
+  AVFormatContext* oc_ = NULL;
+  AVStream* st_ = NULL;
+  AVPacket* pkt_ = NULL;
+
+  bool need_close_ = false;
+  bool need_trailer_ = false;
 };
 
 }
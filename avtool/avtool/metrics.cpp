@@ -0,0 +1,297 @@
+//
+//  metrics.cpp
+//  avtool
+//
+//  Created by zhanwang-sky on 2023/11/27.
+//
+
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <sstream>
+#include <system_error>
+#include <thread>
+#include <vector>
+#include <pthread.h>
+#include <signal.h>
+#include "metrics.hpp"
+
+using namespace AVTool;
+
+namespace {
+
+constexpr int nr_metrics = static_cast<int>(Metric::Count);
+
+const char* const metric_names[nr_metrics] = {
+  "read", "decode", "resample", "stretch", "encode", "mux"
+};
+
+// one thread's slots, only that thread writes them
+struct ThreadSlots {
+  std::atomic<uint64_t> calls[nr_metrics] = {};
+  std::atomic<uint64_t> ns[nr_metrics] = {};
+  std::atomic<uint64_t> hist[nr_metrics][Metrics::nr_buckets] = {};
+  std::atomic<uint64_t> audio_ns{0};
+};
+
+struct Registry {
+  std::mutex mtx;
+  std::vector<ThreadSlots*> live;
+  Metrics::Snapshot retired;  // threads that are gone
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+};
+
+// never destroyed, a signal thread may still read it during exit
+Registry& registry() {
+  static Registry* r = new Registry;
+  return *r;
+}
+
+// single writer, a plain load + store instead of a locked add
+inline void bump(std::atomic<uint64_t>& slot, uint64_t v) {
+  slot.store(slot.load(std::memory_order_relaxed) + v, std::memory_order_relaxed);
+}
+
+void add_slots(Metrics::Snapshot& s, const ThreadSlots& t) {
+  for (int m = 0; m < nr_metrics; m++) {
+    s.stages[m].calls += t.calls[m].load(std::memory_order_relaxed);
+    s.stages[m].ns += t.ns[m].load(std::memory_order_relaxed);
+    for (int b = 0; b < Metrics::nr_buckets; b++) {
+      s.stages[m].hist[b] += t.hist[m][b].load(std::memory_order_relaxed);
+    }
+  }
+  s.audio_ns += t.audio_ns.load(std::memory_order_relaxed);
+}
+
+// registers on a thread's first record, folds into |retired| at its exit
+struct SlotsHolder {
+  ThreadSlots* slots = new ThreadSlots;
+
+  SlotsHolder() {
+    Registry& r = registry();
+    std::lock_guard<std::mutex> lk(r.mtx);
+    r.live.push_back(slots);
+  }
+
+  ~SlotsHolder() {
+    Registry& r = registry();
+    std::lock_guard<std::mutex> lk(r.mtx);
+    add_slots(r.retired, *slots);
+    r.live.erase(std::find(r.live.begin(), r.live.end(), slots));
+    delete slots;
+  }
+};
+
+ThreadSlots& local_slots() {
+  thread_local SlotsHolder holder;
+  return *holder.slots;
+}
+
+thread_local bool local_muted = false;
+
+double bucket_secs(int b) {
+  return static_cast<double>(uint64_t(1) << b) / 1e9;
+}
+
+}
+
+const char* AVTool::metric_name(Metric m) {
+  int i = static_cast<int>(m);
+  return (i >= 0 && i < nr_metrics) ? metric_names[i] : "unknown";
+}
+
+uint64_t Metrics::Stage::quantile_ns(double q) const {
+  uint64_t want = static_cast<uint64_t>(q * calls);
+  uint64_t seen = 0;
+
+  if (calls == 0) {
+    return 0;
+  }
+
+  for (int b = 0; b < nr_buckets; b++) {
+    seen += hist[b];
+    if (seen > want || seen == calls) {
+      return uint64_t(1) << b;
+    }
+  }
+
+  return uint64_t(1) << (nr_buckets - 1);
+}
+
+double Metrics::Snapshot::ns_per_packet(Metric m) const {
+  uint64_t packets = stages[static_cast<int>(Metric::Read)].calls;
+  return packets ? static_cast<double>(stages[static_cast<int>(m)].ns) / packets : 0;
+}
+
+double Metrics::Snapshot::realtime_factor() const {
+  return (uptime > 0) ? (audio_ns / 1e9) / uptime : 0;
+}
+
+void Metrics::record(Metric m, uint64_t ns) {
+  if (local_muted) {
+    return;
+  }
+
+  ThreadSlots& t = local_slots();
+  int i = static_cast<int>(m);
+  int b = std::min(static_cast<int>(std::bit_width(ns)), nr_buckets - 1);
+
+  bump(t.calls[i], 1);
+  bump(t.ns[i], ns);
+  bump(t.hist[i][b], 1);
+}
+
+void Metrics::add_audio(uint64_t samples, int sample_rate) {
+  if (sample_rate > 0 && !local_muted) {
+    bump(local_slots().audio_ns, samples * 1000000000ull / sample_rate);
+  }
+}
+
+void Metrics::set_muted(bool muted) {
+  local_muted = muted;
+}
+
+bool Metrics::muted() {
+  return local_muted;
+}
+
+Metrics::Snapshot Metrics::snapshot() {
+  Registry& r = registry();
+  std::lock_guard<std::mutex> lk(r.mtx);
+  Snapshot s = r.retired;
+
+  for (const ThreadSlots* t : r.live) {
+    add_slots(s, *t);
+  }
+  s.uptime = std::chrono::duration<double>(std::chrono::steady_clock::now() - r.start).count();
+
+  return s;
+}
+
+void Metrics::write_json(std::ostream& os) {
+  Snapshot s = snapshot();
+
+  os << "{\"uptime_s\":" << s.uptime
+     << ",\"packets\":" << s.stages[static_cast<int>(Metric::Read)].calls
+     << ",\"audio_s\":" << s.audio_ns / 1e9
+     << ",\"realtime_factor\":" << s.realtime_factor()
+     << ",\"stages\":{";
+  for (int m = 0; m < nr_metrics; m++) {
+    const Stage& st = s.stages[m];
+    os << (m ? "," : "") << "\"" << metric_names[m] << "\":{"
+       << "\"calls\":" << st.calls
+       << ",\"total_ns\":" << st.ns
+       << ",\"ns_per_call\":" << (st.calls ? st.ns / st.calls : 0)
+       << ",\"ns_per_packet\":" << s.ns_per_packet(static_cast<Metric>(m))
+       << ",\"p50_ns\":" << st.quantile_ns(0.5)
+       << ",\"p99_ns\":" << st.quantile_ns(0.99)
+       << ",\"histogram\":[";
+    // [upper bound ns, count], empty buckets left out
+    bool first = true;
+    for (int b = 0; b < nr_buckets; b++) {
+      if (st.hist[b]) {
+        os << (first ? "" : ",") << "[" << (uint64_t(1) << b) << "," << st.hist[b] << "]";
+        first = false;
+      }
+    }
+    os << "]}";
+  }
+  os << "}}\n";
+}
+
+void Metrics::write_prometheus(std::ostream& os) {
+  Snapshot s = snapshot();
+
+  os << "# HELP avtool_packets_total Packets read from dumps.\n"
+     << "# TYPE avtool_packets_total counter\n"
+     << "avtool_packets_total " << s.stages[static_cast<int>(Metric::Read)].calls << "\n"
+     << "# HELP avtool_audio_seconds_total Audio decoded.\n"
+     << "# TYPE avtool_audio_seconds_total counter\n"
+     << "avtool_audio_seconds_total " << s.audio_ns / 1e9 << "\n"
+     << "# HELP avtool_realtime_factor Seconds of audio per second of wall clock.\n"
+     << "# TYPE avtool_realtime_factor gauge\n"
+     << "avtool_realtime_factor " << s.realtime_factor() << "\n"
+     << "# HELP avtool_stage_ns_per_packet Time spent in a stage per packet read.\n"
+     << "# TYPE avtool_stage_ns_per_packet gauge\n";
+  for (int m = 0; m < nr_metrics; m++) {
+    os << "avtool_stage_ns_per_packet{stage=\"" << metric_names[m] << "\"} "
+       << s.ns_per_packet(static_cast<Metric>(m)) << "\n";
+  }
+
+  os << "# HELP avtool_stage_latency_seconds Latency of one call into a stage.\n"
+     << "# TYPE avtool_stage_latency_seconds histogram\n";
+  for (int m = 0; m < nr_metrics; m++) {
+    const Stage& st = s.stages[m];
+    uint64_t cum = 0;
+    for (int b = 0; b < nr_buckets - 1; b++) {
+      cum += st.hist[b];
+      os << "avtool_stage_latency_seconds_bucket{stage=\"" << metric_names[m]
+         << "\",le=\"" << bucket_secs(b) << "\"} " << cum << "\n";
+    }
+    os << "avtool_stage_latency_seconds_bucket{stage=\"" << metric_names[m]
+       << "\",le=\"+Inf\"} " << st.calls << "\n"
+       << "avtool_stage_latency_seconds_sum{stage=\"" << metric_names[m] << "\"} "
+       << st.ns / 1e9 << "\n"
+       << "avtool_stage_latency_seconds_count{stage=\"" << metric_names[m] << "\"} "
+       << st.calls << "\n";
+  }
+}
+
+bool Metrics::dump(const std::string& format, const std::string& path) {
+  std::ostringstream oss;
+
+  if (format == "json") {
+    write_json(oss);
+  } else if (format == "prom") {
+    write_prometheus(oss);
+  } else {
+    return false;
+  }
+
+  if (path.empty() || path == "-") {
+    std::cerr << oss.str() << std::flush;
+    return true;
+  }
+
+  // readers never see a half written file
+  std::string tmp = path + ".tmp";
+  {
+    std::ofstream ofs(tmp, std::ios::trunc);
+    if (!(ofs << oss.str()) || !ofs.flush()) {
+      std::remove(tmp.c_str());
+      return false;
+    }
+  }
+
+  return std::rename(tmp.c_str(), path.c_str()) == 0;
+}
+
+bool Metrics::dump_on_signal(int signo, const std::string& format, const std::string& path) {
+  sigset_t set;
+
+  sigemptyset(&set);
+  sigaddset(&set, signo);
+  if (pthread_sigmask(SIG_BLOCK, &set, NULL) != 0) {
+    return false;
+  }
+
+  // the start of the clock, not the first record
+  registry();
+
+  try {
+    std::thread([set, format, path] {
+      int sig = 0;
+      while (sigwait(&set, &sig) == 0) {
+        dump(format, path);
+      }
+    }).detach();
+  } catch (std::system_error&) {
+    return false;
+  }
+
+  return true;
+}
@@ -0,0 +1,143 @@
+//
+//  metrics.hpp
+//  avtool
+//
+//  Created by zhanwang-sky on 2023/11/27.
+//
+
+#ifndef metrics_hpp
+#define metrics_hpp
+
+#include <chrono>
+#include <cstdint>
+#include <ostream>
+#include <string>
+
+// build with -DAVTOOL_NO_METRICS to compile the timers out entirely
+#if defined(AVTOOL_NO_METRICS)
+#define AVTOOL_METRICS 0
+#else
+#define AVTOOL_METRICS 1
+#endif
+
+namespace AVTool {
+
+// where the time goes, one counter set and histogram each
+enum class Metric {
+  Read,      // next packet from the dump
+  Decode,    // Opus decode / conceal
+  Resample,
+  Stretch,   // RubberBand process + retrieve
+  Encode,    // avcodec send / receive
+  Mux,       // packet write, AVIOContext flushes included
+  Count
+};
+
+const char* metric_name(Metric m);
+
+// Process wide counters and fixed-bucket latency histograms. Every thread
+// records into slots of its own (plain stores, no lock, no shared cache
+// line), a reader sums them up. The counts of threads that are gone are
+// kept.
+class Metrics {
+ public:
+  // bucket i holds latencies below 2^i ns, the last one everything above
+  static constexpr int nr_buckets = 40;
+
+  struct Stage {
+    uint64_t calls = 0;
+    uint64_t ns = 0;
+    uint64_t hist[nr_buckets] = {};
+
+    // upper bound of the bucket holding quantile |q|, 0 if no calls
+    uint64_t quantile_ns(double q) const;
+  };
+
+  struct Snapshot {
+    Stage stages[static_cast<int>(Metric::Count)];
+    uint64_t audio_ns = 0;  // decoded audio, see add_audio()
+    double uptime = 0;      // seconds since the metrics were first touched
+
+    // per packet read, 0 if none
+    double ns_per_packet(Metric m) const;
+
+    // seconds of audio per second of wall clock
+    double realtime_factor() const;
+  };
+
+  static void record(Metric m, uint64_t ns);
+
+  // |samples| at |sample_rate| went through, for the realtime factor
+  static void add_audio(uint64_t samples, int sample_rate);
+
+  // while muted, record() and add_audio() on the calling thread are no-ops.
+  // per thread, so other jobs keep recording. threads started for muted
+  // work have to mute themselves, see muted()
+  static void set_muted(bool muted);
+
+  static bool muted();
+
+  static Snapshot snapshot();
+
+  static void write_json(std::ostream& os);
+
+  static void write_prometheus(std::ostream& os);
+
+  // |format| "json" or "prom". |path| empty or "-": stderr, otherwise
+  // replaced atomically (e.g. for a node_exporter textfile collector).
+  // returns false on an unknown format or a failed write
+  static bool dump(const std::string& format, const std::string& path);
+
+  // dump() from a helper thread whenever |signo| arrives. blocks |signo|
+  // in the calling thread, call it before starting any other thread so
+  // they all inherit that. returns false if the thread cannot be started
+  static bool dump_on_signal(int signo, const std::string& format, const std::string& path);
+};
+
+// mutes the calling thread for its scope, e.g. a pass that is not part
+// of the measured work
+class MetricsMute {
+ public:
+  MetricsMute(const MetricsMute&) = delete;
+  MetricsMute& operator=(const MetricsMute&) = delete;
+
+  MetricsMute() : was_muted_(Metrics::muted()) { Metrics::set_muted(true); }
+
+  ~MetricsMute() { Metrics::set_muted(was_muted_); }
+
+ private:
+  bool was_muted_;
+};
+
+// times its scope into a Metric
+class ScopedTimer {
+ public:
+  ScopedTimer(const ScopedTimer&) = delete;
+  ScopedTimer& operator=(const ScopedTimer&) = delete;
+
+  explicit ScopedTimer(Metric m) : m_(m), start_(std::chrono::steady_clock::now()) { }
+
+  ~ScopedTimer() {
+    Metrics::record(m_, std::chrono::duration_cast<std::chrono::nanoseconds>(
+                            std::chrono::steady_clock::now() - start_).count());
+  }
+
+ private:
+  Metric m_;
+  std::chrono::steady_clock::time_point start_;
+};
+
+}
+
+#define avtool_concat_(a, b) a##b
+#define avtool_concat(a, b) avtool_concat_(a, b)
+
+#if AVTOOL_METRICS
+#define avtool_time_scope(m) AVTool::ScopedTimer avtool_concat(timer_, __LINE__)(m)
+#define avtool_add_audio(samples, rate) AVTool::Metrics::add_audio(samples, rate)
+#else
+#define avtool_time_scope(m) do { } while (0)
+#define avtool_add_audio(samples, rate) do { } while (0)
+#endif
+
+#endif /* metrics_hpp */
@@ -0,0 +1,353 @@
+//
+//  output_sink.cpp
+//  avtool
+//
+//  Created by zhanwang-sky on 2023/11/26.
+//
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include "output_sink.hpp"
+
+using namespace AVTool;
+
+namespace {
+
+int pwrite_all(int fd, const uint8_t* data, size_t size, int64_t offset) {
+  while (size > 0) {
+    ssize_t n = pwrite(fd, data, size, offset);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+    data += n;
+    size -= n;
+    offset += n;
+  }
+
+  return 0;
+}
+
+// the new position for lseek() style arguments, < 0 if invalid
+int64_t seek_target(int64_t offset, int whence, int64_t pos, int64_t size) {
+  switch (whence & ~AVSEEK_FORCE) {
+    case SEEK_SET:
+      break;
+    case SEEK_CUR:
+      offset += pos;
+      break;
+    case SEEK_END:
+      offset += size;
+      break;
+    default:
+      return AVERROR(EINVAL);
+  }
+
+  return (offset < 0) ? AVERROR(EINVAL) : offset;
+}
+
+}
+
+OutputSink::OutputSink(int buffer_size, bool seekable) noexcept {
+  uint8_t* buf = static_cast<uint8_t*>(av_malloc(buffer_size));
+
+  if (!buf) {
+    return;
+  }
+
+  pb_ = avio_alloc_context(buf, buffer_size, 1, this, NULL, write_packet,
+                           seekable ? seek_packet : NULL);
+  if (!pb_) {
+    av_free(buf);
+  }
+}
+
+OutputSink::~OutputSink() {
+  close();
+}
+
+bool OutputSink::operator!() const {
+  return !pb_;
+}
+
+int OutputSink::flush() {
+  if (!pb_) {
+    return AVERROR(EINVAL);
+  }
+
+  avio_flush(pb_);
+
+  return pb_->error;
+}
+
+int64_t OutputSink::seek(int64_t, int) {
+  return AVERROR(ENOSYS);
+}
+
+void OutputSink::close() {
+  if (!pb_) {
+    return;
+  }
+
+  avio_flush(pb_);
+  // ours, the AVIOContext does not free it
+  av_freep(&pb_->buffer);
+  avio_context_free(&pb_);
+}
+
+int OutputSink::write_packet(void* opaque, AVTOOL_AVIO_WRITE_CONST uint8_t* buf, int buf_size) {
+  return static_cast<OutputSink*>(opaque)->write(buf, buf_size);
+}
+
+int64_t OutputSink::seek_packet(void* opaque, int64_t offset, int whence) {
+  return static_cast<OutputSink*>(opaque)->seek(offset, whence);
+}
+
+FileSink::FileSink(const std::string& filename, int buffer_size, bool direct, int64_t preallocate)
+  noexcept
+#if defined(__linux__)
+    // with O_DIRECT the big buffer is the aligned staging one
+    : OutputSink(direct ? default_buffer_size : buffer_size, true) {
+#else
+    : OutputSink(buffer_size, true) {
+#endif
+  if (!(*this)) {
+    return;
+  }
+
+  fd_ = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd_ < 0) {
+    close();
+    return;
+  }
+
+  if (preallocate > 0) {
+    // reserve the extents up front, best effort
+#if defined(__linux__)
+    (void) fallocate(fd_, FALLOC_FL_KEEP_SIZE, 0, preallocate);
+#elif defined(F_PREALLOCATE)
+    fstore_t fst = {F_ALLOCATECONTIG, F_PEOFPOSMODE, 0, preallocate, 0};
+    if (fcntl(fd_, F_PREALLOCATE, &fst) < 0) {
+      fst.fst_flags = F_ALLOCATEALL;
+      (void) fcntl(fd_, F_PREALLOCATE, &fst);
+    }
+#endif
+  }
+
+  if (direct) {
+#if defined(__linux__)
+    // aligned blocks go through a second descriptor, the ragged ends
+    // through fd_. no O_DIRECT (e.g. tmpfs): plain buffered writes
+    direct_fd_ = open(filename.c_str(), O_WRONLY | O_DIRECT | O_CLOEXEC);
+    if (direct_fd_ >= 0) {
+      staging_cap_ = (std::max(buffer_size, direct_align) + direct_align - 1)
+                     / direct_align * direct_align;
+      if (posix_memalign(reinterpret_cast<void**>(&staging_), direct_align, staging_cap_) != 0) {
+        staging_ = NULL;
+        ::close(direct_fd_);
+        direct_fd_ = -1;
+      }
+    }
+#elif defined(F_NOCACHE)
+    (void) fcntl(fd_, F_NOCACHE, 1);
+#endif
+  }
+}
+
+FileSink::~FileSink() {
+  // the last AVIOContext bytes may land in staging_
+  close();
+
+  if (direct_fd_ >= 0) {
+    flush_staging(true);
+    ::close(direct_fd_);
+  }
+
+  if (fd_ >= 0) {
+    ::close(fd_);
+  }
+
+  free(staging_);
+}
+
+int FileSink::write(const uint8_t* data, int size) {
+  int rc = 0;
+
+  if (direct_fd_ < 0) {
+    if (pwrite_all(fd_, data, size, pos_) < 0) {
+      return AVERROR(errno);
+    }
+  } else {
+    if (lead_ == staged_) {
+      // empty, restart at the block holding pos_
+      staging_base_ = pos_ / direct_align * direct_align;
+      lead_ = staged_ = static_cast<int>(pos_ - staging_base_);
+    }
+    for (int done = 0; done < size; ) {
+      int n = std::min(size - done, staging_cap_ - staged_);
+      memcpy(staging_ + staged_, data + done, n);
+      staged_ += n;
+      done += n;
+      if (staged_ == staging_cap_) {
+        rc = flush_staging(false);
+        if (rc < 0) {
+          return rc;
+        }
+      }
+    }
+  }
+
+  pos_ += size;
+  size_ = std::max(size_, pos_);
+
+  return size;
+}
+
+int64_t FileSink::seek(int64_t offset, int whence) {
+  int rc = 0;
+
+  if (whence == AVSEEK_SIZE) {
+    return size_;
+  }
+
+  offset = seek_target(offset, whence, pos_, size_);
+  if (offset < 0) {
+    return offset;
+  }
+
+  // staging only ever holds a contiguous run
+  if (direct_fd_ >= 0 && lead_ != staged_) {
+    rc = flush_staging(true);
+    if (rc < 0) {
+      return rc;
+    }
+  }
+
+  pos_ = offset;
+
+  return pos_;
+}
+
+int FileSink::flush_staging(bool all) {
+  // [lead_, first) and [last, staged_) are partial blocks
+  int first = std::min((lead_ + direct_align - 1) / direct_align * direct_align, staged_);
+  int last = std::max(staged_ / direct_align * direct_align, first);
+  int tail = 0;
+
+  if (first > lead_ &&
+      pwrite_all(fd_, staging_ + lead_, first - lead_, staging_base_ + lead_) < 0) {
+    return AVERROR(errno);
+  }
+
+  if (last > first &&
+      pwrite_all(direct_fd_, staging_ + first, last - first, staging_base_ + first) < 0) {
+    return AVERROR(errno);
+  }
+
+  if (all) {
+    if (staged_ > last &&
+        pwrite_all(fd_, staging_ + last, staged_ - last, staging_base_ + last) < 0) {
+      return AVERROR(errno);
+    }
+    lead_ = staged_ = 0;
+    return 0;
+  }
+
+  // keep the partial block for the next round, it stays aligned
+  tail = staged_ - last;
+  memmove(staging_, staging_ + last, tail);
+  staging_base_ += last;
+  lead_ = 0;
+  staged_ = tail;
+
+  return 0;
+}
+
+MemorySink::MemorySink(size_t reserve, int buffer_size) noexcept
+    : OutputSink(buffer_size, true) {
+  try {
+    data_.reserve(reserve);
+  } catch (...) {
+    close();
+  }
+}
+
+MemorySink::~MemorySink() {
+  close();
+}
+
+const std::vector<uint8_t>& MemorySink::data() {
+  flush();
+  return data_;
+}
+
+std::vector<uint8_t> MemorySink::release() {
+  std::vector<uint8_t> out;
+
+  flush();
+  out.swap(data_);
+  base_ += static_cast<int64_t>(out.size());
+
+  return out;
+}
+
+int MemorySink::write(const uint8_t* data, int size) {
+  size_t off = 0;
+
+  if (pos_ < base_) {
+    // already released
+    return AVERROR(EINVAL);
+  }
+
+  off = static_cast<size_t>(pos_ - base_);
+  try {
+    if (off + size > data_.size()) {
+      data_.resize(off + size);
+    }
+  } catch (...) {
+    return AVERROR(ENOMEM);
+  }
+  memcpy(data_.data() + off, data, size);
+  pos_ += size;
+
+  return size;
+}
+
+int64_t MemorySink::seek(int64_t offset, int whence) {
+  int64_t size = base_ + static_cast<int64_t>(data_.size());
+
+  if (whence == AVSEEK_SIZE) {
+    return size;
+  }
+
+  offset = seek_target(offset, whence, pos_, size);
+  if (offset < 0) {
+    return offset;
+  }
+  pos_ = offset;
+
+  return pos_;
+}
+
+CallbackSink::CallbackSink(WriteFn fn, int buffer_size) noexcept
+    : OutputSink(buffer_size, false),
+      fn_(std::move(fn)) {
+  if (!fn_) {
+    close();
+  }
+}
+
+CallbackSink::~CallbackSink() {
+  close();
+}
+
+int CallbackSink::write(const uint8_t* data, int size) {
+  int rc = fn_(data, size);
+  return (rc < 0) ? rc : size;
+}
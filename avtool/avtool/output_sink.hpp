@@ -0,0 +1,160 @@
+//
+//  output_sink.hpp
+//  avtool
+//
+//  Created by zhanwang-sky on 2023/11/26.
+//
+
+#ifndef output_sink_hpp
+#define output_sink_hpp
+
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+extern "C" {
+#include <libavformat/avformat.h>
+#include <libavformat/version.h>
+}
+
+// avio_alloc_context() takes a const write_packet buffer since lavf 61
+// (FFmpeg 7), the FF_API_ macro that announced it goes away with the bump
+#if LIBAVFORMAT_VERSION_MAJOR >= 61
+#define AVTOOL_AVIO_WRITE_CONST const
+#else
+#define AVTOOL_AVIO_WRITE_CONST
+#endif
+
+namespace AVTool {
+
+// Where a muxer's bytes go. Wraps a custom AVIOContext (avio_alloc_context)
+// around write() / seek(), so AudioDumper can target a file, memory or a
+// callback alike, with a buffer size of our choosing.
+class OutputSink {
+ public:
+  static constexpr int default_buffer_size = 1 << 16;
+
+  OutputSink(const OutputSink&) = delete;
+  OutputSink& operator=(const OutputSink&) = delete;
+
+  virtual ~OutputSink();
+
+  bool operator!() const;
+
+  // hand to AVFormatContext::pb together with AVFMT_FLAG_CUSTOM_IO
+  AVIOContext* avio() const { return pb_; }
+
+  // push out what the AVIOContext still buffers, < 0 on error
+  int flush();
+
+ protected:
+  // |seekable|: seek() is implemented, muxers can patch headers
+  OutputSink(int buffer_size, bool seekable) noexcept;
+
+  // all |size| bytes at the current position, returns |size| or AVERROR
+  virtual int write(const uint8_t* data, int size) = 0;
+
+  // lseek() semantics, plus AVSEEK_SIZE
+  virtual int64_t seek(int64_t offset, int whence);
+
+  // flush and free the AVIOContext. derived destructors call it first,
+  // write() is no longer virtual by the time ~OutputSink() runs
+  void close();
+
+ private:
+  static int write_packet(void* opaque, AVTOOL_AVIO_WRITE_CONST uint8_t* buf, int buf_size);
+
+  static int64_t seek_packet(void* opaque, int64_t offset, int whence);
+
+  AVIOContext* pb_ = NULL;
+};
+
+// Large-buffer file writer, few big write(2)s instead of FFmpeg's 32KB ones.
+class FileSink : public OutputSink {
+ public:
+  static constexpr int default_file_buffer_size = 1 << 20;
+
+  // O_DIRECT granularity, also the staging buffer's alignment
+  static constexpr int direct_align = 4096;
+
+  // |direct|: bypass the page cache (O_DIRECT on Linux, F_NOCACHE on macOS).
+  // |preallocate|: bytes reserved up front, the file size is not changed
+  FileSink(const std::string& filename,
+           int buffer_size = default_file_buffer_size,
+           bool direct = false,
+           int64_t preallocate = 0) noexcept;
+
+  ~FileSink() override;
+
+ protected:
+  int write(const uint8_t* data, int size) override;
+
+  int64_t seek(int64_t offset, int whence) override;
+
+ private:
+  // O_DIRECT path, whole aligned blocks direct, the ragged ends through
+  // the page cache. |all|: also the partial block at the end
+  int flush_staging(bool all);
+
+  int fd_ = -1;
+  int direct_fd_ = -1;  // Linux O_DIRECT only
+  int64_t pos_ = 0;
+  int64_t size_ = 0;
+
+  // O_DIRECT staging, staging_[i] is at file offset staging_base_ + i
+  uint8_t* staging_ = NULL;
+  int staging_cap_ = 0;
+  int64_t staging_base_ = 0;  // multiple of direct_align
+  int lead_ = 0;              // first valid byte
+  int staged_ = 0;            // end of valid bytes
+};
+
+// Growable memory buffer, for embedding without touching the filesystem.
+class MemorySink : public OutputSink {
+ public:
+  explicit MemorySink(size_t reserve = 0,
+                      int buffer_size = default_buffer_size) noexcept;
+
+  ~MemorySink() override;
+
+  // encoded bytes so far, complete once the AudioDumper is gone
+  const std::vector<uint8_t>& data();
+
+  // hands the bytes over and keeps going, e.g. to stream them out while
+  // encoding. seeking back into released bytes fails, so muxers that patch
+  // their header at the end need it still here
+  std::vector<uint8_t> release();
+
+ protected:
+  int write(const uint8_t* data, int size) override;
+
+  int64_t seek(int64_t offset, int whence) override;
+
+ private:
+  std::vector<uint8_t> data_;
+  int64_t base_ = 0;  // stream offset of data_[0]
+  int64_t pos_ = 0;
+};
+
+// Forwards the bytes to a user callback, not seekable. Muxers that patch
+// their header at the end (e.g. WAV sizes) leave it as written.
+class CallbackSink : public OutputSink {
+ public:
+  // returns < 0 to fail the write
+  typedef std::function<int(const uint8_t* data, int size)> WriteFn;
+
+  explicit CallbackSink(WriteFn fn, int buffer_size = default_buffer_size) noexcept;
+
+  ~CallbackSink() override;
+
+ protected:
+  int write(const uint8_t* data, int size) override;
+
+ private:
+  WriteFn fn_;
+};
+
+}
+
+#endif /* output_sink_hpp */
@@ -0,0 +1,494 @@
+//
+//  pipeline.cpp
+//  avtool
+//
+//  Created by zhanwang-sky on 2023/11/27.
+//
+
+#include <algorithm>
+#include <climits>
+#include <cstdlib>
+#include <sstream>
+#include <stdexcept>
+#include <system_error>
+#include "metrics.hpp"
+#include "pipeline.hpp"
+
+using namespace AVTool;
+
+int Stage::emit(const AVFrame* frame) {
+  if (frame) {
+    samples_out_.fetch_add(frame->nb_samples, std::memory_order_relaxed);
+  }
+
+  return next_ ? next_->push(frame) : 0;
+}
+
+RebatchStage::RebatchStage(int batch)
+    : Stage("batch"),
+      batch_(batch) {
+  // sanity check
+  if (batch <= 0 || batch > max_block) {
+    throw std::runtime_error("Batch size out of range");
+  }
+
+  out_ = av_frame_alloc();
+  if (!out_) {
+    throw std::runtime_error("Error allocating audio frame");
+  }
+}
+
+RebatchStage::~RebatchStage() {
+  if (af_) {
+    av_audio_fifo_free(af_);
+  }
+  av_frame_free(&out_);
+}
+
+int RebatchStage::push(const AVFrame* frame) {
+  int rc = 0;
+
+  if (!frame) {
+    // the short tail. the end of stream goes on regardless, so whatever
+    // is downstream still gets finalized
+    if (af_ && av_audio_fifo_size(af_) > 0) {
+      rc = emit_batch(av_audio_fifo_size(af_));
+    }
+    return std::min(rc, emit(NULL));
+  }
+
+  if (frame->nb_samples <= 0) {
+    return 0;
+  }
+
+  if (!af_) {
+    fmt_ = static_cast<enum AVSampleFormat>(frame->format);
+    af_ = av_audio_fifo_alloc(fmt_, frame->ch_layout.nb_channels, 2 * batch_);
+    pool_.reset(new FramePool(fmt_, frame->ch_layout, frame->sample_rate, batch_));
+    if (!af_ || !(*pool_)) {
+      return AVERROR(ENOMEM);
+    }
+  } else if (frame->format != fmt_) {
+    return INT_MIN;
+  }
+
+  if (av_audio_fifo_size(af_) == 0 && frame->nb_samples == batch_) {
+    return emit(frame);
+  }
+
+  if (av_audio_fifo_write(af_, reinterpret_cast<void**>(frame->extended_data),
+                          frame->nb_samples) < frame->nb_samples) {
+    return AVERROR(ENOMEM);
+  }
+
+  while (av_audio_fifo_size(af_) >= batch_) {
+    rc = emit_batch(batch_);
+    if (rc < 0) {
+      return rc;
+    }
+  }
+
+  return 0;
+}
+
+int RebatchStage::emit_batch(int nb_samples) {
+  int rc = 0;
+
+  if (pool_->get(out_, nb_samples) < 0) {
+    return AVERROR(ENOMEM);
+  }
+
+  if (av_audio_fifo_read(af_, reinterpret_cast<void**>(out_->extended_data), nb_samples) < nb_samples) {
+    av_frame_unref(out_);
+    return -1;
+  }
+
+  rc = emit(out_);
+  av_frame_unref(out_);
+
+  return rc;
+}
+
+WorkerStage::WorkerStage(Stage& inner, int depth)
+    : Stage(inner.name()),
+      inner_(inner),
+      muted_(Metrics::muted()),
+      ring_(depth) {
+  if (!ring_) {
+    throw std::runtime_error("Could not allocate queue for '" + name() + "'");
+  }
+
+  try {
+    thread_ = std::thread(&WorkerStage::loop, this);
+  } catch (std::system_error&) {
+    throw std::runtime_error("Could not start worker for '" + name() + "'");
+  }
+}
+
+WorkerStage::~WorkerStage() {
+  // the ring frees what the worker did not get to
+  ring_.abort();
+  eos_done_.notify_all();
+  thread_.join();
+}
+
+int WorkerStage::push(const AVFrame* frame) {
+  AVFrame* ref = NULL;
+  uint32_t eos = 0;
+  int rc = error_.load(std::memory_order_acquire);
+
+  if (frame && rc < 0) {
+    return rc;
+  }
+
+  if (frame) {
+    // the caller may reuse |frame| as soon as we return
+    ref = av_frame_clone(frame);
+    if (!ref) {
+      return AVERROR(ENOMEM);
+    }
+  }
+
+  while (!ring_.push(ref)) {
+    if (!ring_.wait_for_write()) {
+      av_frame_free(&ref);
+      return AVERROR_EXIT;
+    }
+  }
+
+  if (frame) {
+    return 0;
+  }
+
+  // end of stream, wait until everything downstream is flushed
+  eos = ++eos_sent_;
+  for (;;) {
+    uint32_t done = eos_done_.load(std::memory_order_acquire);
+    if (static_cast<int32_t>(done - eos) >= 0) {
+      break;
+    }
+    if (ring_.aborted()) {
+      return AVERROR_EXIT;
+    }
+    eos_done_.wait(done, std::memory_order_acquire);
+  }
+
+  return error_.load(std::memory_order_acquire);
+}
+
+void WorkerStage::loop() {
+  Metrics::set_muted(muted_);
+
+  for (;;) {
+    AVFrame** slots = NULL;
+    // whatever is queued, taken in place: one look at the producer's index
+    int n = ring_.read_begin(ring_.capacity(), slots);
+
+    if (n == 0) {
+      if (!ring_.wait_for_read()) {
+        return;
+      }
+      continue;
+    }
+
+    for (int i = 0; i < n; i++) {
+      bool eos = !slots[i];
+      int rc = 0;
+
+      if (ring_.aborted()) {
+        // torn down, what is still queued is dropped, not encoded: the
+        // ring frees the uncommitted rest
+        return;
+      }
+
+      rc = error_.load(std::memory_order_relaxed);
+      // after an error only the end of stream goes on, so the outputs still
+      // get finalized
+      if (eos || rc >= 0) {
+        rc = inner_.push(slots[i]);
+      }
+      av_frame_free(&slots[i]);
+      // one at a time, the producer gets the slot back right away
+      ring_.read_commit(1);
+
+      if (rc < 0 && error_.load(std::memory_order_relaxed) >= 0) {
+        error_.store(rc, std::memory_order_release);
+      }
+      if (eos) {
+        eos_done_.fetch_add(1, std::memory_order_release);
+        eos_done_.notify_all();
+      }
+    }
+  }
+}
+
+ResampleStage::ResampleStage(Resampler& resampler,
+                             enum AVSampleFormat out_sample_fmt,
+                             const AVChannelLayout& out_chlayout,
+                             int out_sample_rate)
+    : Stage("resample"),
+      resampler_(resampler),
+      pool_(out_sample_fmt, out_chlayout, out_sample_rate, max_block) {
+  if (!pool_) {
+    throw std::runtime_error("Could not allocate frame pool");
+  }
+
+  out_ = av_frame_alloc();
+  if (!out_) {
+    throw std::runtime_error("Error allocating audio frame");
+  }
+}
+
+ResampleStage::~ResampleStage() {
+  av_frame_free(&out_);
+}
+
+int ResampleStage::push(const AVFrame* frame) {
+  int done = 0;
+  int rc = 0;
+
+  if (!frame) {
+    // the filter delay
+    if (pool_.get(out_, pool_.max_samples()) < 0) {
+      rc = AVERROR(ENOMEM);
+    } else {
+      {
+        avtool_time_scope(Metric::Resample);
+        rc = resampler_.drain(out_);
+      }
+      if (rc > 0) {
+        rc = emit(out_);
+      }
+      av_frame_unref(out_);
+    }
+    return std::min(rc, emit(NULL));
+  }
+
+  while (done < frame->nb_samples) {
+    int n = frame->nb_samples - done;
+    // whatever fits into one output block
+    while (n > 1 && resampler_.max_out_samples(n) > pool_.max_samples()) {
+      n /= 2;
+    }
+
+    const uint8_t* in[AV_NUM_DATA_POINTERS] = {};
+    int planes = av_sample_fmt_is_planar(static_cast<enum AVSampleFormat>(frame->format))
+                 ? frame->ch_layout.nb_channels : 1;
+    int bytes = av_get_bytes_per_sample(static_cast<enum AVSampleFormat>(frame->format))
+                * (planes > 1 ? 1 : frame->ch_layout.nb_channels);
+    if (planes > AV_NUM_DATA_POINTERS) {
+      return INT_MIN;
+    }
+    for (int i = 0; i < planes; i++) {
+      in[i] = frame->extended_data[i] + static_cast<size_t>(done) * bytes;
+    }
+
+    if (pool_.get(out_, pool_.max_samples()) < 0) {
+      return AVERROR(ENOMEM);
+    }
+    {
+      avtool_time_scope(Metric::Resample);
+      rc = resampler_.resample(out_, in, n);
+    }
+    if (rc > 0) {
+      rc = emit(out_);
+    }
+    av_frame_unref(out_);
+    if (rc < 0) {
+      return rc;
+    }
+    done += n;
+  }
+
+  return 0;
+}
+
+StretchStage::StretchStage(RubberBand::RubberBandStretcher& stretcher,
+                           const AVChannelLayout& chlayout,
+                           int sample_rate)
+    : Stage("stretch"),
+      stretcher_(stretcher),
+      pool_(AV_SAMPLE_FMT_FLTP, chlayout, sample_rate, max_block) {
+  if (!pool_) {
+    throw std::runtime_error("Could not allocate frame pool");
+  }
+
+  out_ = av_frame_alloc();
+  if (!out_) {
+    throw std::runtime_error("Error allocating audio frame");
+  }
+}
+
+StretchStage::~StretchStage() {
+  av_frame_free(&out_);
+}
+
+int StretchStage::push(const AVFrame* frame) {
+  int rc = 0;
+
+  if (frame) {
+    if (frame->format != AV_SAMPLE_FMT_FLTP) {
+      return INT_MIN;
+    }
+    if (frame->nb_samples <= 0) {
+      return 0;
+    }
+    {
+      avtool_time_scope(Metric::Stretch);
+      stretcher_.process(reinterpret_cast<const float* const*>(frame->extended_data),
+                         frame->nb_samples, false);
+    }
+    return retrieve();
+  }
+
+  // the stretcher's tail, it wants valid (if unused) planes
+  if (pool_.get(out_, 1) < 0) {
+    rc = AVERROR(ENOMEM);
+  } else {
+    {
+      avtool_time_scope(Metric::Stretch);
+      stretcher_.process(reinterpret_cast<const float* const*>(out_->extended_data), 0, true);
+    }
+    av_frame_unref(out_);
+    rc = retrieve();
+  }
+
+  return std::min(rc, emit(NULL));
+}
+
+int StretchStage::retrieve() {
+  int samples = 0;
+  int rc = 0;
+
+  while ((samples = stretcher_.available()) > 0) {
+    int n = std::min(samples, pool_.max_samples());
+    if (pool_.get(out_, n) < 0) {
+      return AVERROR(ENOMEM);
+    }
+    {
+      avtool_time_scope(Metric::Stretch);
+      n = static_cast<int>(stretcher_.retrieve(reinterpret_cast<float* const*>(out_->extended_data), n));
+    }
+    if (n <= 0) {
+      av_frame_unref(out_);
+      break;
+    }
+    out_->nb_samples = n;
+    rc = emit(out_);
+    av_frame_unref(out_);
+    if (rc < 0) {
+      return rc;
+    }
+  }
+
+  return 0;
+}
+
+int StudyStage::push(const AVFrame* frame) {
+  avtool_time_scope(Metric::Stretch);
+
+  if (!frame) {
+    stretcher_.study(silence_.data(), 0, true);
+    return 0;
+  }
+
+  if (frame->format != AV_SAMPLE_FMT_FLTP) {
+    return INT_MIN;
+  }
+  if (frame->nb_samples > 0) {
+    stretcher_.study(reinterpret_cast<const float* const*>(frame->extended_data),
+                     frame->nb_samples, false);
+  }
+
+  return 0;
+}
+
+int OutputStage::push(const AVFrame* frame) {
+  return frame ? outputs_.dump(frame) : outputs_.dump(NULL, 0);
+}
+
+bool AVTool::parse_pipeline(const char* spec, std::vector<StageSpec>& stages) {
+  std::istringstream stages_iss(spec);
+  std::string stage;
+
+  while (std::getline(stages_iss, stage, ',')) {
+    std::istringstream opts_iss(stage);
+    std::string opt;
+    StageSpec s;
+
+    if (!std::getline(opts_iss, s.name, ':') || s.name.empty()) {
+      return false;
+    }
+
+    while (std::getline(opts_iss, opt, ':')) {
+      size_t eq = opt.find('=');
+      std::string key = opt.substr(0, eq);
+      char* end = NULL;
+      long val = 0;
+
+      if (key == "thread" && eq == std::string::npos) {
+        s.thread = true;
+        continue;
+      }
+      if (eq == std::string::npos) {
+        return false;
+      }
+      val = strtol(opt.c_str() + eq + 1, &end, 10);
+      if (end == opt.c_str() + eq + 1 || *end != '\0' || val < 0 || val > Stage::max_block) {
+        return false;
+      }
+      if (key == "batch") {
+        s.batch = static_cast<int>(val);
+      } else if (key == "queue" && val > 0) {
+        s.queue = static_cast<int>(val);
+      } else {
+        return false;
+      }
+    }
+
+    stages.push_back(s);
+  }
+
+  return true;
+}
+
+Pipeline::~Pipeline() {
+  // a worker goes before anything it pushes into
+  for (std::unique_ptr<Stage>& stage : stages_) {
+    stage.reset();
+  }
+}
+
+void Pipeline::add(std::unique_ptr<Stage> stage, const StageSpec& spec) {
+  std::vector<std::unique_ptr<Stage>> wrappers;
+  Stage* entry = stage.get();
+
+  if (spec.batch > 0) {
+    std::unique_ptr<Stage> rebatch(new RebatchStage(spec.batch));
+    rebatch->connect(entry);
+    entry = rebatch.get();
+    wrappers.insert(wrappers.begin(), std::move(rebatch));
+  }
+
+  if (spec.thread) {
+    std::unique_ptr<Stage> worker(new WorkerStage(*entry, spec.queue));
+    entry = worker.get();
+    wrappers.insert(wrappers.begin(), std::move(worker));
+  }
+
+  if (tail_) {
+    tail_->connect(entry);
+  } else {
+    head_ = entry;
+  }
+  tail_ = stage.get();
+
+  for (std::unique_ptr<Stage>& w : wrappers) {
+    stages_.push_back(std::move(w));
+  }
+  stages_.push_back(std::move(stage));
+}
+
+int Pipeline::push(const AVFrame* frame) {
+  return head_ ? head_->push(frame) : 0;
+}
@@ -0,0 +1,235 @@
+//
+//  pipeline.hpp
+//  avtool
+//
+//  Created by zhanwang-sky on 2023/11/27.
+//
+
+#ifndef pipeline_hpp
+#define pipeline_hpp
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+extern "C" {
+#include <libavutil/audio_fifo.h>
+#include <libavutil/frame.h>
+}
+
+#include <rubberband/RubberBandStretcher.h>
+#include "audio_helper.hpp"
+#include "frame_ring.hpp"
+#include "media_dumper.hpp"
+
+namespace AVTool {
+
+// One step of a processing chain. Sample blocks travel downstream as
+// refcounted AVFrames passed by reference: a stage that keeps a block past
+// push() takes its own reference, a stage that emits one owns it (usually
+// from a FramePool) and may reuse it once emit() returns.
+class Stage {
+ public:
+  // largest block a stage emits, what AudioDumper takes in one go
+  static constexpr int max_block = AudioDumper::max_frame_size;
+
+  Stage(const Stage&) = delete;
+  Stage& operator=(const Stage&) = delete;
+
+  explicit Stage(const std::string& name) : name_(name) { }
+
+  virtual ~Stage() = default;
+
+  const std::string& name() const { return name_; }
+
+  // where emit() goes, NULL: nowhere (a sink)
+  void connect(Stage* next) { next_ = next; }
+
+  // one block in, zero or more out. |frame| NULL: end of stream, flush and
+  // pass it on (even after an error), so everything downstream is flushed
+  // when this returns. < 0 on error
+  virtual int push(const AVFrame* frame) = 0;
+
+  // samples handed downstream so far, safe to read from any thread
+  uint64_t samples_out() const { return samples_out_.load(std::memory_order_relaxed); }
+
+ protected:
+  int emit(const AVFrame* frame);
+
+ private:
+  std::string name_;
+  Stage* next_ = NULL;
+  std::atomic<uint64_t> samples_out_{0};
+};
+
+// Regroups blocks into |batch| samples (the last one may be shorter), fewer
+// calls with more work each for the next stage. A block that already has
+// the right size is passed through as is.
+class RebatchStage : public Stage {
+ public:
+  // throws std::runtime_error if |batch| is out of range
+  explicit RebatchStage(int batch);
+
+  ~RebatchStage() override;
+
+  int push(const AVFrame* frame) override;
+
+ private:
+  int emit_batch(int nb_samples);
+
+  int batch_;
+
+  // set up by the first block, the format does not change afterwards
+  enum AVSampleFormat fmt_ = AV_SAMPLE_FMT_NONE;
+  AVAudioFifo* af_ = NULL;
+  std::unique_ptr<FramePool> pool_;
+  AVFrame* out_ = NULL;
+};
+
+// Puts |inner| on a thread of its own: push() queues a reference to the
+// block on a FrameRing and returns, no lock taken, waiting only if |depth|
+// (rounded up to a power of 2) blocks are already in flight.
+// Errors are sticky and show up on a later push(), the end of stream waits
+// for the worker to push it through. The worker records metrics only if
+// the constructing thread does. |inner| must outlive the stage.
+class WorkerStage : public Stage {
+ public:
+  // throws std::runtime_error if the ring or the thread cannot be set up
+  WorkerStage(Stage& inner, int depth);
+
+  // drops what is still queued
+  ~WorkerStage() override;
+
+  int push(const AVFrame* frame) override;
+
+ private:
+  void loop();
+
+  Stage& inner_;
+  bool muted_;  // Metrics::muted() of the constructing thread
+
+  FrameRing ring_;  // NULL: end of stream
+  std::atomic<int> error_{0};  // set by the worker only
+  uint32_t eos_sent_ = 0;      // push() side
+  std::atomic<uint32_t> eos_done_{0};
+
+  std::thread thread_;
+};
+
+// Resampler as a stage. |resampler| is borrowed, e.g. one kept across runs
+class ResampleStage : public Stage {
+ public:
+  // throws std::runtime_error if the frame pool cannot be set up
+  ResampleStage(Resampler& resampler,
+                enum AVSampleFormat out_sample_fmt,
+                const AVChannelLayout& out_chlayout,
+                int out_sample_rate);
+
+  ~ResampleStage() override;
+
+  int push(const AVFrame* frame) override;
+
+ private:
+  Resampler& resampler_;
+  FramePool pool_;
+  AVFrame* out_ = NULL;
+};
+
+// RubberBand as a stage, planar float in and out. |stretcher| is borrowed
+class StretchStage : public Stage {
+ public:
+  // throws std::runtime_error if the frame pool cannot be set up
+  StretchStage(RubberBand::RubberBandStretcher& stretcher,
+               const AVChannelLayout& chlayout,
+               int sample_rate);
+
+  ~StretchStage() override;
+
+  int push(const AVFrame* frame) override;
+
+ private:
+  // retrieve and emit whatever the stretcher has ready
+  int retrieve();
+
+  RubberBand::RubberBandStretcher& stretcher_;
+  FramePool pool_;
+  AVFrame* out_ = NULL;
+};
+
+// The study pass of an offline stretcher (OptionProcessOffline): a sink
+// that feeds study(), the end of stream finishes it. The same samples then
+// go through a StretchStage on the same stretcher.
+class StudyStage : public Stage {
+ public:
+  StudyStage(RubberBand::RubberBandStretcher& stretcher, int channels)
+      : Stage("study"), stretcher_(stretcher), silence_(channels, &zero_) { }
+
+  int push(const AVFrame* frame) override;
+
+ private:
+  RubberBand::RubberBandStretcher& stretcher_;
+  // study() wants valid (if unused) planes at the end
+  float zero_ = 0;
+  std::vector<const float*> silence_;
+};
+
+// Sink, every output of |outputs| takes a reference to the block.
+// the end of stream flushes the encoders
+class OutputStage : public Stage {
+ public:
+  explicit OutputStage(AudioFanout& outputs) : Stage("dump"), outputs_(outputs) { }
+
+  int push(const AVFrame* frame) override;
+
+ private:
+  AudioFanout& outputs_;
+};
+
+// How a stage is placed, see Pipeline::add()
+struct StageSpec {
+  std::string name;
+  int batch = 0;        // regroup the input into blocks of N samples, 0: as they come
+  bool thread = false;  // run on a worker thread of its own
+  int queue = 16;       // blocks in flight to the worker
+};
+
+// "resample,stretch:batch=1024:thread,dump:thread:queue=32" into |stages|,
+// one StageSpec per comma, options after colons. which names exist is up
+// to whoever builds the pipeline. returns false if malformed
+bool parse_pipeline(const char* spec, std::vector<StageSpec>& stages);
+
+// A chain of stages, each placed as its StageSpec says: behind a
+// RebatchStage for batch, on a WorkerStage for thread (the rebatching then
+// happens on the worker too).
+class Pipeline {
+ public:
+  Pipeline(const Pipeline&) = delete;
+  Pipeline& operator=(const Pipeline&) = delete;
+
+  Pipeline() = default;
+
+  // stops the workers, upstream first
+  virtual ~Pipeline();
+
+  // appends |stage|, throws std::runtime_error if |spec| cannot be honoured
+  void add(std::unique_ptr<Stage> stage, const StageSpec& spec);
+
+  bool empty() const { return !head_; }
+
+  // into the first stage, |frame| NULL: end of stream, returns once every
+  // stage is flushed
+  int push(const AVFrame* frame);
+
+ private:
+  // upstream first, wrappers before what they wrap
+  std::vector<std::unique_ptr<Stage>> stages_;
+  Stage* head_ = NULL;
+  Stage* tail_ = NULL;
+};
+
+}
+
+#endif /* pipeline_hpp */
@@ -0,0 +1,483 @@
+//
+//  sample_convert.cpp
+//  avtool
+//
+//  Created by zhanwang-sky on 2023/11/24.
+//
+
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+
+extern "C" {
+#include <libavutil/cpu.h>
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define AVTOOL_CONVERT_X86 1
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#define AVTOOL_CONVERT_NEON 1
+#endif
+
+#include "sample_convert.hpp"
+
+using namespace AVTool;
+
+namespace {
+
+// per sample conversion, same formulas as swresample (audioconvert.c)
+template <typename In, typename Out>
+inline Out conv(In x);
+
+template <> inline int16_t conv(int16_t x) { return x; }
+template <> inline int32_t conv(int16_t x) { return static_cast<int32_t>(static_cast<uint32_t>(x) << 16); }
+template <> inline float conv(int16_t x) { return x * (1.0f / (1 << 15)); }
+
+template <> inline int16_t conv(int32_t x) { return static_cast<int16_t>(x >> 16); }
+template <> inline int32_t conv(int32_t x) { return x; }
+template <> inline float conv(int32_t x) { return x * (1.0f / (1U << 31)); }
+
+template <> inline int16_t conv(float x) {
+  long v = lrintf(x * (1 << 15));
+  return static_cast<int16_t>(v < INT16_MIN ? INT16_MIN : (v > INT16_MAX ? INT16_MAX : v));
+}
+template <> inline int32_t conv(float x) {
+  long long v = llrintf(x * (1U << 31));
+  return static_cast<int32_t>(v < INT32_MIN ? INT32_MIN : (v > INT32_MAX ? INT32_MAX : v));
+}
+template <> inline float conv(float x) { return x; }
+
+// contiguous run of |n| samples
+template <typename In, typename Out>
+using ElemFn = void (*)(Out* dst, const In* src, int n);
+
+// stereo, |n| samples per channel: two planes into one packed run and back
+template <typename In, typename Out>
+using InterleaveFn = void (*)(Out* dst, const In* left, const In* right, int n);
+
+template <typename In, typename Out>
+using DeinterleaveFn = void (*)(Out* left, Out* right, const In* src, int n);
+
+template <typename In, typename Out>
+void elem_c(Out* dst, const In* src, int n) {
+  if constexpr (std::is_same_v<In, Out>) {
+    memcpy(dst, src, sizeof(Out) * n);
+  } else {
+    for (int i = 0; i < n; i++) {
+      dst[i] = conv<In, Out>(src[i]);
+    }
+  }
+}
+
+template <typename In, typename Out>
+void interleave_c(Out* dst, const In* left, const In* right, int n) {
+  for (int i = 0; i < n; i++) {
+    dst[2 * i] = conv<In, Out>(left[i]);
+    dst[2 * i + 1] = conv<In, Out>(right[i]);
+  }
+}
+
+template <typename In, typename Out>
+void deinterleave_c(Out* left, Out* right, const In* src, int n) {
+  for (int i = 0; i < n; i++) {
+    left[i] = conv<In, Out>(src[2 * i]);
+    right[i] = conv<In, Out>(src[2 * i + 1]);
+  }
+}
+
+#if defined(AVTOOL_CONVERT_X86)
+__attribute__((target("sse2")))
+void flt_to_s16_sse2(int16_t* dst, const float* src, int n) {
+  const __m128 scale = _mm_set1_ps(1 << 15);
+  const __m128 lo = _mm_set1_ps(INT16_MIN);
+  const __m128 hi = _mm_set1_ps(INT16_MAX);
+  int i = 0;
+
+  // clamp before rounding, cvtps would turn overflows into INT32_MIN
+  for (; i + 8 <= n; i += 8) {
+    __m128 a = _mm_min_ps(_mm_max_ps(_mm_mul_ps(_mm_loadu_ps(src + i), scale), lo), hi);
+    __m128 b = _mm_min_ps(_mm_max_ps(_mm_mul_ps(_mm_loadu_ps(src + i + 4), scale), lo), hi);
+    __m128i r = _mm_packs_epi32(_mm_cvtps_epi32(a), _mm_cvtps_epi32(b));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), r);
+  }
+
+  elem_c<float, int16_t>(dst + i, src + i, n - i);
+}
+
+__attribute__((target("sse2")))
+void s16_to_flt_sse2(float* dst, const int16_t* src, int n) {
+  const __m128 scale = _mm_set1_ps(1.0f / (1 << 15));
+  int i = 0;
+
+  for (; i + 8 <= n; i += 8) {
+    __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+    // sign extend to 32 bits
+    __m128i l = _mm_srai_epi32(_mm_unpacklo_epi16(v, v), 16);
+    __m128i h = _mm_srai_epi32(_mm_unpackhi_epi16(v, v), 16);
+    _mm_storeu_ps(dst + i, _mm_mul_ps(_mm_cvtepi32_ps(l), scale));
+    _mm_storeu_ps(dst + i + 4, _mm_mul_ps(_mm_cvtepi32_ps(h), scale));
+  }
+
+  elem_c<int16_t, float>(dst + i, src + i, n - i);
+}
+
+__attribute__((target("avx2")))
+void flt_to_s16_avx2(int16_t* dst, const float* src, int n) {
+  const __m256 scale = _mm256_set1_ps(1 << 15);
+  const __m256 lo = _mm256_set1_ps(INT16_MIN);
+  const __m256 hi = _mm256_set1_ps(INT16_MAX);
+  int i = 0;
+
+  for (; i + 16 <= n; i += 16) {
+    __m256 a = _mm256_min_ps(_mm256_max_ps(_mm256_mul_ps(_mm256_loadu_ps(src + i), scale), lo), hi);
+    __m256 b = _mm256_min_ps(_mm256_max_ps(_mm256_mul_ps(_mm256_loadu_ps(src + i + 8), scale), lo), hi);
+    __m256i r = _mm256_packs_epi32(_mm256_cvtps_epi32(a), _mm256_cvtps_epi32(b));
+    // packs works per 128-bit lane, put the quads back in order
+    r = _mm256_permute4x64_epi64(r, 0xd8);
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i), r);
+  }
+
+  flt_to_s16_sse2(dst + i, src + i, n - i);
+}
+
+__attribute__((target("avx2")))
+void s16_to_flt_avx2(float* dst, const int16_t* src, int n) {
+  const __m256 scale = _mm256_set1_ps(1.0f / (1 << 15));
+  int i = 0;
+
+  for (; i + 16 <= n; i += 16) {
+    __m256i l = _mm256_cvtepi16_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i)));
+    __m256i h = _mm256_cvtepi16_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i + 8)));
+    _mm256_storeu_ps(dst + i, _mm256_mul_ps(_mm256_cvtepi32_ps(l), scale));
+    _mm256_storeu_ps(dst + i + 8, _mm256_mul_ps(_mm256_cvtepi32_ps(h), scale));
+  }
+
+  s16_to_flt_sse2(dst + i, src + i, n - i);
+}
+
+// the stereo kernels are 128-bit only, AVX2 machines use them as well: the
+// lane crossing shuffles would eat what the wider registers gain
+
+// 4 floats scaled, clamped and rounded to int32, see flt_to_s16_sse2()
+__attribute__((target("sse2")))
+inline __m128i flt_to_s32x4_sse2(__m128 v) {
+  const __m128 scale = _mm_set1_ps(1 << 15);
+  const __m128 lo = _mm_set1_ps(INT16_MIN);
+  const __m128 hi = _mm_set1_ps(INT16_MAX);
+
+  return _mm_cvtps_epi32(_mm_min_ps(_mm_max_ps(_mm_mul_ps(v, scale), lo), hi));
+}
+
+// 4 sign extended S16 in int32 lanes to float
+__attribute__((target("sse2")))
+inline __m128 s32x4_to_flt_sse2(__m128i v) {
+  return _mm_mul_ps(_mm_cvtepi32_ps(v), _mm_set1_ps(1.0f / (1 << 15)));
+}
+
+__attribute__((target("sse2")))
+void flt_to_s16_interleave_sse2(int16_t* dst, const float* left, const float* right, int n) {
+  int i = 0;
+
+  for (; i + 8 <= n; i += 8) {
+    __m128i l = _mm_packs_epi32(flt_to_s32x4_sse2(_mm_loadu_ps(left + i)),
+                                flt_to_s32x4_sse2(_mm_loadu_ps(left + i + 4)));
+    __m128i r = _mm_packs_epi32(flt_to_s32x4_sse2(_mm_loadu_ps(right + i)),
+                                flt_to_s32x4_sse2(_mm_loadu_ps(right + i + 4)));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + 2 * i), _mm_unpacklo_epi16(l, r));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + 2 * i + 8), _mm_unpackhi_epi16(l, r));
+  }
+
+  interleave_c<float, int16_t>(dst + 2 * i, left + i, right + i, n - i);
+}
+
+__attribute__((target("sse2")))
+void s16_to_flt_deinterleave_sse2(float* left, float* right, const int16_t* src, int n) {
+  int i = 0;
+
+  for (; i + 8 <= n; i += 8) {
+    __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + 2 * i));
+    __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + 2 * i + 8));
+    // left is the low half of every 32-bit pair, right the high one
+    _mm_storeu_ps(left + i, s32x4_to_flt_sse2(_mm_srai_epi32(_mm_slli_epi32(a, 16), 16)));
+    _mm_storeu_ps(left + i + 4, s32x4_to_flt_sse2(_mm_srai_epi32(_mm_slli_epi32(b, 16), 16)));
+    _mm_storeu_ps(right + i, s32x4_to_flt_sse2(_mm_srai_epi32(a, 16)));
+    _mm_storeu_ps(right + i + 4, s32x4_to_flt_sse2(_mm_srai_epi32(b, 16)));
+  }
+
+  deinterleave_c<int16_t, float>(left + i, right + i, src + 2 * i, n - i);
+}
+
+__attribute__((target("sse2")))
+void s16_to_flt_interleave_sse2(float* dst, const int16_t* left, const int16_t* right, int n) {
+  int i = 0;
+
+  for (; i + 8 <= n; i += 8) {
+    __m128i l = _mm_loadu_si128(reinterpret_cast<const __m128i*>(left + i));
+    __m128i r = _mm_loadu_si128(reinterpret_cast<const __m128i*>(right + i));
+    // L0 R0 L1 R1 ..., then sign extended 4 at a time
+    __m128i lo = _mm_unpacklo_epi16(l, r);
+    __m128i hi = _mm_unpackhi_epi16(l, r);
+    _mm_storeu_ps(dst + 2 * i, s32x4_to_flt_sse2(_mm_srai_epi32(_mm_unpacklo_epi16(lo, lo), 16)));
+    _mm_storeu_ps(dst + 2 * i + 4, s32x4_to_flt_sse2(_mm_srai_epi32(_mm_unpackhi_epi16(lo, lo), 16)));
+    _mm_storeu_ps(dst + 2 * i + 8, s32x4_to_flt_sse2(_mm_srai_epi32(_mm_unpacklo_epi16(hi, hi), 16)));
+    _mm_storeu_ps(dst + 2 * i + 12, s32x4_to_flt_sse2(_mm_srai_epi32(_mm_unpackhi_epi16(hi, hi), 16)));
+  }
+
+  interleave_c<int16_t, float>(dst + 2 * i, left + i, right + i, n - i);
+}
+
+__attribute__((target("sse2")))
+void flt_to_s16_deinterleave_sse2(int16_t* left, int16_t* right, const float* src, int n) {
+  int i = 0;
+
+  for (; i + 8 <= n; i += 8) {
+    __m128 a = _mm_loadu_ps(src + 2 * i);
+    __m128 b = _mm_loadu_ps(src + 2 * i + 4);
+    __m128 c = _mm_loadu_ps(src + 2 * i + 8);
+    __m128 d = _mm_loadu_ps(src + 2 * i + 12);
+    // even lanes left, odd lanes right
+    __m128i l = _mm_packs_epi32(flt_to_s32x4_sse2(_mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0))),
+                                flt_to_s32x4_sse2(_mm_shuffle_ps(c, d, _MM_SHUFFLE(2, 0, 2, 0))));
+    __m128i r = _mm_packs_epi32(flt_to_s32x4_sse2(_mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1))),
+                                flt_to_s32x4_sse2(_mm_shuffle_ps(c, d, _MM_SHUFFLE(3, 1, 3, 1))));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(left + i), l);
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(right + i), r);
+  }
+
+  deinterleave_c<float, int16_t>(left + i, right + i, src + 2 * i, n - i);
+}
+#endif
+
+#if defined(AVTOOL_CONVERT_NEON)
+void flt_to_s16_neon(int16_t* dst, const float* src, int n) {
+  int i = 0;
+
+  // vcvtn rounds to nearest even and saturates, vqmovn saturates again
+  for (; i + 8 <= n; i += 8) {
+    int32x4_t a = vcvtnq_s32_f32(vmulq_n_f32(vld1q_f32(src + i), 1 << 15));
+    int32x4_t b = vcvtnq_s32_f32(vmulq_n_f32(vld1q_f32(src + i + 4), 1 << 15));
+    vst1q_s16(dst + i, vcombine_s16(vqmovn_s32(a), vqmovn_s32(b)));
+  }
+
+  elem_c<float, int16_t>(dst + i, src + i, n - i);
+}
+
+void s16_to_flt_neon(float* dst, const int16_t* src, int n) {
+  int i = 0;
+
+  for (; i + 8 <= n; i += 8) {
+    int16x8_t v = vld1q_s16(src + i);
+    vst1q_f32(dst + i, vmulq_n_f32(vcvtq_f32_s32(vmovl_s16(vget_low_s16(v))), 1.0f / (1 << 15)));
+    vst1q_f32(dst + i + 4, vmulq_n_f32(vcvtq_f32_s32(vmovl_s16(vget_high_s16(v))), 1.0f / (1 << 15)));
+  }
+
+  elem_c<int16_t, float>(dst + i, src + i, n - i);
+}
+
+// vld2 / vst2 do the (de)interleaving
+inline int16x8_t flt_to_s16x8_neon(float32x4_t a, float32x4_t b) {
+  return vcombine_s16(vqmovn_s32(vcvtnq_s32_f32(vmulq_n_f32(a, 1 << 15))),
+                      vqmovn_s32(vcvtnq_s32_f32(vmulq_n_f32(b, 1 << 15))));
+}
+
+inline float32x4x2_t s16x8_to_flt_neon(int16x8_t v) {
+  float32x4x2_t f;
+  f.val[0] = vmulq_n_f32(vcvtq_f32_s32(vmovl_s16(vget_low_s16(v))), 1.0f / (1 << 15));
+  f.val[1] = vmulq_n_f32(vcvtq_f32_s32(vmovl_s16(vget_high_s16(v))), 1.0f / (1 << 15));
+  return f;
+}
+
+void flt_to_s16_interleave_neon(int16_t* dst, const float* left, const float* right, int n) {
+  int i = 0;
+
+  for (; i + 8 <= n; i += 8) {
+    int16x8x2_t v;
+    v.val[0] = flt_to_s16x8_neon(vld1q_f32(left + i), vld1q_f32(left + i + 4));
+    v.val[1] = flt_to_s16x8_neon(vld1q_f32(right + i), vld1q_f32(right + i + 4));
+    vst2q_s16(dst + 2 * i, v);
+  }
+
+  interleave_c<float, int16_t>(dst + 2 * i, left + i, right + i, n - i);
+}
+
+void s16_to_flt_deinterleave_neon(float* left, float* right, const int16_t* src, int n) {
+  int i = 0;
+
+  for (; i + 8 <= n; i += 8) {
+    int16x8x2_t v = vld2q_s16(src + 2 * i);
+    float32x4x2_t l = s16x8_to_flt_neon(v.val[0]);
+    float32x4x2_t r = s16x8_to_flt_neon(v.val[1]);
+    vst1q_f32(left + i, l.val[0]);
+    vst1q_f32(left + i + 4, l.val[1]);
+    vst1q_f32(right + i, r.val[0]);
+    vst1q_f32(right + i + 4, r.val[1]);
+  }
+
+  deinterleave_c<int16_t, float>(left + i, right + i, src + 2 * i, n - i);
+}
+
+void s16_to_flt_interleave_neon(float* dst, const int16_t* left, const int16_t* right, int n) {
+  int i = 0;
+
+  for (; i + 8 <= n; i += 8) {
+    float32x4x2_t l = s16x8_to_flt_neon(vld1q_s16(left + i));
+    float32x4x2_t r = s16x8_to_flt_neon(vld1q_s16(right + i));
+    float32x4x2_t v;
+    v.val[0] = l.val[0];
+    v.val[1] = r.val[0];
+    vst2q_f32(dst + 2 * i, v);
+    v.val[0] = l.val[1];
+    v.val[1] = r.val[1];
+    vst2q_f32(dst + 2 * i + 8, v);
+  }
+
+  interleave_c<int16_t, float>(dst + 2 * i, left + i, right + i, n - i);
+}
+
+void flt_to_s16_deinterleave_neon(int16_t* left, int16_t* right, const float* src, int n) {
+  int i = 0;
+
+  for (; i + 8 <= n; i += 8) {
+    float32x4x2_t a = vld2q_f32(src + 2 * i);
+    float32x4x2_t b = vld2q_f32(src + 2 * i + 8);
+    vst1q_s16(left + i, flt_to_s16x8_neon(a.val[0], b.val[0]));
+    vst1q_s16(right + i, flt_to_s16x8_neon(a.val[1], b.val[1]));
+  }
+
+  deinterleave_c<float, int16_t>(left + i, right + i, src + 2 * i, n - i);
+}
+#endif
+
+template <typename In, typename Out, bool InPlanar, bool OutPlanar, ElemFn<In, Out> Elem,
+          InterleaveFn<In, Out> Inter = nullptr, DeinterleaveFn<In, Out> Deinter = nullptr>
+void convert(uint8_t* const* out, const uint8_t* const* in, int channels, int nb_samples) {
+  if constexpr (InPlanar && OutPlanar) {
+    for (int ch = 0; ch < channels; ch++) {
+      Elem(reinterpret_cast<Out*>(out[ch]), reinterpret_cast<const In*>(in[ch]), nb_samples);
+    }
+  } else if constexpr (!InPlanar && !OutPlanar) {
+    Elem(reinterpret_cast<Out*>(out[0]), reinterpret_cast<const In*>(in[0]), nb_samples * channels);
+  } else {
+    if (channels == 1) {
+      // mono: planar and packed are the same thing
+      Elem(reinterpret_cast<Out*>(out[0]), reinterpret_cast<const In*>(in[0]), nb_samples);
+      return;
+    }
+    if constexpr (InPlanar && Inter != nullptr) {
+      if (channels == 2) {
+        Inter(reinterpret_cast<Out*>(out[0]), reinterpret_cast<const In*>(in[0]),
+              reinterpret_cast<const In*>(in[1]), nb_samples);
+        return;
+      }
+    } else if constexpr (!InPlanar && Deinter != nullptr) {
+      if (channels == 2) {
+        Deinter(reinterpret_cast<Out*>(out[0]), reinterpret_cast<Out*>(out[1]),
+                reinterpret_cast<const In*>(in[0]), nb_samples);
+        return;
+      }
+    }
+    for (int ch = 0; ch < channels; ch++) {
+      if constexpr (InPlanar) {
+        const In* src = reinterpret_cast<const In*>(in[ch]);
+        Out* dst = reinterpret_cast<Out*>(out[0]) + ch;
+        for (int i = 0; i < nb_samples; i++) {
+          dst[i * channels] = conv<In, Out>(src[i]);
+        }
+      } else {
+        const In* src = reinterpret_cast<const In*>(in[0]) + ch;
+        Out* dst = reinterpret_cast<Out*>(out[ch]);
+        for (int i = 0; i < nb_samples; i++) {
+          dst[i] = conv<In, Out>(src[i * channels]);
+        }
+      }
+    }
+  }
+}
+
+template <typename In, typename Out, ElemFn<In, Out> Elem,
+          InterleaveFn<In, Out> Inter = nullptr, DeinterleaveFn<In, Out> Deinter = nullptr>
+SampleConvertFn pick_layout(bool in_planar, bool out_planar) {
+  if (in_planar) {
+    return out_planar ? convert<In, Out, true, true, Elem> : convert<In, Out, true, false, Elem, Inter>;
+  }
+  return out_planar ? convert<In, Out, false, true, Elem, nullptr, Deinter>
+                    : convert<In, Out, false, false, Elem>;
+}
+
+template <typename In, typename Out>
+SampleConvertFn pick(bool in_planar, bool out_planar) {
+  [[maybe_unused]] int flags = av_get_cpu_flags();
+
+  if constexpr (std::is_same_v<In, float> && std::is_same_v<Out, int16_t>) {
+#if defined(AVTOOL_CONVERT_X86)
+    if (flags & AV_CPU_FLAG_AVX2) {
+      return pick_layout<In, Out, flt_to_s16_avx2, flt_to_s16_interleave_sse2, flt_to_s16_deinterleave_sse2>(
+          in_planar, out_planar);
+    }
+    if (flags & AV_CPU_FLAG_SSE2) {
+      return pick_layout<In, Out, flt_to_s16_sse2, flt_to_s16_interleave_sse2, flt_to_s16_deinterleave_sse2>(
+          in_planar, out_planar);
+    }
+#elif defined(AVTOOL_CONVERT_NEON)
+    if (flags & AV_CPU_FLAG_NEON) {
+      return pick_layout<In, Out, flt_to_s16_neon, flt_to_s16_interleave_neon, flt_to_s16_deinterleave_neon>(
+          in_planar, out_planar);
+    }
+#endif
+  } else if constexpr (std::is_same_v<In, int16_t> && std::is_same_v<Out, float>) {
+#if defined(AVTOOL_CONVERT_X86)
+    if (flags & AV_CPU_FLAG_AVX2) {
+      return pick_layout<In, Out, s16_to_flt_avx2, s16_to_flt_interleave_sse2, s16_to_flt_deinterleave_sse2>(
+          in_planar, out_planar);
+    }
+    if (flags & AV_CPU_FLAG_SSE2) {
+      return pick_layout<In, Out, s16_to_flt_sse2, s16_to_flt_interleave_sse2, s16_to_flt_deinterleave_sse2>(
+          in_planar, out_planar);
+    }
+#elif defined(AVTOOL_CONVERT_NEON)
+    if (flags & AV_CPU_FLAG_NEON) {
+      return pick_layout<In, Out, s16_to_flt_neon, s16_to_flt_interleave_neon, s16_to_flt_deinterleave_neon>(
+          in_planar, out_planar);
+    }
+#endif
+  }
+
+  return pick_layout<In, Out, elem_c<In, Out>>(in_planar, out_planar);
+}
+
+template <typename In>
+SampleConvertFn pick_out(enum AVSampleFormat out_packed, bool in_planar, bool out_planar) {
+  switch (out_packed) {
+    case AV_SAMPLE_FMT_S16:
+      return pick<In, int16_t>(in_planar, out_planar);
+    case AV_SAMPLE_FMT_S32:
+      return pick<In, int32_t>(in_planar, out_planar);
+    case AV_SAMPLE_FMT_FLT:
+      return pick<In, float>(in_planar, out_planar);
+    default:
+      return NULL;
+  }
+}
+
+}
+
+SampleConvertFn AVTool::find_sample_converter(enum AVSampleFormat in_fmt, enum AVSampleFormat out_fmt) {
+  enum AVSampleFormat in_packed = av_get_packed_sample_fmt(in_fmt);
+  enum AVSampleFormat out_packed = av_get_packed_sample_fmt(out_fmt);
+  bool in_planar = av_sample_fmt_is_planar(in_fmt);
+  bool out_planar = av_sample_fmt_is_planar(out_fmt);
+
+  switch (in_packed) {
+    case AV_SAMPLE_FMT_S16:
+      return pick_out<int16_t>(out_packed, in_planar, out_planar);
+    case AV_SAMPLE_FMT_S32:
+      return pick_out<int32_t>(out_packed, in_planar, out_planar);
+    case AV_SAMPLE_FMT_FLT:
+      return pick_out<float>(out_packed, in_planar, out_planar);
+    default:
+      return NULL;
+  }
+}
@@ -0,0 +1,31 @@
+//
+//  sample_convert.hpp
+//  avtool
+//
+//  Created by zhanwang-sky on 2023/11/24.
+//
+
+#ifndef sample_convert_hpp
+#define sample_convert_hpp
+
+extern "C" {
+#include <libavutil/samplefmt.h>
+}
+
+namespace AVTool {
+
+// Converts |nb_samples| per channel, |in| / |out| are laid out like
+// AVFrame::extended_data (one pointer per plane, a single one if packed).
+typedef void (*SampleConvertFn)(uint8_t* const* out, const uint8_t* const* in,
+                                int channels, int nb_samples);
+
+// Kernel for a pure sample format change (same rate and layout) between
+// S16/S32/FLT, packed or planar. Rounding and clipping match swresample.
+// The S16 <-> FLT kernels are vectorised (SSE2 / AVX2 / NEON), picked from
+// av_get_cpu_flags(), stereo packed <-> planar between them included.
+// returns NULL for any other pair.
+SampleConvertFn find_sample_converter(enum AVSampleFormat in_fmt, enum AVSampleFormat out_fmt);
+
+}
+
+#endif /* sample_convert_hpp */
@@ -0,0 +1,100 @@
+//
+//  samples_arena.cpp
+//  avtool
+//
+//  Created by zhanwang-sky on 2023/11/24.
+//
+
+#include <sys/mman.h>
+#include <unistd.h>
+#include "samples_arena.hpp"
+
+using namespace AVTool;
+
+namespace {
+
+constexpr size_t huge_page_size = 2 << 20;
+
+size_t align_up(size_t n, size_t a) {
+  return (n + a - 1) / a * a;
+}
+
+}
+
+SamplesArena::SamplesArena(size_t capacity, bool huge_pages) noexcept {
+  void* p = MAP_FAILED;
+
+  if (capacity == 0) {
+    return;
+  }
+
+#if defined(__linux__)
+  if (huge_pages) {
+    // explicit huge pages, needs a reserved pool (vm.nr_hugepages)
+    mapped_ = align_up(capacity, huge_page_size);
+    p = mmap(NULL, mapped_, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    huge_pages_ = (p != MAP_FAILED);
+  }
+#endif
+
+  if (p == MAP_FAILED) {
+    mapped_ = align_up(capacity, huge_pages ? huge_page_size : static_cast<size_t>(getpagesize()));
+    p = mmap(NULL, mapped_, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) {
+      mapped_ = 0;
+      return;
+    }
+#if defined(__linux__) && defined(MADV_HUGEPAGE)
+    if (huge_pages) {
+      // fall back to transparent huge pages, best effort
+      huge_pages_ = (madvise(p, mapped_, MADV_HUGEPAGE) == 0);
+    }
+#endif
+  }
+
+  base_ = static_cast<uint8_t*>(p);
+  capacity_ = mapped_;
+}
+
+SamplesArena::~SamplesArena() {
+  clean();
+}
+
+bool SamplesArena::operator!() const {
+  return !base_;
+}
+
+uint8_t* SamplesArena::allocate(size_t size) {
+  // mmap is page aligned, offsets keep the alignment
+  size_t off = align_up(used_, alignment);
+
+  if (!base_ || size > capacity_ || off > capacity_ - size) {
+    return NULL;
+  }
+
+  used_ = off + size;
+
+  return base_ + off;
+}
+
+size_t SamplesArena::footprint(size_t size, int n) {
+  return size + static_cast<size_t>(n) * (alignment - 1);
+}
+
+void SamplesArena::rewind(size_t mark) {
+  if (mark < used_) {
+    used_ = mark;
+  }
+}
+
+void SamplesArena::clean() {
+  if (base_) {
+    munmap(base_, mapped_);
+    base_ = NULL;
+  }
+  capacity_ = 0;
+  mapped_ = 0;
+  used_ = 0;
+  huge_pages_ = false;
+}
@@ -0,0 +1,64 @@
+//
+//  samples_arena.hpp
+//  avtool
+//
+//  Created by zhanwang-sky on 2023/11/24.
+//
+
+#ifndef samples_arena_hpp
+#define samples_arena_hpp
+
+#include <cstddef>
+#include <cstdint>
+
+namespace AVTool {
+
+// One slab mapped up front, sample buffers are carved out of it by bumping
+// a cursor, nothing is freed individually. Meant to live as long as a
+// stream or a worker so the steady state makes no heap calls at all.
+class SamplesArena {
+ public:
+  // cache line, also enough for AVX-512 loads
+  static constexpr size_t alignment = 64;
+
+  SamplesArena(const SamplesArena&) = delete;
+  SamplesArena& operator=(const SamplesArena&) = delete;
+
+  // |huge_pages|: try MAP_HUGETLB, then transparent huge pages (Linux only)
+  SamplesArena(size_t capacity, bool huge_pages = false) noexcept;
+
+  virtual ~SamplesArena();
+
+  bool operator!() const;
+
+  // |size| bytes aligned to |alignment|, NULL if the slab is exhausted
+  uint8_t* allocate(size_t size);
+
+  // bytes needed to carve |n| blocks totalling |size| bytes
+  static size_t footprint(size_t size, int n = 1);
+
+  // scoped scratch: rewind() to a mark() drops everything carved after it
+  size_t mark() const { return used_; }
+
+  void rewind(size_t mark);
+
+  size_t capacity() const { return capacity_; }
+
+  size_t used() const { return used_; }
+
+  bool huge_pages() const { return huge_pages_; }
+
+ protected:
+  void clean();
+
+ private:
+  uint8_t* base_ = NULL;
+  size_t capacity_ = 0;
+  size_t mapped_ = 0;
+  size_t used_ = 0;
+  bool huge_pages_ = false;
+};
+
+}
+
+#endif /* samples_arena_hpp */
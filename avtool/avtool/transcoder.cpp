@@ -0,0 +1,754 @@
+//
+//  transcoder.cpp
+//  avtool
+//
+//  Created by zhanwang-sky on 2023/11/20.
+//
+
+#include <algorithm>
+#include <cstdlib>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include "../tlv_async_reader.hpp"
+#include "../tlv_jitter_buffer.hpp"
+#include "../tlv_reader.hpp"
+#include "../tlv_stream_reader.hpp"
+#include "media_dumper.hpp"
+#include "metrics.hpp"
+#include "transcoder.hpp"
+
+using namespace AVTool;
+
+using std::cout;
+
+Transcoder::Transcoder(int sample_rate, int channels, ResamplerPreset resample_preset,
+                       av_opus_pool_t* opus_pool)
+    : sample_rate_(sample_rate),
+      ch_layout_((channels > 1) ? AVChannelLayout(AV_CHANNEL_LAYOUT_STEREO)
+                                : AVChannelLayout(AV_CHANNEL_LAYOUT_MONO)),
+      decode_rate_(decode_rate(sample_rate)) {
+  std::ostringstream oss;
+
+  // sanity check
+  if (opus_pool && (opus_pool->sample_rate != decode_rate_ || opus_pool->channels != channels)) {
+    throw std::runtime_error("Opus pool does not match the decode format");
+  }
+
+  if (decode_rate_ != sample_rate) {
+    resampler_.reset(new Resampler(AV_SAMPLE_FMT_FLTP, ch_layout_, decode_rate_,
+                                   AV_SAMPLE_FMT_FLTP, ch_layout_, sample_rate,
+                                   resample_preset));
+    if (!(*resampler_)) {
+      oss << "Fail to create resampler";
+      goto err_exit;
+    }
+  }
+
+  dec_pool_.reset(new FramePool(AV_SAMPLE_FMT_FLTP, ch_layout_, decode_rate_, max_samples_cache));
+  dec_frame_ = av_frame_alloc();
+  if (!(*dec_pool_) || !dec_frame_) {
+    oss << "Fail to alloc decode frames";
+    goto err_exit;
+  }
+
+  if (opus_pool) {
+    opus_ctx_ = av_opus_pool_acquire(opus_pool);
+  }
+  if (!opus_ctx_) {
+    opus_ctx_ = av_opus_init(true, false, decode_rate_, channels);
+  }
+  if (!opus_ctx_) {
+    oss << "Fail to init opus context";
+    goto err_exit;
+  }
+
+  return;
+
+err_exit:
+  if (opus_ctx_) {
+    av_opus_destroy(opus_ctx_);
+    opus_ctx_ = NULL;
+  }
+  av_frame_free(&dec_frame_);
+  throw std::runtime_error(oss.str());
+}
+
+Transcoder::~Transcoder() {
+  if (opus_ctx_) {
+    av_opus_destroy(opus_ctx_);
+  }
+  av_frame_free(&dec_frame_);
+}
+
+int Transcoder::decode_rate(int sample_rate) {
+  return av_opus_rate_supported(sample_rate) ? sample_rate : 48000;
+}
+
+bool AVTool::parse_stretch_options(const char* spec, StretchOptions& opts) {
+  std::istringstream iss(spec);
+  std::string item;
+
+  while (std::getline(iss, item, ':')) {
+    size_t eq = item.find('=');
+    std::string key = item.substr(0, eq);
+    std::string value = (eq != std::string::npos) ? item.substr(eq + 1) : "";
+
+    if (item.empty()) {
+      continue;
+    }
+
+    if (key == "offline" && eq == std::string::npos) {
+      opts.offline = true;
+    } else if (key == "realtime" && eq == std::string::npos) {
+      opts.offline = false;
+    } else if (key == "pitch") {
+      char* end = NULL;
+      double pitch = strtod(value.c_str(), &end);
+      if (value.empty() || *end != '\0' || !(pitch > 0)) {
+        return false;
+      }
+      opts.pitch_scale = pitch;
+    } else if (key == "engine") {
+      if (value == "faster") {
+        opts.engine = StretchEngine::Faster;
+      } else if (value == "finer") {
+        opts.engine = StretchEngine::Finer;
+      } else {
+        return false;
+      }
+    } else {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+namespace {
+
+// mapped, read-ahead or streaming reader, whichever fits the input and options
+class PacketSource {
+ public:
+  PacketSource(const std::string& tlv_file, const TranscodeOptions& opts) {
+    std::ostringstream oss;
+
+    if (opts.follow || avTLVStreamReader::is_stream(tlv_file)) {
+      // stdin, pipe, socket or a dump still being written, read it in order
+      stream_reader_.reset(new avTLVStreamReader(tlv_file, opts.follow, opts.follow_idle_ms));
+      if (!stream_reader_->is_open()) {
+        oss << "Fail to open tlv stream '" << tlv_file << "'";
+        throw std::runtime_error(oss.str());
+      }
+      return;
+    }
+
+    tlv_reader_.reset(new avTLVReader(tlv_file));
+    if (!tlv_reader_->is_open()) {
+      oss << "Fail to open tlv file '" << tlv_file << "'";
+      throw std::runtime_error(oss.str());
+    }
+
+    if (opts.from_cap_ts > 0) {
+      // clip extraction, reuse (or create) the sidecar index
+      std::string idx_file = avTLVIndex::sidecar_name(tlv_file);
+      if (!tlv_reader_->load_index(idx_file)) {
+        if (tlv_reader_->build_index() < 0 || !tlv_reader_->index().save(idx_file)) {
+          std::cerr << "Warning: no index for '" << tlv_file << "', scanning from head\n";
+        }
+      }
+      if (tlv_reader_->seek_to_cap_ts(opts.from_cap_ts) < 0) {
+        oss << "cap_ts " << opts.from_cap_ts << " not found in '" << tlv_file << "'";
+        throw std::runtime_error(oss.str());
+      }
+    }
+
+    if (opts.async_read) {
+      // starts where the (possibly seeked) mapped reader stands
+      async_reader_.reset(new avTLVAsyncReader(tlv_file, tlv_reader_->tell()));
+      if (!async_reader_->is_open()) {
+        oss << "Fail to start async reader for '" << tlv_file << "'";
+        throw std::runtime_error(oss.str());
+      }
+    }
+  }
+
+  int next(avTLVPacket& pkt) {
+    // in follow mode this includes waiting for the writer
+    avtool_time_scope(Metric::Read);
+    if (stream_reader_) {
+      return stream_reader_->next(pkt);
+    }
+    return async_reader_ ? async_reader_->next(pkt) : tlv_reader_->next(pkt);
+  }
+
+ private:
+  std::unique_ptr<avTLVReader> tlv_reader_;
+  std::unique_ptr<avTLVAsyncReader> async_reader_;
+  std::unique_ptr<avTLVStreamReader> stream_reader_;
+};
+
+// hand the packets within [from_cap_ts, to_cap_ts) to |fn| in playout order,
+// through the jitter buffer if enabled. returns the last reader return code
+template <typename Fn>
+int feed(PacketSource& source, const TranscodeOptions& opts, TranscodeStats& stats, Fn&& fn) {
+  std::unique_ptr<avTLVJitterBuffer> jitter_buffer;
+  avTLVPacket pkt;
+  avTLVPacket out;
+  int tlv_len = 0;
+
+  if (opts.jitter_buffer) {
+    avTLVJitterBuffer::Config cfg;
+    cfg.target_delay_ms = opts.jitter_target_ms;
+    cfg.max_delay_ms = opts.jitter_max_ms;
+    cfg.rtp_clock_rate = opts.rtp_clock_rate;
+    jitter_buffer.reset(new avTLVJitterBuffer(cfg));
+  }
+
+  while ((tlv_len = source.next(pkt)) > 0) {
+    if (pkt.cap_ts < opts.from_cap_ts) {
+      // streams cannot seek, skip up to the clip start
+      continue;
+    }
+    if (pkt.cap_ts >= opts.to_cap_ts) {
+      break;
+    }
+
+    stats.packets++;
+    stats.bytes += tlv_len;
+
+    if (!jitter_buffer) {
+      fn(pkt);
+      continue;
+    }
+
+    // the capture clock drives playout
+    jitter_buffer->push(pkt);
+    while (jitter_buffer->pop(pkt.cap_ts, out)) {
+      fn(out);
+    }
+  }
+
+  if (jitter_buffer) {
+    while (jitter_buffer->drain(out)) {
+      fn(out);
+    }
+    const avTLVJitterBuffer::Counters& c = jitter_buffer->counters();
+    stats.late += c.late;
+    stats.duplicate += c.duplicate;
+    stats.reordered += c.reordered;
+    stats.errors += c.overflow;
+  }
+
+  return tlv_len;
+}
+
+}
+
+TranscodeStats Transcoder::run(const std::string& tlv_file, const std::string& out_file,
+                               const TranscodeOptions& opts) {
+  return run(tlv_file, std::vector<std::string>(1, out_file), opts);
+}
+
+TranscodeStats Transcoder::run(const std::string& tlv_file, const std::vector<std::string>& out_files,
+                               const TranscodeOptions& opts) {
+  TranscodeStats stats;
+  int tlv_len = 0;
+
+  if (out_files.empty()) {
+    throw std::runtime_error("No output");
+  }
+
+  if (opts.remux) {
+    if (out_files.size() > 1) {
+      throw std::runtime_error("Remux writes a single output");
+    }
+    return remux(tlv_file, out_files[0], opts);
+  }
+
+  bool study = opts.stretch.offline && stretching(opts);
+  if (study && (opts.follow || avTLVStreamReader::is_stream(tlv_file))) {
+    throw std::runtime_error("Offline stretching reads the dump twice, it cannot be a stream");
+  }
+
+  PacketSource source(tlv_file, opts);
+
+  log_ = LogLimiter(opts.log_rate);
+
+  if (restart() < 0) {
+    throw std::runtime_error("Fail to reset transcoder state");
+  }
+  if (stretching(opts)) {
+    setup_stretcher(opts.stretch);
+  }
+
+  AsyncDumpOptions async;
+  async.queue_depth = opts.dump_queue;
+
+  // decoded and stretched once, whatever the number of outputs
+  AudioFanout outputs(AV_SAMPLE_FMT_FLTP, ch_layout_, sample_rate_);
+  for (size_t i = 0; i < out_files.size(); i++) {
+    const std::string& out_file = out_files[i];
+    EncoderOptions enc = opts.encoders.empty() ? EncoderOptions()
+                         : opts.encoders[std::min(i, opts.encoders.size() - 1)];
+    if (opts.segment_secs > 0 || opts.segment_bytes > 0) {
+      SegmentOptions segment;
+      segment.segment_secs = opts.segment_secs;
+      segment.segment_bytes = opts.segment_bytes;
+      if (!opts.segment_manifest.empty()) {
+        size_t dot = out_file.find_last_of('.');
+        size_t slash = out_file.find_last_of('/');
+        std::string stem = (dot != std::string::npos && (slash == std::string::npos || dot > slash))
+                           ? out_file.substr(0, dot) : out_file;
+        segment.manifest = stem + "." + opts.segment_manifest;
+      }
+      outputs.add(std::unique_ptr<AudioOutput>(
+          new SegmentedDumper(out_file, AV_SAMPLE_FMT_FLTP, ch_layout_, sample_rate_, segment, async,
+                              enc)));
+    } else {
+      outputs.add(std::unique_ptr<AudioOutput>(
+          new AudioDumper(out_file, AV_SAMPLE_FMT_FLTP, ch_layout_, sample_rate_, async, enc)));
+    }
+  }
+
+  if (study) {
+    // the whole input through study() first, same decode, same samples.
+    // stats, metrics and log lines come from the second pass only, the
+    // study pipeline's workers are muted along with this thread
+    MetricsMute mute;
+    PacketSource study_source(tlv_file, opts);
+    TranscodeOptions quiet = opts;
+    TranscodeStats scratch;
+    Pipeline study_pipeline;
+    int rc = 0;
+
+    quiet.log_level = LogLevel::Quiet;
+    build_pipeline(study_pipeline, outputs, opts, true);
+    pipeline_ = &study_pipeline;
+    try {
+      feed(study_source, quiet, scratch, [&](const avTLVPacket& pkt) {
+        process(pkt, scratch, quiet);
+      });
+      rc = study_pipeline.push(NULL);
+    } catch (...) {
+      pipeline_ = NULL;
+      throw;
+    }
+    pipeline_ = NULL;
+
+    if (rc < 0 || restart() < 0) {
+      throw std::runtime_error("Study pass failed");
+    }
+  }
+
+  // declared after |outputs|, its stages go first
+  Pipeline pipeline;
+  const Stage* resample = build_pipeline(pipeline, outputs, opts);
+  pipeline_ = &pipeline;
+
+  try {
+    tlv_len = feed(source, opts, stats, [&](const avTLVPacket& pkt) {
+      process(pkt, stats, opts);
+    });
+
+    // flush what the resampler, the stretcher and the encoders still hold
+    if (pipeline.push(NULL) < 0) {
+      stats.errors++;
+    }
+  } catch (...) {
+    pipeline_ = NULL;
+    throw;
+  }
+
+  pipeline_ = NULL;
+
+  if (resample) {
+    // counted at the output rate
+    stats.samples += resample->samples_out();
+  }
+
+  if (opts.log_level >= LogLevel::Info) {
+    cout << "break " << tlv_len << "\n";
+  }
+
+  return stats;
+}
+
+const Stage* Transcoder::build_pipeline(Pipeline& pipeline, AudioFanout& outputs,
+                                        const TranscodeOptions& opts, bool study) {
+  static const char* const order[] = {"decode", "resample", "stretch", "dump"};
+  std::vector<StageSpec> specs = opts.pipeline;
+  std::ostringstream oss;
+  const Stage* resample = NULL;
+  int last = -1;
+
+  if (specs.empty()) {
+    specs.resize(3);
+    specs[0].name = "resample";
+    specs[1].name = "stretch";
+    specs[1].thread = opts.threaded;
+    specs[2].name = "dump";
+    specs[2].thread = opts.threaded;
+  }
+
+  for (const StageSpec& spec : specs) {
+    int rank = static_cast<int>(std::find(std::begin(order), std::end(order), spec.name)
+                                - std::begin(order));
+    if (rank == 4) {
+      oss << "Unknown stage '" << spec.name << "'";
+      throw std::runtime_error(oss.str());
+    }
+    if (rank <= last) {
+      oss << "Stage '" << spec.name << "' out of order, expected decode,resample,stretch,dump";
+      throw std::runtime_error(oss.str());
+    }
+    last = rank;
+
+    if (rank == 0) {
+      // the source, it runs on the reading thread
+      if (spec.thread || spec.batch > 0) {
+        throw std::runtime_error("The decode stage cannot be batched or threaded");
+      }
+      continue;
+    }
+
+    if (rank == 1) {
+      if (!resampler_) {
+        // Opus decodes at the output rate, nothing to do
+        continue;
+      }
+      std::unique_ptr<Stage> stage(new ResampleStage(*resampler_, AV_SAMPLE_FMT_FLTP,
+                                                     ch_layout_, sample_rate_));
+      resample = stage.get();
+      pipeline.add(std::move(stage), spec);
+    } else if (rank == 2) {
+      if (!stretching(opts)) {
+        // pitch 1.0, bypassed
+        continue;
+      }
+      StageSpec s = spec;
+      if (opts.stretch.offline && s.batch == 0) {
+        // fewer, larger calls, the offline stretcher does not mind the latency
+        s.batch = Stage::max_block;
+      }
+      if (study) {
+        pipeline.add(std::unique_ptr<Stage>(new StudyStage(*stretcher_, ch_layout_.nb_channels)), s);
+      } else {
+        pipeline.add(std::unique_ptr<Stage>(new StretchStage(*stretcher_, ch_layout_, sample_rate_)), s);
+      }
+    } else if (!study) {
+      pipeline.add(std::unique_ptr<Stage>(new OutputStage(outputs)), spec);
+    }
+  }
+
+  if (last != 3) {
+    throw std::runtime_error("The pipeline must end with a dump stage");
+  }
+  if (resampler_ && !resample) {
+    oss << "Opus cannot decode at " << sample_rate_ << "Hz, a resample stage is needed";
+    throw std::runtime_error(oss.str());
+  }
+
+  return resample;
+}
+
+TranscodeStats Transcoder::remux(const std::string& tlv_file, const std::string& out_file,
+                                 const TranscodeOptions& opts) {
+  TranscodeStats stats;
+  int tlv_len = 0;
+  bool started = false;
+  int64_t ext_rtp = 0;    // unwrapped rtp_ts
+  int64_t first_rtp = 0;
+  int64_t next_pts = 0;   // 48kHz
+
+  PacketSource source(tlv_file, opts);
+  PacketDumper packet_dumper(out_file, ch_layout_.nb_channels);
+
+  tlv_len = feed(source, opts, stats, [&](const avTLVPacket& pkt) {
+    std::span<const uint8_t> payload = pkt.payload();
+    int64_t pts = 0;
+    int duration = 0;
+
+    if (!started) {
+      started = true;
+      ext_rtp = first_rtp = pkt.rtp_ts;
+    } else {
+      ext_rtp += static_cast<int32_t>(pkt.rtp_ts - static_cast<uint32_t>(ext_rtp));
+    }
+    pts = av_rescale(ext_rtp - first_rtp, PacketDumper::opus_rate, opts.rtp_clock_rate);
+
+    if (pts < next_pts) {
+      // duplicate or reordered, the muxer needs monotonic timestamps
+      stats.late++;
+      return;
+    }
+
+    duration = opus_packet_get_nb_samples(payload.data(), static_cast<opus_int32>(payload.size()),
+                                          PacketDumper::opus_rate);
+    if (duration <= 0) {
+      stats.errors++;
+      return;
+    }
+
+    if (packet_dumper.dump(payload.data(), static_cast<int>(payload.size()), pts, duration) < 0) {
+      stats.errors++;
+      return;
+    }
+
+    next_pts = pts + duration;
+    avtool_add_audio(duration, PacketDumper::opus_rate);
+    stats.samples += av_rescale(duration, sample_rate_, PacketDumper::opus_rate);
+  });
+
+  if (opts.log_level >= LogLevel::Info) {
+    cout << "break " << tlv_len << "\n";
+  }
+
+  return stats;
+}
+
+void Transcoder::process(const avTLVPacket& pkt, TranscodeStats& stats,
+                         const TranscodeOptions& opts) {
+  FloatPlanes planes;
+  int samples = 0;
+
+  if (have_prev_ && static_cast<int16_t>(pkt.seq - next_seq_) < 0) {
+    int behind = -static_cast<int16_t>(pkt.seq - next_seq_);
+    int64_t jump_ms = static_cast<int64_t>(static_cast<int32_t>(pkt.rtp_ts - prev_rtp_ts_))
+                      * 1000 / opts.rtp_clock_rate;
+
+    if (behind > opts.max_conceal_packets || std::abs(jump_ms) > opts.max_gap_ms) {
+      // sender restart or new SSRC, not a late packet: start over from here
+      if (debug(opts)) {
+        cout << "seq=" << pkt.seq << ": seq went back by " << behind << ", resync\n";
+      }
+      have_prev_ = false;
+      next_seq_ = 0;
+      prev_rtp_ts_ = 0;
+    } else {
+      // duplicate or too late, its slot is already filled
+      if (debug(opts)) {
+        cout << "seq=" << pkt.seq << ": late packet, drop\n";
+      }
+      stats.late++;
+      return;
+    }
+  }
+
+  if (opts.conceal_loss && fill_gap(pkt, stats, opts) < 0) {
+    stats.errors++;
+  }
+
+  planes = decode_planes();
+  if (planes.empty()) {
+    stats.errors++;
+    return;
+  }
+
+  {
+    avtool_time_scope(Metric::Decode);
+    samples = av_opus_decode_planar(opus_ctx_,
+                                    pkt.payload().data(),
+                                    static_cast<int>(pkt.payload().size()),
+                                    planes.planes(), max_samples_cache);
+  }
+  // one line per packet, rate limited
+  if (debug(opts)) {
+    cout << "seq=" << pkt.seq
+         << (pkt.marker ? "#" : "")
+         << ", rtp_ts=" << pkt.rtp_ts
+         << ", cap_ts=" << pkt.cap_ts;
+    if (samples > 0) {
+      cout << ": " << samples << " samples decoded\n";
+    } else {
+      cout << ": decode error(" << samples << ")\n";
+    }
+  }
+  if (samples <= 0) {
+    stats.errors++;
+    return;
+  }
+
+  have_prev_ = true;
+  next_seq_ = pkt.seq + 1;
+  prev_rtp_ts_ = pkt.rtp_ts;
+  prev_frame_samples_ = samples;
+
+  if (push(samples, stats) < 0) {
+    stats.errors++;
+  }
+}
+
+FloatPlanes Transcoder::decode_planes() {
+  if (dec_pool_->get(dec_frame_, max_samples_cache) < 0) {
+    return FloatPlanes();
+  }
+  return FloatPlanes(dec_frame_->extended_data, ch_layout_.nb_channels, max_samples_cache);
+}
+
+int Transcoder::push(int samples, TranscodeStats& stats) {
+  int rc = 0;
+
+  if (!resampler_) {
+    // already at the output rate, see build_pipeline() otherwise
+    stats.samples += samples;
+  }
+
+  avtool_add_audio(samples, decode_rate_);
+
+  // the stages downstream take references, the next decode gets a fresh buffer
+  dec_frame_->nb_samples = samples;
+  rc = pipeline_->push(dec_frame_);
+  av_frame_unref(dec_frame_);
+
+  return rc;
+}
+
+bool Transcoder::debug(const TranscodeOptions& opts) {
+  uint64_t suppressed = 0;
+
+  if (opts.log_level < LogLevel::Debug || !log_.allow()) {
+    return false;
+  }
+
+  suppressed = log_.take_suppressed();
+  if (suppressed > 0) {
+    cout << "(" << suppressed << " lines suppressed)\n";
+  }
+
+  return true;
+}
+
+int Transcoder::fill_gap(const avTLVPacket& pkt, TranscodeStats& stats,
+                         const TranscodeOptions& opts) {
+  int lost = 0;
+  int64_t gap = 0;
+  int rc = 0;
+
+  if (!have_prev_) {
+    return 0;
+  }
+
+  lost = static_cast<int16_t>(pkt.seq - next_seq_);
+
+  // samples between the end of the previous frame and the start of this one
+  gap = static_cast<int64_t>(static_cast<int32_t>(pkt.rtp_ts - prev_rtp_ts_))
+        * decode_rate_ / opts.rtp_clock_rate - prev_frame_samples_;
+  if (lost == 0 && gap < prev_frame_samples_) {
+    // contiguous, small rtp_ts jitter is not a gap
+    return 0;
+  }
+  if (gap <= 0) {
+    // no usable rtp_ts, assume same-sized frames
+    gap = static_cast<int64_t>(lost) * prev_frame_samples_;
+  }
+  if (gap > static_cast<int64_t>(opts.max_gap_ms) * decode_rate_ / 1000) {
+    // discontinuity rather than loss, leave the timeline alone
+    return 0;
+  }
+
+  stats.lost += lost;
+
+  if (debug(opts)) {
+    cout << lost << " packets lost, " << gap << " samples missing\n";
+  }
+
+  // a few lost frames: let the decoder conceal them, the last one from the
+  // FEC data carried by this packet
+  if (lost > 0 && lost <= opts.max_conceal_packets) {
+    for (int i = 0; i < lost && gap >= prev_frame_samples_; i++) {
+      bool last = (i == lost - 1);
+      FloatPlanes planes = decode_planes();
+      if (planes.empty()) {
+        return -1;
+      }
+      {
+        avtool_time_scope(Metric::Decode);
+        rc = av_opus_conceal_planar(opus_ctx_,
+                                    last ? pkt.payload().data() : NULL,
+                                    last ? static_cast<int>(pkt.payload().size()) : 0,
+                                    planes.planes(), prev_frame_samples_);
+      }
+      if (rc <= 0) {
+        return -1;
+      }
+      stats.concealed += rc;
+      gap -= rc;
+      if (push(rc, stats) < 0) {
+        return -2;
+      }
+    }
+  }
+
+  // DTX, long gaps and whatever concealment did not cover: plain silence,
+  // no need to run the decoder for frames that carry no information
+  while (gap > 0) {
+    int n = static_cast<int>(std::min<int64_t>(gap, AV_OPUS_MAX_FRAME_SAMPLES));
+    FloatPlanes planes = decode_planes().first(n);
+    if (planes.empty()) {
+      return -3;
+    }
+    for (int ch = 0; ch < planes.channels(); ch++) {
+      std::ranges::fill(planes.channel(ch), 0.0f);
+    }
+    stats.silence += n;
+    gap -= n;
+    if (push(n, stats) < 0) {
+      return -3;
+    }
+  }
+
+  return 0;
+}
+
+void Transcoder::setup_stretcher(const StretchOptions& opts) {
+  RubberBand::RubberBandStretcher::Options options = 0;
+
+  if (stretcher_ && stretcher_opts_.engine == opts.engine && stretcher_opts_.offline == opts.offline) {
+    stretcher_->reset();
+  } else {
+    options |= opts.offline ? RubberBand::RubberBandStretcher::OptionProcessOffline
+                            : RubberBand::RubberBandStretcher::OptionProcessRealTime;
+    options |= (opts.engine == StretchEngine::Faster) ? RubberBand::RubberBandStretcher::OptionEngineFaster
+                                                      : RubberBand::RubberBandStretcher::OptionEngineFiner;
+    stretcher_.reset(new RubberBand::RubberBandStretcher(sample_rate_, ch_layout_.nb_channels, options));
+  }
+
+  stretcher_opts_ = opts;
+  stretcher_->setPitchScale(opts.pitch_scale);
+  // a batched stretch stage hands over up to this much at once
+  stretcher_->setMaxProcessSize(Stage::max_block);
+}
+
+bool Transcoder::stretching(const TranscodeOptions& opts) const {
+  if (opts.stretch.pitch_scale == 1.0) {
+    return false;
+  }
+
+  return opts.pipeline.empty()
+         || std::any_of(opts.pipeline.begin(), opts.pipeline.end(),
+                        [](const StageSpec& spec) { return spec.name == "stretch"; });
+}
+
+int Transcoder::restart() {
+  int rc = 0;
+
+  rc = av_opus_reset(opus_ctx_);
+  if (rc != OPUS_OK) {
+    return -1;
+  }
+
+  if (resampler_) {
+    rc = resampler_->restart();
+    if (rc < 0) {
+      return -2;
+    }
+  }
+
+  have_prev_ = false;
+  next_seq_ = 0;
+  prev_rtp_ts_ = 0;
+  prev_frame_samples_ = 0;
+
+  return 0;
+}
@@ -0,0 +1,225 @@
+//
+//  transcoder.hpp
+//  avtool
+//
+//  Created by zhanwang-sky on 2023/11/20.
+//
+
+#ifndef transcoder_hpp
+#define transcoder_hpp
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <rubberband/RubberBandStretcher.h>
+#include "../mod_opus/mod_opus.h"
+#include "../tlv_packet.hpp"
+#include "audio_helper.hpp"
+#include "log_limiter.hpp"
+#include "media_dumper.hpp"
+#include "pipeline.hpp"
+
+namespace AVTool {
+
+enum class StretchEngine {
+  Faster,  // R2, OptionEngineFaster
+  Finer,   // R3, OptionEngineFiner
+};
+
+// The RubberBand pitch shift. Realtime mode works on the blocks as they are
+// decoded. Offline mode (OptionProcessOffline) reads the dump twice: a study
+// pass over the whole of it and then the real one, fed in large blocks.
+// That gives better quality and throughput, but it needs a seekable dump.
+struct StretchOptions {
+  double pitch_scale = 1.35;  // 1.0: no stretcher at all
+  StretchEngine engine = StretchEngine::Finer;
+  bool offline = false;
+};
+
+// "pitch=1.2:engine=faster:offline" into |opts|, engine is faster (R2) or
+// finer (R3), offline / realtime pick the mode. returns false if malformed
+bool parse_stretch_options(const char* spec, StretchOptions& opts);
+
+struct TranscodeOptions {
+  bool async_read = false;
+  // copy the Opus payloads into the output container as they are, no
+  // decoding / pitch shift, see PacketDumper
+  bool remux = false;
+  // wait for a dump that is still being written, stop after follow_idle_ms
+  // without new data (< 0: never)
+  bool follow = false;
+  int follow_idle_ms = 10000;
+  uint64_t from_cap_ts = 0;
+  uint64_t to_cap_ts = UINT64_MAX;
+  // per packet lines (Debug) are capped at log_rate lines per second, the
+  // rest is counted and reported with the next line that goes out
+  LogLevel log_level = LogLevel::Quiet;
+  int log_rate = 50;
+
+  // packet loss handling, driven by seq / rtp_ts discontinuities. a seq
+  // going back by more than max_conceal_packets, or an rtp_ts jump beyond
+  // max_gap_ms, is a restart of the stream rather than a late packet (also
+  // without conceal_loss)
+  bool conceal_loss = true;
+  int max_conceal_packets = 5;  // longer bursts are filled with silence
+  int max_gap_ms = 60000;       // longer jumps are treated as discontinuities
+  int rtp_clock_rate = 48000;   // RFC 7587
+
+  // reorder / dejitter live captures before decoding, see avTLVJitterBuffer
+  bool jitter_buffer = false;
+  int jitter_target_ms = 40;
+  int jitter_max_ms = 200;
+
+  StretchOptions stretch;
+
+  // stages after the decoder, in order: resample (only used when Opus
+  // cannot decode at the output rate), stretch (optional, skipped at pitch
+  // 1.0) and dump, see parse_pipeline(). empty: all of them, stretch and
+  // dump on worker threads of their own if |threaded|, stretch in
+  // Stage::max_block batches if offline
+  std::vector<StageSpec> pipeline;
+  bool threaded = false;
+
+  // blocks queued to each output's writer thread, 0: encode inline.
+  // with several outputs this also runs them in parallel
+  int dump_queue = 0;
+
+  // roll the outputs into segments (see SegmentedDumper) every N seconds
+  // and / or N bytes, 0: one file per output
+  double segment_secs = 0;
+  int64_t segment_bytes = 0;
+  // "m3u8" or "txt": a manifest named after the output, next to the
+  // segments. empty: none
+  std::string segment_manifest;
+
+  // per output, in order, the last one also covers the outputs after it.
+  // empty: FFmpeg defaults for every output
+  std::vector<EncoderOptions> encoders;
+};
+
+struct TranscodeStats {
+  uint64_t packets = 0;
+  uint64_t bytes = 0;
+  uint64_t samples = 0;  // decoded samples per channel, at the output rate
+  uint64_t errors = 0;
+  uint64_t late = 0;       // packets dropped, their slot already played out
+  uint64_t duplicate = 0;
+  uint64_t reordered = 0;  // put back in order by the jitter buffer
+  uint64_t lost = 0;       // packets missing from the seq sequence
+  uint64_t concealed = 0;  // samples synthesized by FEC / PLC, decode rate
+  uint64_t silence = 0;    // samples filled with silence, decode rate
+
+  TranscodeStats& operator+=(const TranscodeStats& rhs) {
+    packets += rhs.packets;
+    bytes += rhs.bytes;
+    samples += rhs.samples;
+    errors += rhs.errors;
+    late += rhs.late;
+    duplicate += rhs.duplicate;
+    reordered += rhs.reordered;
+    lost += rhs.lost;
+    concealed += rhs.concealed;
+    silence += rhs.silence;
+    return *this;
+  }
+};
+
+// TLV(Opus) -> decode to FLTP -> pitch shift -> AudioDumper(s), the part
+// after the decoder is a Pipeline of stages (see TranscodeOptions::pipeline).
+// Opus decodes straight to planar float at the output rate when it supports
+// it natively, otherwise it decodes at 48kHz and goes through a Resampler.
+// Decoder, resampler, stretcher and scratch buffers are kept across
+// run() calls, so one instance per worker serves any number of dumps.
+class Transcoder {
+ public:
+  static constexpr int max_samples_cache = 16384;
+
+  Transcoder(const Transcoder&) = delete;
+  Transcoder& operator=(const Transcoder&) = delete;
+
+  // |opus_pool| (optional) supplies the decoder, a context is taken at
+  // construction and handed back at destruction. it has to be at
+  // decode_rate(sample_rate) with |channels| and outlive the transcoder.
+  // an exhausted pool falls back to a context of its own
+  Transcoder(int sample_rate, int channels,
+             ResamplerPreset resample_preset = ResamplerPreset::Default,
+             av_opus_pool_t* opus_pool = NULL);
+
+  virtual ~Transcoder();
+
+  // the rate Opus decodes at for |sample_rate| output, resampled from there
+  static int decode_rate(int sample_rate);
+
+  // throws std::runtime_error if the dump or the output cannot be opened
+  TranscodeStats run(const std::string& tlv_file, const std::string& out_file,
+                     const TranscodeOptions& opts = TranscodeOptions());
+
+  // one decode and stretch feeding every output, see AudioFanout
+  TranscodeStats run(const std::string& tlv_file, const std::vector<std::string>& out_files,
+                     const TranscodeOptions& opts = TranscodeOptions());
+
+ private:
+  // TranscodeOptions::remux, pts from rtp_ts, duration from the Opus TOC
+  TranscodeStats remux(const std::string& tlv_file, const std::string& out_file,
+                       const TranscodeOptions& opts);
+
+  // decoder side only, the stretcher is set up by setup_stretcher()
+  int restart();
+
+  // a stretcher as |opts| asks, reused if the engine and mode match
+  void setup_stretcher(const StretchOptions& opts);
+
+  // true if the pipeline has a stretch stage that is not bypassed
+  bool stretching(const TranscodeOptions& opts) const;
+
+  // a fresh pooled block for the decoder, empty on failure
+  FloatPlanes decode_planes();
+
+  // the stages behind the decoder as |opts| asks, returns the resample
+  // stage if any. |study|: the offline study pass instead, it ends in a
+  // StudyStage. throws std::runtime_error if the description does not
+  // make sense
+  const Stage* build_pipeline(Pipeline& pipeline, AudioFanout& outputs, const TranscodeOptions& opts,
+                              bool study = false);
+
+  // gap handling, decode and push of one packet in playout order
+  void process(const avTLVPacket& pkt, TranscodeStats& stats, const TranscodeOptions& opts);
+
+  // the first |samples| of decode_planes() into the pipeline
+  int push(int samples, TranscodeStats& stats);
+
+  // conceal / fill the timeline between the previous packet and |pkt|
+  int fill_gap(const avTLVPacket& pkt, TranscodeStats& stats, const TranscodeOptions& opts);
+
+  // true if a Debug line may go out now
+  bool debug(const TranscodeOptions& opts);
+
+  int sample_rate_;
+  AVChannelLayout ch_layout_;
+
+  int decode_rate_;
+
+  av_opus_context_t* opus_ctx_ = NULL;
+  std::unique_ptr<Resampler> resampler_;  // only if decode_rate_ != sample_rate_
+  std::unique_ptr<RubberBand::RubberBandStretcher> stretcher_;  // only once stretching
+  StretchOptions stretcher_opts_;  // what |stretcher_| was created with
+
+  // decoder output, decode_rate_. the pipeline takes references
+  std::unique_ptr<FramePool> dec_pool_;
+  AVFrame* dec_frame_ = NULL;
+
+  Pipeline* pipeline_ = NULL;  // only while run() is in progress
+
+  LogLimiter log_;
+
+  bool have_prev_ = false;
+  uint16_t next_seq_ = 0;
+  uint32_t prev_rtp_ts_ = 0;
+  int prev_frame_samples_ = 0;
+};
+
+}
+
+#endif /* transcoder_hpp */
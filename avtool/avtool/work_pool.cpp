@@ -0,0 +1,128 @@
+//
+//  work_pool.cpp
+//  avtool
+//
+//  Created by zhanwang-sky on 2023/11/20.
+//
+
+#include <algorithm>
+
+#if defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+#include "work_pool.hpp"
+
+using namespace AVTool;
+
+WorkPool::WorkPool(int nr_workers, bool pin_cpus) {
+  if (nr_workers <= 0) {
+    nr_workers = std::max(1u, std::thread::hardware_concurrency());
+  }
+
+  for (int i = 0; i < nr_workers; i++) {
+    workers_.emplace_back(new Worker);
+  }
+
+  for (int i = 0; i < nr_workers; i++) {
+    threads_.emplace_back(&WorkPool::run, this, i, pin_cpus);
+  }
+}
+
+WorkPool::~WorkPool() {
+  {
+    std::lock_guard<std::mutex> lk(mtx_);
+    stop_ = true;
+  }
+  work_cv_.notify_all();
+
+  for (std::thread& t : threads_) {
+    t.join();
+  }
+}
+
+int WorkPool::size() const {
+  return static_cast<int>(workers_.size());
+}
+
+void WorkPool::submit(Task task) {
+  Worker& w = *workers_[next_worker_++ % workers_.size()];
+
+  {
+    std::lock_guard<std::mutex> lk(w.mtx);
+    w.tasks.push_back(std::move(task));
+  }
+
+  {
+    std::lock_guard<std::mutex> lk(mtx_);
+    queued_++;
+    pending_++;
+  }
+  work_cv_.notify_one();
+}
+
+void WorkPool::wait() {
+  std::unique_lock<std::mutex> lk(mtx_);
+  done_cv_.wait(lk, [this] { return pending_ == 0; });
+}
+
+void WorkPool::run(int id, bool pin_cpu) {
+#if defined(__linux__)
+  if (pin_cpu) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(id % std::max(1u, std::thread::hardware_concurrency()), &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+  }
+#else
+  (void) pin_cpu;  // thread affinity is not available here
+#endif
+
+  while (true) {
+    Task task;
+
+    if (pop(id, task)) {
+      task(id);
+      std::lock_guard<std::mutex> lk(mtx_);
+      if (--pending_ == 0) {
+        done_cv_.notify_all();
+      }
+      continue;
+    }
+
+    std::unique_lock<std::mutex> lk(mtx_);
+    work_cv_.wait(lk, [this] { return stop_ || queued_ > 0; });
+    if (stop_ && queued_ == 0) {
+      break;
+    }
+  }
+}
+
+bool WorkPool::pop(int id, Task& task) {
+  int n = size();
+  bool found = false;
+
+  // own queue first (LIFO), then steal (FIFO) from the others
+  for (int i = 0; i < n && !found; i++) {
+    Worker& w = *workers_[(id + i) % n];
+    std::lock_guard<std::mutex> lk(w.mtx);
+    if (!w.tasks.empty()) {
+      if (i == 0) {
+        task = std::move(w.tasks.back());
+        w.tasks.pop_back();
+      } else {
+        task = std::move(w.tasks.front());
+        w.tasks.pop_front();
+      }
+      found = true;
+    }
+  }
+
+  if (found) {
+    std::lock_guard<std::mutex> lk(mtx_);
+    queued_--;
+  }
+
+  return found;
+}
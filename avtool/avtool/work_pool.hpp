@@ -0,0 +1,68 @@
+//
+//  work_pool.hpp
+//  avtool
+//
+//  Created by zhanwang-sky on 2023/11/20.
+//
+
+#ifndef work_pool_hpp
+#define work_pool_hpp
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace AVTool {
+
+// Fixed-size pool, every worker owns a deque: it pops its own tasks from the
+// back and steals from the front of the others when it runs dry.
+class WorkPool {
+ public:
+  // |worker| is the index of the thread running the task, in [0, size())
+  using Task = std::function<void(int worker)>;
+
+  WorkPool(const WorkPool&) = delete;
+  WorkPool& operator=(const WorkPool&) = delete;
+
+  // |nr_workers| <= 0 means one per hardware thread
+  explicit WorkPool(int nr_workers, bool pin_cpus = false);
+
+  virtual ~WorkPool();
+
+  int size() const;
+
+  void submit(Task task);
+
+  // block until every submitted task has finished
+  void wait();
+
+ private:
+  struct Worker {
+    std::mutex mtx;
+    std::deque<Task> tasks;
+  };
+
+  void run(int id, bool pin_cpu);
+
+  bool pop(int id, Task& task);
+
+  std::vector<std::unique_ptr<Worker>> workers_;
+  std::vector<std::thread> threads_;
+
+  std::mutex mtx_;
+  std::condition_variable work_cv_;
+  std::condition_variable done_cv_;
+  int queued_ = 0;   // guarded by mtx_
+  int pending_ = 0;  // guarded by mtx_
+  bool stop_ = false;
+  std::atomic<unsigned> next_worker_{0};
+};
+
+}
+
+#endif /* work_pool_hpp */
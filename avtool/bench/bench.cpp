@@ -0,0 +1,104 @@
+//
+//  bench.cpp
+//  avtool
+//
+//  Created by zhanwang-sky on 2023/11/27.
+//
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <iostream>
+#include "bench.hpp"
+
+using namespace AVTool;
+
+namespace {
+
+typedef std::chrono::steady_clock Clock;
+
+// the time |ops| calls take, < 0 if one failed
+double time_ops(const std::function<int()>& fn, int64_t ops) {
+  Clock::time_point start = Clock::now();
+
+  for (int64_t i = 0; i < ops; i++) {
+    if (fn() < 0) {
+      return -1;
+    }
+  }
+
+  return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+}
+
+BenchRunner::BenchRunner(int reps, double min_secs, const std::string& filter)
+    : reps_(std::max(reps, 1)),
+      min_secs_(min_secs),
+      filter_(filter) { }
+
+bool BenchRunner::enabled(const std::string& name) const {
+  return filter_.empty() || name.find(filter_) != std::string::npos;
+}
+
+bool BenchRunner::run(const std::string& name, const std::string& unit, double items,
+                      const std::function<int()>& fn,
+                      const std::function<void()>& setup) {
+  std::vector<double> ns;
+  BenchResult r;
+  int64_t ops = 1;
+  double secs = 0;
+
+  if (!enabled(name)) {
+    return false;
+  }
+
+  // warm up and calibrate: grow until one repetition is long enough
+  for (;;) {
+    if (setup) {
+      setup();
+    }
+    secs = time_ops(fn, ops);
+    if (secs < 0) {
+      fprintf(stderr, "%s: failed\n", name.c_str());
+      return false;
+    }
+    if (secs >= min_secs_ || ops >= (INT64_C(1) << 40)) {
+      break;
+    }
+    ops = (secs > 0) ? std::max(ops * 2, static_cast<int64_t>(ops * 1.2 * min_secs_ / secs)) : ops * 10;
+  }
+
+  for (int i = 0; i < reps_; i++) {
+    if (setup) {
+      setup();
+    }
+    secs = time_ops(fn, ops);
+    if (secs < 0) {
+      fprintf(stderr, "%s: failed\n", name.c_str());
+      return false;
+    }
+    ns.push_back(secs * 1e9 / ops);
+  }
+  std::sort(ns.begin(), ns.end());
+
+  r.name = name;
+  r.unit = unit;
+  r.ops = ops;
+  r.ns_per_op = ns[ns.size() / 2];
+  r.min_ns_per_op = ns.front();
+  r.items_per_sec = (r.ns_per_op > 0) ? items * 1e9 / r.ns_per_op : 0;
+  results_.push_back(r);
+
+  print(std::cout, r);
+
+  return true;
+}
+
+void BenchRunner::print(std::ostream& os, const BenchResult& r) {
+  char line[256];
+
+  snprintf(line, sizeof(line), "%-28s %12.0f ns/op %12.0f ns/op(min) %14.0f %s/s\n",
+           r.name.c_str(), r.ns_per_op, r.min_ns_per_op, r.items_per_sec, r.unit.c_str());
+  os << line << std::flush;
+}
@@ -0,0 +1,58 @@
+//
+//  bench.hpp
+//  avtool
+//
+//  Created by zhanwang-sky on 2023/11/27.
+//
+
+#ifndef bench_hpp
+#define bench_hpp
+
+#include <cstdint>
+#include <functional>
+#include <ostream>
+#include <string>
+#include <vector>
+
+namespace AVTool {
+
+struct BenchResult {
+  std::string name;
+  std::string unit;          // what an item is: "packets", "samples", ...
+  int64_t ops = 0;           // calls per repetition
+  double ns_per_op = 0;      // median over the repetitions
+  double min_ns_per_op = 0;
+  double items_per_sec = 0;  // at the median
+};
+
+// Minimal timing loop, no dependencies. Every benchmark is calibrated to
+// run at least |min_secs| per repetition, the median of |reps| counts.
+class BenchRunner {
+ public:
+  // |filter| non-empty: only benchmarks whose name contains it
+  BenchRunner(int reps, double min_secs, const std::string& filter);
+
+  bool enabled(const std::string& name) const;
+
+  // |fn| does one op worth |items| |unit|s. |setup| runs before every
+  // repetition, untimed. returns false if skipped or |fn| failed (< 0)
+  bool run(const std::string& name, const std::string& unit, double items,
+           const std::function<int()>& fn,
+           const std::function<void()>& setup = std::function<void()>());
+
+  const std::vector<BenchResult>& results() const { return results_; }
+
+  // one line per result
+  static void print(std::ostream& os, const BenchResult& r);
+
+ private:
+  int reps_;
+  double min_secs_;
+  std::string filter_;
+
+  std::vector<BenchResult> results_;
+};
+
+}
+
+#endif /* bench_hpp */
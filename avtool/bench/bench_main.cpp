@@ -0,0 +1,612 @@
+//
+//  bench_main.cpp
+//  avtool
+//
+//  Created by zhanwang-sky on 2023/11/27.
+//
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include <getopt.h>
+#include <unistd.h>
+
+extern "C" {
+#include <libswresample/swresample.h>
+}
+
+#include <rubberband/RubberBandStretcher.h>
+#include "../avtool/audio_helper.hpp"
+#include "../avtool/media_dumper.hpp"
+#include "../avtool/metrics.hpp"
+#include "../avtool/output_sink.hpp"
+#include "../avtool/sample_convert.hpp"
+#include "../avtool/transcoder.hpp"
+#include "../mod_opus/mod_opus.h"
+#include "../tlv_reader.hpp"
+#include "bench.hpp"
+#include "synthetic_dump.hpp"
+
+// what the tool runs with, see main.cpp
+#define SAMPLE_RATE 16000
+#define NR_CHANNELS 1
+
+using std::cout;
+using std::cerr;
+using std::endl;
+
+namespace {
+
+struct Config {
+  AVTool::SyntheticDumpOptions dump;  // dump.sample_rate: the capture rate
+  std::string dump_file;      // an existing dump instead of a synthetic one
+  int reps = 5;
+  double min_secs = 0.2;
+  std::string filter;
+  std::string json_file;
+};
+
+struct EndToEnd {
+  std::string name;
+  double wall_secs = 0;  // median
+  AVTool::TranscodeStats stats;
+
+  double packets_per_sec() const { return wall_secs > 0 ? stats.packets / wall_secs : 0; }
+
+  double mb_per_sec() const { return wall_secs > 0 ? stats.bytes / 1e6 / wall_secs : 0; }
+
+  double realtime_factor() const {
+    return wall_secs > 0 ? static_cast<double>(stats.samples) / SAMPLE_RATE / wall_secs : 0;
+  }
+};
+
+void usage() {
+  cerr << "Usage: ./avtool_bench [-d secs] [-r rate] [-b bitrate] [-l loss] [-S seed] [-i dump.tlv]\n"
+       << "                      [-n reps] [-m min_secs] [-f filter] [-o results.json]\n"
+       << "  -d  seconds of synthetic speech to encode (default: 60)\n"
+       << "  -r  capture rate of the synthetic dump (default: 48000)\n"
+       << "  -b  Opus bit rate (default: 24000)\n"
+       << "  -l  fraction of packets to drop, e.g. 0.02\n"
+       << "  -S  generator seed, same seed, same dump\n"
+       << "  -i  benchmark an existing dump instead\n"
+       << "  -n  repetitions per benchmark, the median counts (default: 5)\n"
+       << "  -m  minimum seconds per repetition (default: 0.2)\n"
+       << "  -f  only run benchmarks whose name contains filter\n"
+       << "  -o  write the results as JSON\n";
+  exit(EXIT_FAILURE);
+}
+
+// the payloads of |filename|, to feed decoders without the reader
+std::vector<std::vector<uint8_t>> load_payloads(const std::string& filename) {
+  std::vector<std::vector<uint8_t>> payloads;
+  avTLVReader reader(filename);
+  avTLVPacket pkt;
+
+  while (reader.next(pkt) > 0) {
+    payloads.emplace_back(pkt.payload().begin(), pkt.payload().end());
+  }
+
+  return payloads;
+}
+
+void bench_reader(AVTool::BenchRunner& runner, const std::string& dump_file, double packets) {
+  avTLVReader reader(dump_file);
+  std::vector<uint8_t> buf(UINT16_MAX);
+
+  if (!reader.is_open()) {
+    return;
+  }
+
+  // one op: the whole dump
+  runner.run("tlv_read", "packets", packets, [&] {
+    uint8_t marker = 0;
+    uint16_t seq = 0;
+    uint32_t rtp_ts = 0;
+    uint64_t cap_ts = 0;
+    int rc = 0;
+    reader.seek(0);
+    while ((rc = reader.read(buf.data(), static_cast<int>(buf.size()), marker, seq, rtp_ts, cap_ts)) > 0) { }
+    return rc;
+  });
+
+  runner.run("tlv_next", "packets", packets, [&] {
+    avTLVPacket pkt;
+    int rc = 0;
+    reader.seek(0);
+    while ((rc = reader.next(pkt)) > 0) { }
+    return rc;
+  });
+}
+
+void bench_decoder(AVTool::BenchRunner& runner, const std::vector<std::vector<uint8_t>>& payloads) {
+  std::unique_ptr<av_opus_context_t, void (*)(av_opus_context_t*)> ctx(
+      av_opus_init(true, false, SAMPLE_RATE, NR_CHANNELS), av_opus_destroy);
+  std::vector<int16_t> pcm(AV_OPUS_MAX_FRAME_SAMPLES * NR_CHANNELS);
+  std::vector<float> plane(AV_OPUS_MAX_FRAME_SAMPLES * NR_CHANNELS);
+  size_t next = 0;
+
+  if (!ctx || payloads.empty()) {
+    return;
+  }
+
+  // one op: one packet, round and round the dump
+  auto decode = [&](bool planar) {
+    const std::vector<uint8_t>& p = payloads[next];
+    float* planes[1] = {plane.data()};
+    if (++next == payloads.size()) {
+      next = 0;
+      av_opus_reset(ctx.get());
+    }
+    return planar
+           ? av_opus_decode_planar(ctx.get(), p.data(), static_cast<int>(p.size()), planes, AV_OPUS_MAX_FRAME_SAMPLES)
+           : av_opus_decode(ctx.get(), p.data(), static_cast<int>(p.size()),
+                            reinterpret_cast<uint8_t*>(pcm.data()), AV_OPUS_MAX_FRAME_SAMPLES);
+  };
+  auto restart = [&] {
+    next = 0;
+    av_opus_reset(ctx.get());
+  };
+
+  runner.run("opus_decode", "packets", 1, [&] { return decode(false); }, restart);
+  runner.run("opus_decode_planar", "packets", 1, [&] { return decode(true); }, restart);
+}
+
+// av_opus_decode_batch_float against a loop of av_opus_decode_float over
+// the same packets into the same buffer
+void bench_batch_decoder(AVTool::BenchRunner& runner, const std::vector<std::vector<uint8_t>>& payloads) {
+  const int batch = 50;  // 1s of 20ms packets
+  std::unique_ptr<av_opus_context_t, void (*)(av_opus_context_t*)> ctx(
+      av_opus_init(true, false, SAMPLE_RATE, NR_CHANNELS), av_opus_destroy);
+  const int samples = batch * SAMPLE_RATE / 50 * 3;  // room for up to 60ms packets
+  std::vector<float> pcm(static_cast<size_t>(samples) * NR_CHANNELS);
+  std::vector<const uint8_t*> pkts;
+  std::vector<int> lens;
+  size_t next = 0;
+
+  if (!ctx || payloads.size() < static_cast<size_t>(batch)) {
+    return;
+  }
+
+  for (size_t i = 0; i + batch <= payloads.size(); i++) {
+    pkts.push_back(payloads[i].data());
+    lens.push_back(static_cast<int>(payloads[i].size()));
+  }
+
+  // one op: |batch| consecutive packets
+  auto take = [&] {
+    size_t first = next;
+    next += batch;
+    if (next + batch > pkts.size()) {
+      next = 0;
+      av_opus_reset(ctx.get());
+    }
+    return first;
+  };
+  auto restart = [&] {
+    next = 0;
+    av_opus_reset(ctx.get());
+  };
+
+  runner.run("opus_decode_float_x50", "packets", batch, [&] {
+    size_t first = take();
+    int done = 0;
+    for (int i = 0; i < batch; i++) {
+      int rc = av_opus_decode_float(ctx.get(), pkts[first + i], lens[first + i],
+                                    pcm.data() + static_cast<size_t>(done) * NR_CHANNELS, samples - done);
+      if (rc < 0) {
+        return rc;
+      }
+      done += rc;
+    }
+    return done;
+  }, restart);
+
+  runner.run("opus_decode_batch_float", "packets", batch, [&] {
+    size_t first = take();
+    return av_opus_decode_batch_float(ctx.get(), &pkts[first], &lens[first], batch,
+                                      pcm.data(), samples, NULL);
+  }, restart);
+}
+
+// what a batch worker pays per job for its decoder: a fresh context against
+// one recycled from av_opus_pool
+void bench_decoder_setup(AVTool::BenchRunner& runner) {
+  av_opus_pool_t* pool = av_opus_pool_create(1, SAMPLE_RATE, NR_CHANNELS);
+
+  runner.run("opus_ctx_init", "contexts", 1, [] {
+    av_opus_context_t* ctx = av_opus_init(true, false, SAMPLE_RATE, NR_CHANNELS);
+    av_opus_destroy(ctx);
+    return ctx ? 0 : -1;
+  });
+
+  if (pool) {
+    runner.run("opus_pool_acquire", "contexts", 1, [pool] {
+      av_opus_context_t* ctx = av_opus_pool_acquire(pool);
+      av_opus_destroy(ctx);
+      return ctx ? 0 : -1;
+    });
+  }
+
+  av_opus_pool_destroy(pool);
+}
+
+void bench_resampler(AVTool::BenchRunner& runner, const std::vector<float>& speech48k) {
+  static const struct {
+    const char* name;
+    AVTool::ResamplerPreset preset;
+  } presets[] = {
+    {"resample_48k_16k_fast", AVTool::ResamplerPreset::Fast},
+    {"resample_48k_16k", AVTool::ResamplerPreset::Default},
+    {"resample_48k_16k_hq", AVTool::ResamplerPreset::HighQuality},
+  };
+  const AVChannelLayout mono = AV_CHANNEL_LAYOUT_MONO;
+  const int block = 960;  // 20ms
+  std::vector<float> out(block);
+  size_t pos = 0;
+
+  for (const auto& p : presets) {
+    AVTool::Resampler resampler(AV_SAMPLE_FMT_FLTP, mono, 48000, AV_SAMPLE_FMT_FLTP, mono, SAMPLE_RATE, p.preset);
+    if (!resampler) {
+      continue;
+    }
+    runner.run(p.name, "samples", block, [&] {
+      const uint8_t* in[1] = {reinterpret_cast<const uint8_t*>(speech48k.data() + pos)};
+      uint8_t* o[1] = {reinterpret_cast<uint8_t*>(out.data())};
+      pos = (pos + 2 * block <= speech48k.size()) ? pos + block : 0;
+      return resampler.resample(o, block, in, block);
+    }, [&] { pos = 0; resampler.restart(); });
+  }
+}
+
+// the SIMD kernel against swresample doing the same S16 -> FLT conversion
+void bench_convert(AVTool::BenchRunner& runner, const std::vector<float>& speech) {
+  const AVChannelLayout mono = AV_CHANNEL_LAYOUT_MONO;
+  const int block = 4096;
+  std::vector<int16_t> s16(block);
+  std::vector<float> flt(block);
+  const uint8_t* in[1] = {reinterpret_cast<const uint8_t*>(s16.data())};
+  uint8_t* out[1] = {reinterpret_cast<uint8_t*>(flt.data())};
+  AVTool::SampleConvertFn convert = AVTool::find_sample_converter(AV_SAMPLE_FMT_S16, AV_SAMPLE_FMT_FLT);
+  SwrContext* swr = NULL;
+
+  for (int i = 0; i < block; i++) {
+    s16[i] = static_cast<int16_t>(speech[i % speech.size()] * 32767);
+  }
+
+  if (convert) {
+    runner.run("convert_s16_flt_simd", "samples", block, [&] {
+      convert(out, in, 1, block);
+      return 0;
+    });
+  }
+
+  if (swr_alloc_set_opts2(&swr, &mono, AV_SAMPLE_FMT_FLT, SAMPLE_RATE,
+                          &mono, AV_SAMPLE_FMT_S16, SAMPLE_RATE, 0, NULL) >= 0
+      && swr_init(swr) >= 0) {
+    runner.run("convert_s16_flt_swr", "samples", block, [&] {
+      return swr_convert(swr, out, block, in, block);
+    });
+  }
+  swr_free(&swr);
+}
+
+// stereo planar float <-> packed S16, the (de)interleaving kernels
+void bench_convert_stereo(AVTool::BenchRunner& runner, const std::vector<float>& speech) {
+  const int block = 4096;
+  std::vector<float> fltp(2 * block);
+  std::vector<int16_t> s16(2 * block);
+  const uint8_t* planes_in[2] = {reinterpret_cast<const uint8_t*>(fltp.data()),
+                                 reinterpret_cast<const uint8_t*>(fltp.data() + block)};
+  uint8_t* planes_out[2] = {reinterpret_cast<uint8_t*>(fltp.data()),
+                            reinterpret_cast<uint8_t*>(fltp.data() + block)};
+  const uint8_t* packed_in[1] = {reinterpret_cast<const uint8_t*>(s16.data())};
+  uint8_t* packed_out[1] = {reinterpret_cast<uint8_t*>(s16.data())};
+  AVTool::SampleConvertFn interleave = AVTool::find_sample_converter(AV_SAMPLE_FMT_FLTP, AV_SAMPLE_FMT_S16);
+  AVTool::SampleConvertFn deinterleave = AVTool::find_sample_converter(AV_SAMPLE_FMT_S16, AV_SAMPLE_FMT_FLTP);
+
+  for (int i = 0; i < block; i++) {
+    fltp[i] = speech[i % speech.size()];
+    fltp[block + i] = 0.8f * fltp[i];
+  }
+
+  if (interleave) {
+    runner.run("convert_fltp_s16_stereo", "samples", block, [&] {
+      interleave(packed_out, planes_in, 2, block);
+      return 0;
+    });
+  }
+
+  if (deinterleave) {
+    runner.run("convert_s16_fltp_stereo", "samples", block, [&] {
+      deinterleave(planes_out, packed_in, 2, block);
+      return 0;
+    });
+  }
+}
+
+void bench_stretcher(AVTool::BenchRunner& runner, const std::vector<float>& speech) {
+  const int block = SAMPLE_RATE / 50;  // 20ms, one decoded packet
+  std::vector<float> out(AVTool::Stage::max_block);
+  float* out_planes[1] = {out.data()};
+  size_t pos = 0;
+
+  // as the Transcoder sets it up
+  RubberBand::RubberBandStretcher stretcher(SAMPLE_RATE, NR_CHANNELS,
+                                            RubberBand::RubberBandStretcher::OptionProcessRealTime
+                                            | RubberBand::RubberBandStretcher::OptionEngineFiner);
+  stretcher.setPitchScale(1.35);
+
+  runner.run("rubberband_process", "samples", block, [&] {
+    const float* in[1] = {speech.data() + pos};
+    int avail = 0;
+    pos = (pos + 2 * block <= speech.size()) ? pos + block : 0;
+    stretcher.process(in, block, false);
+    while ((avail = stretcher.available()) > 0) {
+      stretcher.retrieve(out_planes, std::min(avail, static_cast<int>(out.size())));
+    }
+    return 0;
+  }, [&] { pos = 0; stretcher.reset(); });
+}
+
+void bench_dumper(AVTool::BenchRunner& runner, const std::vector<float>& speech) {
+  const AVChannelLayout mono = AV_CHANNEL_LAYOUT_MONO;
+  const int block = SAMPLE_RATE / 50;
+  size_t pos = 0;
+  // the encoder and muxer, not the disk
+  AVTool::CallbackSink sink([](const uint8_t*, int size) { return size; });
+  std::unique_ptr<AVTool::AudioDumper> dumper;
+
+  try {
+    dumper.reset(new AVTool::AudioDumper(sink, "wav", AV_SAMPLE_FMT_FLTP, mono, SAMPLE_RATE));
+  } catch (std::exception& e) {
+    cerr << "audio_dumper: " << e.what() << endl;
+    return;
+  }
+
+  runner.run("audio_dumper_wav", "samples", block, [&] {
+    const uint8_t* planes[1] = {reinterpret_cast<const uint8_t*>(speech.data() + pos)};
+    pos = (pos + 2 * block <= speech.size()) ? pos + block : 0;
+    return dumper->dump(planes, block);
+  });
+
+  dumper->dump(NULL, 0);
+}
+
+// whole runs through the Transcoder, median wall time of |reps|
+bool bench_transcode(const std::string& name, const std::string& dump_file, const std::string& out_file,
+                     const AVTool::TranscodeOptions& opts, int reps, EndToEnd& result) {
+  AVTool::Transcoder transcoder(SAMPLE_RATE, NR_CHANNELS);
+  std::vector<double> walls;
+
+  result.name = name;
+
+  // one more, the first warms the page cache and the allocators
+  for (int i = 0; i <= reps; i++) {
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    try {
+      result.stats = transcoder.run(dump_file, out_file, opts);
+    } catch (std::exception& e) {
+      cerr << name << ": " << e.what() << endl;
+      return false;
+    }
+    if (i > 0) {
+      walls.push_back(std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+    }
+  }
+  std::sort(walls.begin(), walls.end());
+  result.wall_secs = walls[walls.size() / 2];
+
+  printf("%-28s %12.0f packets/s %8.2f MB/s %10.1f x realtime\n",
+         name.c_str(), result.packets_per_sec(), result.mb_per_sec(), result.realtime_factor());
+  fflush(stdout);
+
+  return true;
+}
+
+std::string json_escape(const std::string& s) {
+  std::string out;
+
+  for (char c : s) {
+    if (c == '"' || c == '\\') {
+      out += '\\';
+    }
+    out += c;
+  }
+
+  return out;
+}
+
+bool write_json(const std::string& filename, const Config& cfg,
+                const std::vector<AVTool::BenchResult>& micro, const std::vector<EndToEnd>& e2e) {
+  std::ofstream ofs(filename, std::ios::trunc);
+
+  ofs << "{\"schema\":1"
+      << ",\"config\":{\"dump\":\"" << json_escape(cfg.dump_file.empty() ? "synthetic" : cfg.dump_file) << "\""
+      << ",\"secs\":" << cfg.dump.secs
+      << ",\"capture_rate\":" << cfg.dump.sample_rate
+      << ",\"bit_rate\":" << cfg.dump.bit_rate
+      << ",\"loss\":" << cfg.dump.loss
+      << ",\"seed\":" << cfg.dump.seed
+      << ",\"output_rate\":" << SAMPLE_RATE
+      << ",\"reps\":" << cfg.reps
+      << ",\"cpus\":" << std::thread::hardware_concurrency()
+#if defined(__VERSION__)
+      << ",\"compiler\":\"" << json_escape(__VERSION__) << "\""
+#endif
+      << ",\"metrics\":" << (AVTOOL_METRICS ? "true" : "false")
+      << "},\"micro\":[";
+  for (size_t i = 0; i < micro.size(); i++) {
+    const AVTool::BenchResult& r = micro[i];
+    ofs << (i ? "," : "") << "{\"name\":\"" << r.name << "\""
+        << ",\"unit\":\"" << r.unit << "\""
+        << ",\"ops\":" << r.ops
+        << ",\"ns_per_op\":" << r.ns_per_op
+        << ",\"min_ns_per_op\":" << r.min_ns_per_op
+        << ",\"items_per_sec\":" << r.items_per_sec << "}";
+  }
+  ofs << "],\"end_to_end\":[";
+  for (size_t i = 0; i < e2e.size(); i++) {
+    const EndToEnd& r = e2e[i];
+    ofs << (i ? "," : "") << "{\"name\":\"" << r.name << "\""
+        << ",\"wall_s\":" << r.wall_secs
+        << ",\"packets\":" << r.stats.packets
+        << ",\"bytes\":" << r.stats.bytes
+        << ",\"packets_per_sec\":" << r.packets_per_sec()
+        << ",\"mb_per_sec\":" << r.mb_per_sec()
+        << ",\"realtime_factor\":" << r.realtime_factor() << "}";
+  }
+  ofs << "]}\n";
+
+  return static_cast<bool>(ofs.flush());
+}
+
+}
+
+int main(int argc, char* argv[]) {
+  Config cfg;
+  std::vector<EndToEnd> e2e;
+  char tmp_dir[] = "/tmp/avtool_bench.XXXXXX";
+  std::string dump_file;
+  std::string out_file;
+  int opt = 0;
+
+  while ((opt = getopt(argc, argv, "d:r:b:l:S:i:n:m:f:o:")) != -1) {
+    switch (opt) {
+      case 'd':
+        cfg.dump.secs = std::stod(optarg);
+        break;
+      case 'r':
+        cfg.dump.sample_rate = std::stoi(optarg);
+        break;
+      case 'b':
+        cfg.dump.bit_rate = std::stoi(optarg);
+        break;
+      case 'l':
+        cfg.dump.loss = std::stod(optarg);
+        break;
+      case 'S':
+        cfg.dump.seed = static_cast<uint32_t>(std::stoul(optarg));
+        break;
+      case 'i':
+        cfg.dump_file = optarg;
+        break;
+      case 'n':
+        cfg.reps = std::stoi(optarg);
+        break;
+      case 'm':
+        cfg.min_secs = std::stod(optarg);
+        break;
+      case 'f':
+        cfg.filter = optarg;
+        break;
+      case 'o':
+        cfg.json_file = optarg;
+        break;
+      default:
+        usage();
+    }
+  }
+  if (optind != argc) {
+    usage();
+  }
+
+  if (!mkdtemp(tmp_dir)) {
+    cerr << "Fail to create a scratch directory" << endl;
+    return EXIT_FAILURE;
+  }
+  out_file = std::string(tmp_dir) + "/out.wav";
+
+  dump_file = cfg.dump_file;
+  if (dump_file.empty()) {
+    AVTool::SyntheticDumpInfo info;
+    dump_file = std::string(tmp_dir) + "/synthetic.tlv";
+    if (AVTool::write_synthetic_dump(dump_file, cfg.dump, &info) < 0) {
+      cerr << "Fail to generate '" << dump_file << "'" << endl;
+      rmdir(tmp_dir);
+      return EXIT_FAILURE;
+    }
+    cout << "synthetic dump: " << info.packets << " packets, " << info.bytes << " bytes, "
+         << cfg.dump.secs << "s @" << cfg.dump.sample_rate << "Hz" << endl;
+  }
+
+  std::vector<std::vector<uint8_t>> payloads = load_payloads(dump_file);
+  if (payloads.empty()) {
+    cerr << "No packets in '" << dump_file << "'" << endl;
+    unlink(dump_file.c_str());
+    rmdir(tmp_dir);
+    return EXIT_FAILURE;
+  }
+
+  // 10s of input for the sample based stages, a fixed seed
+  std::vector<float> speech48k(48000 * 10);
+  std::vector<float> speech(SAMPLE_RATE * 10);
+  AVTool::SpeechSynth(48000, cfg.dump.seed).generate(speech48k.data(), static_cast<int>(speech48k.size()));
+  AVTool::SpeechSynth(SAMPLE_RATE, cfg.dump.seed).generate(speech.data(), static_cast<int>(speech.size()));
+
+  AVTool::BenchRunner runner(cfg.reps, cfg.min_secs, cfg.filter);
+  bench_reader(runner, dump_file, static_cast<double>(payloads.size()));
+  bench_decoder(runner, payloads);
+  bench_batch_decoder(runner, payloads);
+  bench_decoder_setup(runner);
+  bench_resampler(runner, speech48k);
+  bench_convert(runner, speech);
+  bench_convert_stereo(runner, speech);
+  bench_stretcher(runner, speech);
+  bench_dumper(runner, speech);
+
+  AVTool::TranscodeOptions opts;
+  if (runner.enabled("transcode")) {
+    EndToEnd r;
+    if (bench_transcode("transcode", dump_file, out_file, opts, cfg.reps, r)) {
+      e2e.push_back(r);
+    }
+  }
+  if (runner.enabled("transcode_threaded")) {
+    EndToEnd r;
+    opts.threaded = true;
+    if (bench_transcode("transcode_threaded", dump_file, out_file, opts, cfg.reps, r)) {
+      e2e.push_back(r);
+    }
+  }
+
+  // the pitch shift variants, see StretchOptions
+  static const struct {
+    const char* name;
+    const char* stretch;
+  } variants[] = {
+    {"transcode_faster", "engine=faster"},
+    {"transcode_offline", "offline"},
+    {"transcode_offline_faster", "offline:engine=faster"},
+    {"transcode_bypass", "pitch=1"},
+  };
+  for (const auto& v : variants) {
+    if (runner.enabled(v.name)) {
+      AVTool::TranscodeOptions vopts;
+      EndToEnd r;
+      AVTool::parse_stretch_options(v.stretch, vopts.stretch);
+      if (bench_transcode(v.name, dump_file, out_file, vopts, cfg.reps, r)) {
+        e2e.push_back(r);
+      }
+    }
+  }
+
+  unlink(out_file.c_str());
+  if (cfg.dump_file.empty()) {
+    unlink(dump_file.c_str());
+  }
+  rmdir(tmp_dir);
+
+  if (!cfg.json_file.empty() && !write_json(cfg.json_file, cfg, runner.results(), e2e)) {
+    cerr << "Fail to write '" << cfg.json_file << "'" << endl;
+    return EXIT_FAILURE;
+  }
+
+  return 0;
+}
@@ -0,0 +1,223 @@
+//
+//  synthetic_dump.cpp
+//  avtool
+//
+//  Created by zhanwang-sky on 2023/11/27.
+//
+
+#include <algorithm>
+#include <climits>
+#include <cmath>
+#include <cstdio>
+#include <vector>
+#include "../mod_opus/mod_opus.h"
+#include "../tlv_packet.hpp"
+#include "synthetic_dump.hpp"
+
+using namespace AVTool;
+
+namespace {
+
+constexpr double two_pi = 2 * M_PI;
+
+// RFC 7587
+constexpr int rtp_clock_rate = 48000;
+
+constexpr int max_packet_len = 1500;
+
+}
+
+void SpeechSynth::Biquad::set(double freq, double q, int sample_rate) {
+  double w0 = two_pi * freq / sample_rate;
+  double alpha = std::sin(w0) / (2 * q);
+  double a0 = 1 + alpha;
+
+  b0 = static_cast<float>(alpha / a0);
+  b2 = -b0;
+  a1 = static_cast<float>(-2 * std::cos(w0) / a0);
+  a2 = static_cast<float>((1 - alpha) / a0);
+}
+
+float SpeechSynth::Biquad::process(float x) {
+  float y = b0 * x + b2 * x2 - a1 * y1 - a2 * y2;
+
+  x2 = x1;
+  x1 = x;
+  y2 = y1;
+  y1 = y;
+
+  return y;
+}
+
+SpeechSynth::SpeechSynth(int sample_rate, uint32_t seed)
+    : sample_rate_(sample_rate),
+      rng_(seed),
+      ramp_(sample_rate / 100) {
+  next_segment();
+}
+
+void SpeechSynth::next_segment() {
+  std::uniform_real_distribution<double> u(0, 1);
+  double r = u(rng_);
+  double nyquist = sample_rate_ / 2.0;
+
+  // roughly: mostly syllables, a consonant now and then, pauses between
+  // phrases
+  if (segment_ != Segment::Pause && r < 0.25) {
+    segment_ = Segment::Pause;
+    length_ = static_cast<int>(sample_rate_ * (0.1 + 0.5 * u(rng_)));
+  } else if (r < 0.4) {
+    segment_ = Segment::Unvoiced;
+    length_ = static_cast<int>(sample_rate_ * (0.04 + 0.08 * u(rng_)));
+    fricative_.set(std::min(2500 + 2500 * u(rng_), 0.8 * nyquist), 2.0, sample_rate_);
+    gain_ = static_cast<float>(0.15 + 0.15 * u(rng_));
+  } else {
+    segment_ = Segment::Voiced;
+    length_ = static_cast<int>(sample_rate_ * (0.12 + 0.2 * u(rng_)));
+    f0_ = 100 + 120 * u(rng_);
+    // vowel space, F2 capped for narrowband rates
+    f1_.set(std::min(300 + 500 * u(rng_), 0.4 * nyquist), 5.0, sample_rate_);
+    f2_.set(std::min(900 + 1300 * u(rng_), 0.8 * nyquist), 8.0, sample_rate_);
+    gain_ = static_cast<float>(0.6 + 0.4 * u(rng_));
+  }
+
+  pos_ = 0;
+}
+
+void SpeechSynth::generate(float* out, int nb_samples) {
+  for (int i = 0; i < nb_samples; i++) {
+    float x = 0;
+
+    if (pos_ >= length_) {
+      next_segment();
+    }
+
+    switch (segment_) {
+      case Segment::Pause:
+        // room noise, so it is not digital silence
+        x = 0.001f * noise_(rng_);
+        break;
+      case Segment::Unvoiced:
+        x = gain_ * fricative_.process(noise_(rng_));
+        break;
+      case Segment::Voiced: {
+        // a few percent of vibrato-ish drift at ~4Hz
+        double f0 = f0_ * (1 + 0.04 * std::sin(drift_phase_));
+        drift_phase_ += two_pi * 4 / sample_rate_;
+        phase_ += f0 / sample_rate_;
+        phase_ -= std::floor(phase_);
+        // sawtooth: every harmonic, falling off at 6dB/oct like a glottal source
+        float src = static_cast<float>(1 - 2 * phase_) + 0.02f * noise_(rng_);
+        x = gain_ * (0.8f * f1_.process(src) + 0.4f * f2_.process(src));
+        break;
+      }
+    }
+
+    if (segment_ != Segment::Pause) {
+      int edge = std::min(pos_, length_ - 1 - pos_);
+      if (edge < ramp_) {
+        x *= static_cast<float>(edge) / ramp_;
+      }
+    }
+
+    out[i] = x;
+    pos_++;
+  }
+}
+
+int AVTool::write_synthetic_dump(const std::string& filename, const SyntheticDumpOptions& opts,
+                                 SyntheticDumpInfo* info) {
+  SyntheticDumpInfo stats;
+  av_opus_context_t* opus_ctx = NULL;
+  FILE* fp = NULL;
+  int frame_samples = opts.sample_rate * opts.frame_ms / 1000;
+  uint64_t nb_frames = 0;
+  std::vector<float> mono;
+  std::vector<float> pcm;
+  std::vector<uint8_t> tlv(avTLVPacket::header_len + max_packet_len);
+  std::mt19937 loss_rng(opts.seed ^ 0x5eed);
+  std::uniform_real_distribution<double> u(0, 1);
+  int rc = 0;
+
+  // sanity check
+  if (!av_opus_rate_supported(opts.sample_rate) || opts.channels < 1 || opts.channels > 2
+      || (opts.frame_ms != 10 && opts.frame_ms != 20 && opts.frame_ms != 40 && opts.frame_ms != 60)
+      || opts.secs <= 0 || opts.loss < 0 || opts.loss >= 1) {
+    return INT_MIN;
+  }
+
+  SpeechSynth synth(opts.sample_rate, opts.seed);
+  mono.resize(frame_samples);
+  pcm.resize(static_cast<size_t>(frame_samples) * opts.channels);
+  nb_frames = static_cast<uint64_t>(opts.secs * 1000 / opts.frame_ms);
+
+  opus_ctx = av_opus_init(false, true, opts.sample_rate, opts.channels);
+  if (!opus_ctx) {
+    rc = -1;
+    goto exit;
+  }
+  if (av_opus_set_bitrate(opus_ctx, opts.bit_rate) != OPUS_OK) {
+    rc = -2;
+    goto exit;
+  }
+
+  fp = fopen(filename.c_str(), "wb");
+  if (!fp) {
+    rc = -3;
+    goto exit;
+  }
+
+  for (uint64_t i = 0; i < nb_frames; i++) {
+    int len = 0;
+
+    synth.generate(mono.data(), frame_samples);
+    for (int s = 0; s < frame_samples; s++) {
+      for (int ch = 0; ch < opts.channels; ch++) {
+        // the right channel a little quieter, so stereo is not dual mono
+        pcm[static_cast<size_t>(s) * opts.channels + ch] = ch ? 0.8f * mono[s] : mono[s];
+      }
+    }
+
+    // always encoded, the decoder-side timeline stays continuous
+    len = av_opus_encode_float(opus_ctx, pcm.data(), frame_samples,
+                               tlv.data() + avTLVPacket::header_len, max_packet_len);
+    if (len <= 0) {
+      rc = -4;
+      goto exit;
+    }
+
+    if (i > 0 && u(loss_rng) < opts.loss) {
+      continue;
+    }
+
+    len = avTLVPacket::write_header(tlv.data(), len, i == 0,
+                                    static_cast<uint16_t>(i),
+                                    static_cast<uint32_t>(i * rtp_clock_rate * opts.frame_ms / 1000),
+                                    i * opts.frame_ms);
+    if (len < 0 || fwrite(tlv.data(), 1, len, fp) != static_cast<size_t>(len)) {
+      rc = -5;
+      goto exit;
+    }
+
+    stats.packets++;
+    stats.bytes += len;
+  }
+  stats.samples = nb_frames * frame_samples;
+
+  if (fflush(fp) != 0) {
+    rc = -5;
+    goto exit;
+  }
+
+  if (info) {
+    *info = stats;
+  }
+
+exit:
+  if (fp) {
+    fclose(fp);
+  }
+  av_opus_destroy(opus_ctx);
+
+  return rc;
+}
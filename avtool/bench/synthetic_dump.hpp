@@ -0,0 +1,88 @@
+//
+//  synthetic_dump.hpp
+//  avtool
+//
+//  Created by zhanwang-sky on 2023/11/27.
+//
+
+#ifndef synthetic_dump_hpp
+#define synthetic_dump_hpp
+
+#include <cstdint>
+#include <random>
+#include <string>
+
+namespace AVTool {
+
+// Deterministic speech-like test signal: voiced syllables (a glottal pulse
+// train through two formant resonators, with some pitch drift), unvoiced
+// bursts (shaped noise) and pauses, in random order and lengths. Not
+// intelligible, but it keeps Opus in its SILK / hybrid modes and gives the
+// stretcher transients and silence to deal with, like a real capture.
+class SpeechSynth {
+ public:
+  SpeechSynth(int sample_rate, uint32_t seed = 1);
+
+  // the next |nb_samples| mono samples, peaks stay below 0.5
+  void generate(float* out, int nb_samples);
+
+ private:
+  struct Biquad {
+    float b0 = 0, b2 = 0, a1 = 0, a2 = 0;
+    float x1 = 0, x2 = 0, y1 = 0, y2 = 0;
+
+    // band-pass around |freq|, 0dB peak gain
+    void set(double freq, double q, int sample_rate);
+
+    float process(float x);
+  };
+
+  enum class Segment { Pause, Voiced, Unvoiced };
+
+  void next_segment();
+
+  int sample_rate_;
+  std::mt19937 rng_;
+  std::uniform_real_distribution<float> noise_{-1.0f, 1.0f};
+
+  Segment segment_ = Segment::Pause;
+  int length_ = 0;  // samples in the current segment
+  int pos_ = 0;
+  int ramp_ = 0;    // attack / release, samples
+
+  double f0_ = 0;
+  double phase_ = 0;
+  double drift_phase_ = 0;
+  float gain_ = 0;
+
+  Biquad f1_;
+  Biquad f2_;
+  Biquad fricative_;
+};
+
+struct SyntheticDumpOptions {
+  double secs = 60;
+  int sample_rate = 48000;  // encoder rate, one Opus supports natively
+  int channels = 1;
+  int frame_ms = 20;        // 10, 20, 40 or 60
+  int bit_rate = 24000;
+  double loss = 0;          // fraction of packets left out, seq gaps
+  uint32_t seed = 1;
+};
+
+struct SyntheticDumpInfo {
+  uint64_t packets = 0;
+  uint64_t bytes = 0;    // file size
+  uint64_t samples = 0;  // per channel, at sample_rate
+};
+
+// Opus-encodes SpeechSynth output (av_opus_init() encoder side) into a TLV
+// dump as the capture side writes them: rtp_ts on the 48kHz clock, cap_ts
+// in ms, the marker on the first packet. the same options always give the
+// same file. returns 0 on success, < 0 on error
+int write_synthetic_dump(const std::string& filename, const SyntheticDumpOptions& opts,
+                         SyntheticDumpInfo* info = NULL);
+
+}
+
+#endif /* synthetic_dump_hpp */
@@ -0,0 +1,81 @@
+//
+//  tlvgen.cpp
+//  avtool
+//
+//  Created by zhanwang-sky on 2023/11/27.
+//
+
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <getopt.h>
+
+#include "synthetic_dump.hpp"
+
+using std::cout;
+using std::cerr;
+using std::endl;
+
+static void usage() {
+  cerr << "Usage: ./tlvgen [-d secs] [-r rate] [-c channels] [-p frame_ms] [-b bitrate] [-l loss] [-S seed] out.tlv\n"
+       << "  -d  seconds of synthetic speech (default: 60)\n"
+       << "  -r  encoder rate: 8000, 12000, 16000, 24000 or 48000 (default)\n"
+       << "  -c  1 or 2 channels\n"
+       << "  -p  packet duration: 10, 20 (default), 40 or 60 ms\n"
+       << "  -b  Opus bit rate (default: 24000)\n"
+       << "  -l  fraction of packets to drop, e.g. 0.02\n"
+       << "  -S  seed, same options and seed give the same file\n";
+  exit(EXIT_FAILURE);
+}
+
+int main(int argc, char* argv[]) {
+  AVTool::SyntheticDumpOptions opts;
+  AVTool::SyntheticDumpInfo info;
+  int opt = 0;
+  int rc = 0;
+
+  while ((opt = getopt(argc, argv, "d:r:c:p:b:l:S:")) != -1) {
+    switch (opt) {
+      case 'd':
+        opts.secs = std::stod(optarg);
+        break;
+      case 'r':
+        opts.sample_rate = std::stoi(optarg);
+        break;
+      case 'c':
+        opts.channels = std::stoi(optarg);
+        break;
+      case 'p':
+        opts.frame_ms = std::stoi(optarg);
+        break;
+      case 'b':
+        opts.bit_rate = std::stoi(optarg);
+        break;
+      case 'l':
+        opts.loss = std::stod(optarg);
+        break;
+      case 'S':
+        opts.seed = static_cast<uint32_t>(std::stoul(optarg));
+        break;
+      default:
+        usage();
+    }
+  }
+  argc -= optind;
+  argv += optind;
+
+  if (argc != 1) {
+    usage();
+  }
+
+  rc = AVTool::write_synthetic_dump(argv[0], opts, &info);
+  if (rc < 0) {
+    cerr << "Fail to write '" << argv[0] << "' (" << rc << ")" << endl;
+    return EXIT_FAILURE;
+  }
+
+  cout << info.packets << " packets, " << info.bytes << " bytes, "
+       << info.samples << " samples @" << opts.sample_rate << "Hz" << endl;
+
+  return 0;
+}
@@ -5,155 +5,290 @@
 //  Created by zhanwang-sky on 2023/11/20.
 //
 
+#include <cerrno>
+#include <climits>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
 #include <iostream>
 #include <memory>
 #include <stdexcept>
+#include <string>
+#include <vector>
+#include <getopt.h>
+#include <signal.h>
+#include <unistd.h>
 
-#include <rubberband/RubberBandStretcher.h>
-#include "avtool/audio_helper.hpp"
-#include "avtool/media_dumper.hpp"
-#include "mod_opus/mod_opus.h"
-#include "tlv_reader.hpp"
+#include "avtool/batch_runner.hpp"
+#include "avtool/metrics.hpp"
+#include "avtool/transcoder.hpp"
 
 #define SAMPLE_RATE 16000
 #define NR_CHANNELS 1
-#define SAMPLES_PER_FRAME 320
-#define MAX_SAMPLES_CACHE 16384
 
 using std::cout;
 using std::cerr;
 using std::endl;
 
-using audio_fifo_ptr = std::unique_ptr<AVAudioFifo, decltype(&av_audio_fifo_free)>;
-using opus_ctx_ptr = std::unique_ptr<av_opus_context_t, decltype(&av_opus_destroy)>;
+// -M, empty: no stats dump
+static std::string metrics_format;
+static std::string metrics_path;
 
-uint8_t pkt_buf[512];
+static void usage() {
+  cerr << "Usage: ./avtool [-a] [-f] [-J] [-r] [-t] [-v] [-w depth] [-s secs] [-S bytes] [-m m3u8|txt] [-q preset]\n"
+       << "                [-c encoder ...] [-x stretch] [-P stages] [-M format[:path]]\n"
+       << "                {dump.tlv|-} {dump.wav[,out.webm,...]} [from_cap_ts to_cap_ts]\n"
+       << "       ./avtool [-a] [-J] [-r] [-t] [-v] [-w depth] [-q preset] [-c encoder] [-x stretch] [-P stages]\n"
+       << "                [-M format[:path]]\n"
+       << "                [-j threads] [-p] [-e ext] -b {manifest|'glob'}\n"
+       << "  -a  read ahead asynchronously (io_uring or helper thread)\n"
+       << "  -f, --follow  keep reading a dump that is still being written\n"
+       << "  -J  reorder / dejitter packets by seq and cap_ts (live captures)\n"
+       << "  -r  copy Opus packets into .ogg/.opus/.webm/.mka, no decoding\n"
+       << "  -t  decode, stretch and write on separate threads\n"
+       << "  -x  pitch shift, e.g. pitch=1.2:engine=faster:offline (default: pitch=1.35:engine=finer:realtime)\n"
+       << "      pitch=1 skips the stretcher, offline studies the whole dump first (not for streams)\n"
+       << "  -P  stages after the decoder, e.g. resample,stretch:batch=1024:thread,dump:thread:queue=32\n"
+       << "      (stretch can be left out, resample is only used if Opus cannot decode at the rate)\n"
+       << "  -w  encode and write on a background thread, queue up to depth blocks\n"
+       << "  -s  roll the output into segments of secs seconds (out_00000.wav, ...)\n"
+       << "  -S  roll the output into segments of about bytes bytes\n"
+       << "  -m  write a segment manifest next to the output, HLS playlist or plain list\n"
+       << "  -q  resampler preset: fast, default or hq\n"
+       << "  -v  per packet log lines, at most 50 per second\n"
+       << "  -M  per stage timings as json or prom (Prometheus text), to path (default: stderr)\n"
+       << "      at exit and on SIGUSR1\n"
+       << "  -c  encoder for the next output, e.g. codec=pcm_f32le or codec=libopus:b=24k:level=0,\n"
+       << "      also threads=N, fmt=native|first, mux.<muxer option>=..., <encoder option>=...\n"
+       << "  -b  batch mode, manifest lines are '{dump.tlv} {output}'\n"
+       << "  -j  batch worker threads (default: one per CPU)\n"
+       << "  -p  pin batch workers to CPUs\n"
+       << "  -e  output extension for glob inputs (default: wav)\n";
+  exit(EXIT_FAILURE);
+}
 
-int main(int argc, char* argv[]) {
-  if (argc != 3) {
-    cerr << "Usage: ./avtool {dump.tlv} {dump.wav}\n";
-    exit(EXIT_FAILURE);
+// "a.wav,b.webm" -> {"a.wav", "b.webm"}
+static std::vector<std::string> split_outputs(const std::string& arg) {
+  std::vector<std::string> outputs;
+  size_t begin = 0;
+
+  while (begin <= arg.size()) {
+    size_t end = arg.find(',', begin);
+    if (end == std::string::npos) {
+      end = arg.size();
+    }
+    if (end > begin) {
+      outputs.push_back(arg.substr(begin, end - begin));
+    }
+    begin = end + 1;
   }
 
-  AVChannelLayout ch_layout = (NR_CHANNELS > 1)
-                              ? AVChannelLayout(AV_CHANNEL_LAYOUT_STEREO)
-                              : AVChannelLayout(AV_CHANNEL_LAYOUT_MONO);
+  return outputs;
+}
 
-  AVTool::Resampler resampler(AV_SAMPLE_FMT_S16, ch_layout, SAMPLE_RATE,
-                              AV_SAMPLE_FMT_FLTP, ch_layout, SAMPLE_RATE);
-  if (!resampler) {
-    cerr << "Fail to create resampler\n";
-    exit(EXIT_FAILURE);
-  }
+// whole of |arg| a number in [0, max], anything else ends in usage()
+static long long parse_count(const char* arg, long long max) {
+  char* end = NULL;
+  long long val = 0;
 
-  audio_fifo_ptr audio_fifo(av_audio_fifo_alloc(AV_SAMPLE_FMT_FLTP, NR_CHANNELS, MAX_SAMPLES_CACHE),
-                            &av_audio_fifo_free);
-  if (!audio_fifo) {
-    cerr << "Fail to create audio fifo\n";
-    exit(EXIT_FAILURE);
+  errno = 0;
+  val = strtoll(arg, &end, 10);
+  if (end == arg || *end != '\0' || errno == ERANGE || val < 0 || val > max) {
+    cerr << "Bad number '" << arg << "'\n";
+    usage();
   }
 
-  opus_ctx_ptr opus_ctx(av_opus_init(true, false, SAMPLE_RATE, NR_CHANNELS),
-                        &av_opus_destroy);
-  if (!opus_ctx) {
-    cerr << "Fail to init opus context\n";
-    exit(EXIT_FAILURE);
-  }
+  return val;
+}
 
-  RubberBand::RubberBandStretcher stretcher(SAMPLE_RATE, NR_CHANNELS,
-                                            RubberBand::RubberBandStretcher::OptionProcessRealTime
-                                            | RubberBand::RubberBandStretcher::OptionEngineFiner);
-  stretcher.setPitchScale(1.35);
+static uint64_t parse_u64(const char* arg) {
+  char* end = NULL;
+  unsigned long long val = 0;
 
-  avTLVReader tlv_reader(argv[1]);
-  if (!tlv_reader.is_open()) {
-    cerr << "Fail to open tlv file '" << argv[1] << "'\n";
-    exit(EXIT_FAILURE);
+  errno = 0;
+  // strtoull takes "-1" as ULLONG_MAX
+  val = strtoull(arg, &end, 10);
+  if (end == arg || *end != '\0' || errno == ERANGE || arg[strspn(arg, " \t")] == '-') {
+    cerr << "Bad number '" << arg << "'\n";
+    usage();
   }
 
-  AVTool::SamplesBuffer s16_buf(NR_CHANNELS, MAX_SAMPLES_CACHE, AV_SAMPLE_FMT_S16);
-  if (!s16_buf) {
-    cerr << "Fail to alloc s16 buf\n";
-    exit(EXIT_FAILURE);
+  return val;
+}
+
+static double parse_secs(const char* arg) {
+  char* end = NULL;
+  double val = 0;
+
+  errno = 0;
+  val = strtod(arg, &end);
+  if (end == arg || *end != '\0' || errno == ERANGE || !std::isfinite(val) || val < 0) {
+    cerr << "Bad number '" << arg << "'\n";
+    usage();
   }
 
-  AVTool::SamplesBuffer fltp_buf(NR_CHANNELS, MAX_SAMPLES_CACHE, AV_SAMPLE_FMT_FLTP);
-  if (!fltp_buf) {
-    cerr << "Fail to alloc fltp buf\n";
-    exit(EXIT_FAILURE);
+  return val;
+}
+
+static void dump_metrics() {
+  if (!metrics_format.empty() && !AVTool::Metrics::dump(metrics_format, metrics_path)) {
+    cerr << "Fail to write stats to '" << metrics_path << "'\n";
   }
+}
 
-  AVTool::SamplesBuffer stretched_buf(NR_CHANNELS, MAX_SAMPLES_CACHE, AV_SAMPLE_FMT_FLTP);
-  if (!stretched_buf) {
-    cerr << "Fail to alloc stretched buf\n";
-    exit(EXIT_FAILURE);
+static int run_batch_mode(const std::string& source, const std::string& out_ext,
+                          const AVTool::BatchConfig& cfg) {
+  std::vector<AVTool::BatchJob> jobs;
+
+  if (AVTool::load_batch_jobs(source, out_ext, jobs) < 0) {
+    cerr << "Fail to read manifest '" << source << "'\n";
+    return EXIT_FAILURE;
   }
 
-  try {
-    AVTool::AudioDumper audio_dumper(argv[2], AV_SAMPLE_FMT_FLTP, ch_layout, SAMPLE_RATE);
-
-    uint8_t marker = 0;
-    uint16_t seq = 0;
-    uint32_t rtp_ts = 0;
-    uint64_t cap_ts = 0;
-    int tlv_len = 0;
-    int samples = 0;
-
-    while ((tlv_len = tlv_reader.read(pkt_buf, sizeof(pkt_buf), marker, seq, rtp_ts, cap_ts)) > 0) {
-      cout << "seq=" << seq
-           << (marker ? "#" : "")
-           << ", rtp_ts=" << rtp_ts
-           << ", cap_ts=" << cap_ts
-           << endl;
-
-      samples = av_opus_decode(opus_ctx.get(),
-                               pkt_buf + tlv_reader.header_len,
-                               tlv_len - tlv_reader.header_len,
-                               s16_buf.get()[0], SAMPLES_PER_FRAME);
-      cout << samples << " samples decoded\n";
-      if (samples <= 0) {
-        cout << "decode error(" << samples << ")\n";
-        continue;
-      }
+  AVTool::BatchReport report = AVTool::run_batch(jobs, cfg);
 
-      samples = resampler.resample(audio_fifo.get(), s16_buf.get(), samples);
-      cout << samples << " samples converted\n";
-      if (samples <= 0) {
-        cout << "resample error(" << samples << ")\n";
-        continue;
-      }
+  cout << report.jobs << " jobs (" << report.failed << " failed), "
+       << report.stats.packets << " packets in " << report.wall_secs << "s, "
+       << report.packets_per_sec() << " packets/s, "
+       << "realtime x" << report.realtime_factor(cfg.sample_rate) << endl;
 
-      samples = av_audio_fifo_read(audio_fifo.get(), reinterpret_cast<void**>(fltp_buf.get()), MAX_SAMPLES_CACHE);
-      cout << samples << " samples read\n";
-      if (samples <= 0) {
-        cout << "fifo error(" << samples << ")\n";
-        continue;
-      }
+  dump_metrics();
+
+  return report.failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+int main(int argc, char* argv[]) {
+  AVTool::BatchConfig cfg;
+  std::string batch_source;
+  std::string out_ext = "wav";
+  int opt = 0;
+  static const struct option long_opts[] = {
+    { "follow", no_argument, NULL, 'f' },
+    { NULL, 0, NULL, 0 }
+  };
 
-      stretcher.process(reinterpret_cast<float**>(fltp_buf.get()), samples, false);
+  cfg.sample_rate = SAMPLE_RATE;
+  cfg.channels = NR_CHANNELS;
 
-      samples = stretcher.available();
-      cout << samples << " samples stretched\n";
-      if (samples <= 0) {
-        cout << "not available, skip\n";
-        continue;
+  while ((opt = getopt_long(argc, argv, "afJrtvx:P:w:s:S:m:q:c:M:b:j:pe:", long_opts, NULL)) != -1) {
+    switch (opt) {
+      case 'a':
+        cfg.opts.async_read = true;
+        break;
+      case 'f':
+        cfg.opts.follow = true;
+        break;
+      case 'J':
+        cfg.opts.jitter_buffer = true;
+        break;
+      case 'r':
+        cfg.opts.remux = true;
+        break;
+      case 't':
+        cfg.opts.threaded = true;
+        break;
+      case 'v':
+        cfg.opts.log_level = AVTool::LogLevel::Debug;
+        break;
+      case 'x':
+        if (!AVTool::parse_stretch_options(optarg, cfg.opts.stretch)) {
+          usage();
+        }
+        break;
+      case 'P':
+        cfg.opts.pipeline.clear();
+        if (!AVTool::parse_pipeline(optarg, cfg.opts.pipeline)) {
+          usage();
+        }
+        break;
+      case 'w':
+        cfg.opts.dump_queue = static_cast<int>(parse_count(optarg, INT_MAX));
+        break;
+      case 's':
+        cfg.opts.segment_secs = parse_secs(optarg);
+        break;
+      case 'S':
+        cfg.opts.segment_bytes = parse_count(optarg, INT64_MAX);
+        break;
+      case 'm':
+        cfg.opts.segment_manifest = optarg;
+        break;
+      case 'q':
+        if (!AVTool::parse_resampler_preset(optarg, cfg.resample_preset)) {
+          usage();
+        }
+        break;
+      case 'c':
+        cfg.opts.encoders.emplace_back();
+        if (!AVTool::parse_encoder_options(optarg, cfg.opts.encoders.back())) {
+          usage();
+        }
+        break;
+      case 'M': {
+        std::string arg(optarg);
+        size_t colon = arg.find(':');
+        metrics_format = arg.substr(0, colon);
+        metrics_path = (colon != std::string::npos) ? arg.substr(colon + 1) : "";
+        if (metrics_format != "json" && metrics_format != "prom") {
+          usage();
+        }
+        break;
       }
+      case 'b':
+        batch_source = optarg;
+        break;
+      case 'j':
+        cfg.nr_workers = static_cast<int>(parse_count(optarg, INT_MAX));
+        break;
+      case 'p':
+        cfg.pin_cpus = true;
+        break;
+      case 'e':
+        out_ext = optarg;
+        break;
+      default:
+        usage();
+    }
+  }
+  argc -= optind;
+  argv += optind;
 
-      stretcher.retrieve(reinterpret_cast<float**>(stretched_buf.get()), samples);
+  // before any worker starts, they inherit the blocked signal
+  if (!metrics_format.empty() && !AVTool::Metrics::dump_on_signal(SIGUSR1, metrics_format, metrics_path)) {
+    cerr << "Warning: no stats dump on SIGUSR1\n";
+  }
 
-      audio_dumper.dump(stretched_buf.get(), samples);
-      cout << samples << " samples write\n";
+  if (!batch_source.empty()) {
+    if (argc != 0) {
+      usage();
     }
+    return run_batch_mode(batch_source, out_ext, cfg);
+  }
+
+  if (argc != 2 && argc != 4) {
+    usage();
+  }
 
-    // flush
-    audio_dumper.dump(NULL, 0);
+  if (argc == 4) {
+    cfg.opts.from_cap_ts = parse_u64(argv[2]);
+    cfg.opts.to_cap_ts = parse_u64(argv[3]);
+  }
 
-    cout << "break " << tlv_len << endl;
+  if (cfg.opts.log_level < AVTool::LogLevel::Info) {
+    cfg.opts.log_level = AVTool::LogLevel::Info;
+  }
 
+  try {
+    AVTool::Transcoder transcoder(SAMPLE_RATE, NR_CHANNELS, cfg.resample_preset);
+    transcoder.run(argv[0], split_outputs(argv[1]), cfg.opts);
   } catch (std::exception &e) {
     cerr << "Error: " << e.what() << endl;
+    dump_metrics();
     exit(EXIT_FAILURE);
   }
 
+  dump_metrics();
+
   return 0;
 }
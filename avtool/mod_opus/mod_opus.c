@@ -5,10 +5,24 @@
 //  Created by zhanwang-sky on 2023/11/20.
 //
 
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include "mod_opus.h"
 
+bool av_opus_rate_supported(int sample_rate) {
+  switch (sample_rate) {
+    case 8000:
+    case 12000:
+    case 16000:
+    case 24000:
+    case 48000:
+      return true;
+    default:
+      return false;
+  }
+}
+
 av_opus_context_t* av_opus_init(bool decoding, bool encoding,
                                 int sample_rate, int channels) {
   av_opus_context_t* context = NULL;
@@ -32,6 +46,12 @@ av_opus_context_t* av_opus_init(bool decoding, bool encoding,
     if (!context->decoder || err != OPUS_OK) {
       goto err_exit;
     }
+    if (channels > 1) {
+      context->deinterleave_buf = malloc(sizeof(float) * AV_OPUS_MAX_FRAME_SAMPLES * channels);
+      if (!context->deinterleave_buf) {
+        goto err_exit;
+      }
+    }
   }
 
   if (encoding) {
@@ -49,6 +69,11 @@ err_exit:
 }
 
 void av_opus_destroy(av_opus_context_t* context) {
+  if (context && context->pool) {
+    av_opus_pool_release(context->pool, context);
+    return;
+  }
+
   if (context) {
     if (context->decoder) {
       opus_decoder_destroy(context->decoder);
@@ -58,10 +83,27 @@ void av_opus_destroy(av_opus_context_t* context) {
       opus_encoder_destroy(context->encoder);
       context->encoder = NULL;
     }
+    if (context->deinterleave_buf) {
+      free(context->deinterleave_buf);
+      context->deinterleave_buf = NULL;
+    }
     free(context);
   }
 }
 
+int av_opus_reset(av_opus_context_t* context) {
+  int rc = OPUS_OK;
+
+  if (context->decoder) {
+    rc = opus_decoder_ctl(context->decoder, OPUS_RESET_STATE);
+  }
+  if (rc == OPUS_OK && context->encoder) {
+    rc = opus_encoder_ctl(context->encoder, OPUS_RESET_STATE);
+  }
+
+  return rc;
+}
+
 int av_opus_decode(av_opus_context_t* context,
                    const uint8_t* pkt, int pkt_len,
                    uint8_t* pcm, int samples) {
@@ -71,3 +113,274 @@ int av_opus_decode(av_opus_context_t* context,
 
   return rc;
 }
+
+int av_opus_decode_float(av_opus_context_t* context,
+                         const uint8_t* pkt, int pkt_len,
+                         float* pcm, int samples) {
+  int rc = 0;
+
+  rc = opus_decode_float(context->decoder, pkt, pkt_len, pcm, samples, 0);
+
+  return rc;
+}
+
+static int decode_planar(av_opus_context_t* context,
+                         const uint8_t* pkt, int pkt_len,
+                         float* const* planes, int samples, int decode_fec) {
+  const float* src = NULL;
+  int channels = context->channels;
+  int rc = 0;
+  int i = 0;
+  int ch = 0;
+
+  if (channels == 1) {
+    // mono is planar already
+    return opus_decode_float(context->decoder, pkt, pkt_len, planes[0], samples, decode_fec);
+  }
+
+  if (samples > AV_OPUS_MAX_FRAME_SAMPLES) {
+    samples = AV_OPUS_MAX_FRAME_SAMPLES;
+  }
+
+  rc = opus_decode_float(context->decoder, pkt, pkt_len, context->deinterleave_buf, samples, decode_fec);
+  if (rc <= 0) {
+    return rc;
+  }
+
+  src = context->deinterleave_buf;
+  for (i = 0; i < rc; i++) {
+    for (ch = 0; ch < channels; ch++) {
+      planes[ch][i] = *src++;
+    }
+  }
+
+  return rc;
+}
+
+int av_opus_decode_planar(av_opus_context_t* context,
+                          const uint8_t* pkt, int pkt_len,
+                          float* const* planes, int samples) {
+  return decode_planar(context, pkt, pkt_len, planes, samples, 0);
+}
+
+int av_opus_conceal_planar(av_opus_context_t* context,
+                           const uint8_t* next_pkt, int next_len,
+                           float* const* planes, int samples) {
+  if (!next_pkt || next_len <= 0) {
+    return decode_planar(context, NULL, 0, planes, samples, 0);
+  }
+
+  return decode_planar(context, next_pkt, next_len, planes, samples, 1);
+}
+
+static int decode_batch(av_opus_context_t* context,
+                        const uint8_t* const* pkts, const int* pkt_lens, int nb_pkts,
+                        void* pcm, bool is_float, int samples, int* pkt_samples) {
+  int channels = context->channels;
+  int total = 0;
+  int rc = 0;
+  int i = 0;
+
+  for (i = 0; i < nb_pkts; i++) {
+    int room = samples - total;
+    int need = opus_packet_get_nb_samples(pkts[i], pkt_lens[i], context->sample_rate);
+
+    if (need > room) {
+      rc = OPUS_BUFFER_TOO_SMALL;
+    } else if (need < 0) {
+      rc = need;
+    } else if (is_float) {
+      rc = opus_decode_float(context->decoder, pkts[i], pkt_lens[i],
+                             (float*) pcm + (size_t) total * channels, room, 0);
+    } else {
+      rc = opus_decode(context->decoder, pkts[i], pkt_lens[i],
+                       (opus_int16*) pcm + (size_t) total * channels, room, 0);
+    }
+
+    if (rc > 0) {
+      total += rc;
+    }
+    if (pkt_samples) {
+      pkt_samples[i] = rc;
+    }
+  }
+
+  return total;
+}
+
+int av_opus_decode_batch(av_opus_context_t* context,
+                         const uint8_t* const* pkts, const int* pkt_lens, int nb_pkts,
+                         uint8_t* pcm, int samples, int* pkt_samples) {
+  return decode_batch(context, pkts, pkt_lens, nb_pkts, pcm, false, samples, pkt_samples);
+}
+
+int av_opus_decode_batch_float(av_opus_context_t* context,
+                               const uint8_t* const* pkts, const int* pkt_lens, int nb_pkts,
+                               float* pcm, int samples, int* pkt_samples) {
+  return decode_batch(context, pkts, pkt_lens, nb_pkts, pcm, true, samples, pkt_samples);
+}
+
+int av_opus_encode(av_opus_context_t* context,
+                   const uint8_t* pcm, int samples,
+                   uint8_t* pkt, int max_pkt_len) {
+  if (!context->encoder) {
+    return OPUS_INVALID_STATE;
+  }
+
+  return opus_encode(context->encoder, (const opus_int16*) pcm, samples, pkt, max_pkt_len);
+}
+
+int av_opus_encode_float(av_opus_context_t* context,
+                         const float* pcm, int samples,
+                         uint8_t* pkt, int max_pkt_len) {
+  if (!context->encoder) {
+    return OPUS_INVALID_STATE;
+  }
+
+  return opus_encode_float(context->encoder, pcm, samples, pkt, max_pkt_len);
+}
+
+int av_opus_set_bitrate(av_opus_context_t* context, int bit_rate) {
+  if (!context->encoder) {
+    return OPUS_INVALID_STATE;
+  }
+
+  return opus_encoder_ctl(context->encoder, OPUS_SET_BITRATE(bit_rate));
+}
+
+av_opus_pool_t* av_opus_pool_create(int size, int sample_rate, int channels) {
+  av_opus_pool_t* pool = NULL;
+  void* states = NULL;
+  int state_size = 0;
+  int i = 0;
+
+  // sanity check
+  if (size <= 0 || !av_opus_rate_supported(sample_rate) || channels < 1 || channels > 2) {
+    return NULL;
+  }
+
+  if (!(pool = malloc(sizeof(av_opus_pool_t)))) {
+    return NULL;
+  }
+
+  memset(pool, 0, sizeof(av_opus_pool_t));
+  pool->sample_rate = sample_rate;
+  pool->channels = channels;
+  pool->size = size;
+
+  if (pthread_mutex_init(&pool->lock, NULL) != 0) {
+    free(pool);
+    return NULL;
+  }
+
+  state_size = opus_decoder_get_size(channels);
+  if (state_size <= 0) {
+    goto err_exit;
+  }
+  pool->state_size = ((size_t) state_size + 63) & ~(size_t) 63;
+
+  if (posix_memalign(&states, 64, pool->state_size * size) != 0) {
+    goto err_exit;
+  }
+  pool->states = states;
+
+  if (channels > 1) {
+    pool->deinterleave_bufs = malloc(sizeof(float) * AV_OPUS_MAX_FRAME_SAMPLES * channels * size);
+    if (!pool->deinterleave_bufs) {
+      goto err_exit;
+    }
+  }
+
+  pool->contexts = calloc(size, sizeof(av_opus_context_t));
+  pool->in_use = calloc(size, sizeof(bool));
+  pool->free_list = malloc(sizeof(int) * size);
+  if (!pool->contexts || !pool->in_use || !pool->free_list) {
+    goto err_exit;
+  }
+
+  for (i = 0; i < size; i++) {
+    av_opus_context_t* context = &pool->contexts[i];
+    context->sample_rate = sample_rate;
+    context->channels = channels;
+    context->decoder = (OpusDecoder*) (pool->states + pool->state_size * i);
+    if (opus_decoder_init(context->decoder, sample_rate, channels) != OPUS_OK) {
+      goto err_exit;
+    }
+    if (pool->deinterleave_bufs) {
+      context->deinterleave_buf = pool->deinterleave_bufs + (size_t) AV_OPUS_MAX_FRAME_SAMPLES * channels * i;
+    }
+    context->pool = pool;
+    // hand out low indexes first
+    pool->free_list[size - 1 - i] = i;
+  }
+  pool->nr_free = size;
+
+  return pool;
+
+err_exit:
+  av_opus_pool_destroy(pool);
+  return NULL;
+}
+
+void av_opus_pool_destroy(av_opus_pool_t* pool) {
+  if (pool) {
+    // decoder states are plain memory, nothing to destroy one by one
+    free(pool->states);
+    free(pool->deinterleave_bufs);
+    free(pool->contexts);
+    free(pool->in_use);
+    free(pool->free_list);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool);
+  }
+}
+
+av_opus_context_t* av_opus_pool_acquire(av_opus_pool_t* pool) {
+  av_opus_context_t* context = NULL;
+
+  pthread_mutex_lock(&pool->lock);
+  if (pool->nr_free > 0) {
+    int index = pool->free_list[--pool->nr_free];
+    pool->in_use[index] = true;
+    context = &pool->contexts[index];
+  }
+  pthread_mutex_unlock(&pool->lock);
+
+  if (context) {
+    opus_decoder_ctl(context->decoder, OPUS_RESET_STATE);
+  }
+
+  return context;
+}
+
+int av_opus_pool_release(av_opus_pool_t* pool, av_opus_context_t* context) {
+  uintptr_t offset = 0;
+  int index = 0;
+  int rc = 0;
+
+  // sanity check
+  if (!pool || !context) {
+    return -1;
+  }
+
+  // one of ours, and on a context boundary
+  offset = (uintptr_t) context - (uintptr_t) pool->contexts;
+  if ((uintptr_t) context < (uintptr_t) pool->contexts
+      || offset % sizeof(av_opus_context_t) != 0
+      || offset / sizeof(av_opus_context_t) >= (uintptr_t) pool->size) {
+    return -1;
+  }
+  index = (int) (offset / sizeof(av_opus_context_t));
+
+  pthread_mutex_lock(&pool->lock);
+  if (!pool->in_use[index] || pool->nr_free >= pool->size) {
+    // released twice
+    rc = -2;
+  } else {
+    pool->in_use[index] = false;
+    pool->free_list[pool->nr_free++] = index;
+  }
+  pthread_mutex_unlock(&pool->lock);
+
+  return rc;
+}
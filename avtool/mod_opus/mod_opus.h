@@ -9,28 +9,112 @@
 #define mod_opus_h
 
 #include <stdbool.h>
+#include <pthread.h>
 #include <opus/opus.h>
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+#define AV_OPUS_MAX_FRAME_SAMPLES 5760  // 120ms @ 48kHz
+
 typedef struct {
   int sample_rate;
   int channels;
   OpusDecoder* decoder;
   OpusEncoder* encoder;
+  float* deinterleave_buf;  // AV_OPUS_MAX_FRAME_SAMPLES * channels
+  void* pool;               // owning av_opus_pool_t, NULL if malloc'ed
 } av_opus_context_t;
 
+// Pre-allocated decoder contexts for many concurrent streams. All decoder
+// states live in one contiguous allocation sized with opus_decoder_get_size,
+// and are recycled with OPUS_RESET_STATE instead of destroy/create.
+typedef struct {
+  int sample_rate;
+  int channels;
+  int size;
+  size_t state_size;           // per decoder, rounded up to a cache line
+  uint8_t* states;             // size * state_size
+  float* deinterleave_bufs;    // size * AV_OPUS_MAX_FRAME_SAMPLES * channels
+  av_opus_context_t* contexts;
+  bool* in_use;                // per context, catches double releases
+  int* free_list;
+  int nr_free;
+  pthread_mutex_t lock;
+} av_opus_pool_t;
+
+// rates opus can decode to natively: 8/12/16/24/48 kHz
+bool av_opus_rate_supported(int sample_rate);
+
 av_opus_context_t* av_opus_init(bool decoding, bool encoding,
                                 int sample_rate, int channels);
 
+// returns pooled contexts to their pool
 void av_opus_destroy(av_opus_context_t* context);
 
+int av_opus_reset(av_opus_context_t* context);
+
 int av_opus_decode(av_opus_context_t* context,
                    const uint8_t* pkt, int pkt_len,
                    uint8_t* pcm, int samples);
 
+// interleaved float output
+int av_opus_decode_float(av_opus_context_t* context,
+                         const uint8_t* pkt, int pkt_len,
+                         float* pcm, int samples);
+
+// planar float output, one pointer per channel
+int av_opus_decode_planar(av_opus_context_t* context,
+                          const uint8_t* pkt, int pkt_len,
+                          float* const* planes, int samples);
+
+// Conceal |samples| lost samples per channel right before |next_pkt|: the
+// decoder recovers them from the in-band FEC data of |next_pkt| when it has
+// some and falls back to PLC otherwise. |next_pkt| may be NULL (PLC only).
+// |samples| must be a multiple of 2.5ms. returns samples written
+int av_opus_conceal_planar(av_opus_context_t* context,
+                           const uint8_t* next_pkt, int next_len,
+                           float* const* planes, int samples);
+
+// Decode |nb_pkts| packets back to back into one interleaved buffer that
+// holds |samples| samples per channel. |pkt_samples| (optional) receives the
+// per-packet result, packets that no longer fit get OPUS_BUFFER_TOO_SMALL.
+// returns the total samples per channel written
+int av_opus_decode_batch(av_opus_context_t* context,
+                         const uint8_t* const* pkts, const int* pkt_lens, int nb_pkts,
+                         uint8_t* pcm, int samples, int* pkt_samples);
+
+int av_opus_decode_batch_float(av_opus_context_t* context,
+                               const uint8_t* const* pkts, const int* pkt_lens, int nb_pkts,
+                               float* pcm, int samples, int* pkt_samples);
+
+// encoder side, needs av_opus_init(..., encoding=true, ...). |samples| per
+// channel must be a valid Opus frame size (2.5 to 60ms). returns the packet
+// length, < 0 on error
+int av_opus_encode(av_opus_context_t* context,
+                   const uint8_t* pcm, int samples,
+                   uint8_t* pkt, int max_pkt_len);
+
+// interleaved float input
+int av_opus_encode_float(av_opus_context_t* context,
+                         const float* pcm, int samples,
+                         uint8_t* pkt, int max_pkt_len);
+
+// bits/s, OPUS_AUTO for the encoder's choice
+int av_opus_set_bitrate(av_opus_context_t* context, int bit_rate);
+
+av_opus_pool_t* av_opus_pool_create(int size, int sample_rate, int channels);
+
+void av_opus_pool_destroy(av_opus_pool_t* pool);
+
+// returns a freshly reset decoder context, NULL if the pool is exhausted
+av_opus_context_t* av_opus_pool_acquire(av_opus_pool_t* pool);
+
+// returns < 0 and leaves the pool alone if |context| is not one of its
+// contexts or is already back in it
+int av_opus_pool_release(av_opus_pool_t* pool, av_opus_context_t* context);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,379 @@
+//
+//  tlv_async_reader.cpp
+//  avtool
+//
+//  Created by zhanwang-sky on 2023/11/20.
+//
+
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <fcntl.h>
+#include <unistd.h>
+
+#if defined(__linux__) && defined(AVTOOL_HAVE_LIBURING)
+#include <liburing.h>
+#endif
+
+#include "tlv_async_reader.hpp"
+
+namespace {
+
+ssize_t pread_full(int fd, uint8_t* buf, size_t len, uint64_t pos) {
+  size_t done = 0;
+
+  while (done < len) {
+    ssize_t n = pread(fd, buf + done, len - done, static_cast<off_t>(pos + done));
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+    if (n == 0) {
+      break;
+    }
+    done += n;
+  }
+
+  return static_cast<ssize_t>(done);
+}
+
+}
+
+struct avTLVAsyncReader::Backend {
+  virtual ~Backend() = default;
+
+  // start reading |len| bytes at |pos| into |buf| for |slot|
+  virtual bool submit(int slot, uint8_t* buf, int len, uint64_t pos) = 0;
+
+  // block until |slot| completes, returns bytes read (short on EOF), < 0 on error
+  virtual ssize_t wait(int slot) = 0;
+
+  virtual bool is_uring() const { return false; }
+};
+
+namespace {
+
+// fallback: one helper thread serving requests in submission order
+class ThreadBackend : public avTLVAsyncReader::Backend {
+ public:
+  ThreadBackend(int fd, int queue_depth)
+      : fd_(fd), results_(queue_depth, 0), done_(queue_depth, true),
+        worker_(&ThreadBackend::run, this) { }
+
+  ~ThreadBackend() override {
+    {
+      std::lock_guard<std::mutex> lk(mtx_);
+      stop_ = true;
+    }
+    req_cv_.notify_one();
+    worker_.join();
+  }
+
+  bool submit(int slot, uint8_t* buf, int len, uint64_t pos) override {
+    {
+      std::lock_guard<std::mutex> lk(mtx_);
+      done_[slot] = false;
+      reqs_.push_back({slot, buf, len, pos});
+    }
+    req_cv_.notify_one();
+    return true;
+  }
+
+  ssize_t wait(int slot) override {
+    std::unique_lock<std::mutex> lk(mtx_);
+    done_cv_.wait(lk, [&] { return static_cast<bool>(done_[slot]); });
+    return results_[slot];
+  }
+
+ private:
+  struct Request {
+    int slot;
+    uint8_t* buf;
+    int len;
+    uint64_t pos;
+  };
+
+  void run() {
+    std::unique_lock<std::mutex> lk(mtx_);
+    while (true) {
+      req_cv_.wait(lk, [&] { return stop_ || !reqs_.empty(); });
+      if (stop_) {
+        break;
+      }
+      Request req = reqs_.front();
+      reqs_.pop_front();
+
+      lk.unlock();
+      ssize_t n = pread_full(fd_, req.buf, req.len, req.pos);
+      lk.lock();
+
+      results_[req.slot] = n;
+      done_[req.slot] = true;
+      done_cv_.notify_all();
+    }
+  }
+
+  int fd_;
+  std::mutex mtx_;
+  std::condition_variable req_cv_;
+  std::condition_variable done_cv_;
+  std::deque<Request> reqs_;
+  std::vector<ssize_t> results_;
+  std::vector<char> done_;
+  bool stop_ = false;
+  std::thread worker_;
+};
+
+#if defined(__linux__) && defined(AVTOOL_HAVE_LIBURING)
+class UringBackend : public avTLVAsyncReader::Backend {
+ public:
+  UringBackend(int fd, int queue_depth)
+      : fd_(fd), reqs_(queue_depth), results_(queue_depth, 0), done_(queue_depth, true) {
+    ok_ = (io_uring_queue_init(queue_depth, &ring_, 0) == 0);
+  }
+
+  ~UringBackend() override {
+    if (ok_) {
+      // in-flight reads still target our buffers, reap them first
+      for (size_t slot = 0; slot < done_.size(); slot++) {
+        reap(static_cast<int>(slot));
+      }
+      io_uring_queue_exit(&ring_);
+    }
+  }
+
+  bool ok() const {
+    return ok_;
+  }
+
+  bool submit(int slot, uint8_t* buf, int len, uint64_t pos) override {
+    struct io_uring_sqe* sqe = io_uring_get_sqe(&ring_);
+    if (!sqe) {
+      return false;
+    }
+    io_uring_prep_read(sqe, fd_, buf, len, pos);
+    io_uring_sqe_set_data(sqe, reinterpret_cast<void*>(static_cast<intptr_t>(slot)));
+    reqs_[slot] = {buf, len, pos};
+    done_[slot] = false;
+    return io_uring_submit(&ring_) >= 0;
+  }
+
+  ssize_t wait(int slot) override {
+    if (!reap(slot)) {
+      return -1;
+    }
+
+    ssize_t n = results_[slot];
+    const Request& req = reqs_[slot];
+    if (n > 0 && n < req.len) {
+      // short read before EOF, finish synchronously
+      ssize_t rest = pread_full(fd_, req.buf + n, req.len - n, req.pos + n);
+      n = (rest < 0) ? rest : n + rest;
+    }
+
+    return n;
+  }
+
+  bool is_uring() const override { return true; }
+
+ private:
+  struct Request {
+    uint8_t* buf = NULL;
+    int len = 0;
+    uint64_t pos = 0;
+  };
+
+  bool reap(int slot) {
+    while (!done_[slot]) {
+      struct io_uring_cqe* cqe = NULL;
+      int rc = io_uring_wait_cqe(&ring_, &cqe);
+      if (rc == -EINTR) {
+        continue;
+      }
+      if (rc < 0) {
+        return false;
+      }
+      int s = static_cast<int>(reinterpret_cast<intptr_t>(io_uring_cqe_get_data(cqe)));
+      results_[s] = cqe->res;
+      done_[s] = true;
+      io_uring_cqe_seen(&ring_, cqe);
+    }
+    return true;
+  }
+
+  int fd_;
+  struct io_uring ring_;
+  bool ok_ = false;
+  std::vector<Request> reqs_;
+  std::vector<ssize_t> results_;
+  std::vector<char> done_;
+};
+#endif
+
+}
+
+avTLVAsyncReader::avTLVAsyncReader(const std::string& filename,
+                                   uint64_t start_pos,
+                                   int block_size,
+                                   int queue_depth) noexcept
+    : fd_(open(filename.c_str(), O_RDONLY)),
+      block_size_(std::max(block_size, avTLVPacket::header_len)),
+      queue_depth_(std::max(queue_depth, 1)),
+      next_submit_pos_(start_pos) {
+  if (fd_ < 0) {
+    return;
+  }
+
+  try {
+    blocks_.resize(static_cast<size_t>(block_size_) * queue_depth_);
+    carry_.reserve(UINT16_MAX);
+
+#if defined(__linux__) && defined(AVTOOL_HAVE_LIBURING)
+    {
+      std::unique_ptr<UringBackend> uring(new UringBackend(fd_, queue_depth_));
+      if (uring->ok()) {
+        backend_ = std::move(uring);
+      }
+    }
+#endif
+    if (!backend_) {
+      backend_.reset(new ThreadBackend(fd_, queue_depth_));
+    }
+  } catch (...) {
+    backend_.reset();
+    return;
+  }
+
+  // fill the queue
+  for (int slot = 0; slot < queue_depth_; slot++) {
+    if (!backend_->submit(slot, &blocks_[static_cast<size_t>(slot) * block_size_],
+                          block_size_, next_submit_pos_)) {
+      backend_.reset();
+      return;
+    }
+    next_submit_pos_ += block_size_;
+  }
+}
+
+avTLVAsyncReader::~avTLVAsyncReader() {
+  // stop in-flight I/O before the buffers go away
+  backend_.reset();
+  if (fd_ >= 0) {
+    close(fd_);
+    fd_ = -1;
+  }
+}
+
+bool avTLVAsyncReader::is_open() const {
+  return fd_ >= 0 && backend_;
+}
+
+bool avTLVAsyncReader::uses_io_uring() const {
+  return backend_ && backend_->is_uring();
+}
+
+int avTLVAsyncReader::next(avTLVPacket& pkt) {
+  const uint8_t* p = NULL;
+  int avail = 0;
+  int rc = 0;
+
+  if (!is_open()) {
+    // not opened
+    return INT_MIN + 1;
+  }
+
+  if (cur_slot_ < 0 || cur_off_ == cur_len_) {
+    if (!advance_block()) {
+      return read_error_ ? INT_MIN + 2 : 0;
+    }
+  }
+
+  p = &blocks_[static_cast<size_t>(cur_slot_) * block_size_ + cur_off_];
+  avail = cur_len_ - cur_off_;
+
+  rc = avTLVPacket::parse(p, avail, pkt);
+  if (rc > 0) {
+    cur_off_ += rc;
+    return rc;
+  }
+
+  if (avail >= 2 && (p[0] | (p[1] << 8)) < avTLVPacket::header_len) {
+    // malformed TLV header
+    return -1;
+  }
+
+  if (cur_len_ < block_size_) {
+    // truncated in the last block
+    return rc;
+  }
+
+  // packet spans block boundaries, reassemble it
+  carry_.assign(p, p + avail);
+  cur_off_ = cur_len_;
+
+  while (true) {
+    size_t need = (carry_.size() < 2) ? avTLVPacket::header_len
+                                      : static_cast<size_t>(carry_[0] | (carry_[1] << 8));
+    if (need < static_cast<size_t>(avTLVPacket::header_len)) {
+      // malformed TLV header
+      return -1;
+    }
+    if (carry_.size() >= need) {
+      break;
+    }
+    if (cur_off_ == cur_len_ && !advance_block()) {
+      if (read_error_) {
+        return INT_MIN + 2;
+      }
+      break;
+    }
+    int take = static_cast<int>(std::min(need - carry_.size(),
+                                         static_cast<size_t>(cur_len_ - cur_off_)));
+    const uint8_t* b = &blocks_[static_cast<size_t>(cur_slot_) * block_size_ + cur_off_];
+    carry_.insert(carry_.end(), b, b + take);
+    cur_off_ += take;
+  }
+
+  return avTLVPacket::parse(carry_.data(), carry_.size(), pkt);
+}
+
+bool avTLVAsyncReader::advance_block() {
+  ssize_t n = 0;
+
+  if (eof_) {
+    return false;
+  }
+
+  if (cur_slot_ >= 0) {
+    // recycle the consumed block for the next read-ahead
+    if (!backend_->submit(cur_slot_, &blocks_[static_cast<size_t>(cur_slot_) * block_size_],
+                          block_size_, next_submit_pos_)) {
+      read_error_ = true;
+      eof_ = true;
+      return false;
+    }
+    next_submit_pos_ += block_size_;
+  }
+
+  cur_slot_ = (cur_slot_ + 1) % queue_depth_;
+
+  n = backend_->wait(cur_slot_);
+  if (n <= 0) {
+    read_error_ = (n < 0);
+    eof_ = true;
+    cur_len_ = 0;
+    cur_off_ = 0;
+    return false;
+  }
+
+  cur_len_ = static_cast<int>(n);
+  cur_off_ = 0;
+
+  return true;
+}
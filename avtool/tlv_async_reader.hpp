@@ -0,0 +1,67 @@
+//
+//  tlv_async_reader.hpp
+//  avtool
+//
+//  Created by zhanwang-sky on 2023/11/20.
+//
+
+#ifndef tlv_async_reader_hpp
+#define tlv_async_reader_hpp
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "tlv_packet.hpp"
+
+// Read-ahead TLV reader for slow / cold storage. Keeps |queue_depth| block
+// reads of |block_size| bytes in flight (io_uring when built with
+// AVTOOL_HAVE_LIBURING on Linux, a helper thread doing pread otherwise)
+// and parses packets out of completed blocks.
+class avTLVAsyncReader {
+ public:
+  static constexpr int default_block_size = 1 << 20;
+  static constexpr int default_queue_depth = 4;
+
+  avTLVAsyncReader(const avTLVAsyncReader&) = delete;
+  avTLVAsyncReader& operator=(const avTLVAsyncReader&) = delete;
+
+  avTLVAsyncReader(const std::string& filename,
+                   uint64_t start_pos = 0,
+                   int block_size = default_block_size,
+                   int queue_depth = default_queue_depth) noexcept;
+
+  virtual ~avTLVAsyncReader();
+
+  bool is_open() const;
+
+  bool uses_io_uring() const;
+
+  // same return codes as avTLVReader::next(),
+  // |pkt| stays valid until the next call
+  int next(avTLVPacket& pkt);
+
+  struct Backend;
+
+ private:
+  bool advance_block();
+
+  int fd_ = -1;
+  int block_size_ = 0;
+  int queue_depth_ = 0;
+  std::unique_ptr<Backend> backend_;
+
+  // one buffer per in-flight read, consumed round-robin
+  std::vector<uint8_t> blocks_;
+  int cur_slot_ = -1;
+  int cur_len_ = 0;
+  int cur_off_ = 0;
+  uint64_t next_submit_pos_ = 0;
+  bool eof_ = false;
+  bool read_error_ = false;
+
+  // reassembly buffer for packets spanning block boundaries
+  std::vector<uint8_t> carry_;
+};
+
+#endif /* tlv_async_reader_hpp */
@@ -0,0 +1,226 @@
+//
+//  tlv_index.hpp
+//  avtool
+//
+//  Created by zhanwang-sky on 2023/11/20.
+//
+
+#ifndef tlv_index_hpp
+#define tlv_index_hpp
+
+#include <algorithm>
+#include <climits>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "tlv_packet.hpp"
+
+// Sparse index of a TLV dump, one entry every |interval| packets.
+// seq and rtp_ts are unwrapped (monotonic 64-bit) starting from the raw
+// values of the first packet, so they stay searchable across wraps.
+//
+// Sidecar file layout (little endian, usually "<dump>.idx"):
+//   "AVTI" | u32 version | u32 interval | u32 count | u64 dump_size |
+//   count * { u64 seq | u64 rtp_ts | u64 cap_ts | u64 offset }
+class avTLVIndex {
+ public:
+  static constexpr uint32_t version = 1;
+  static constexpr int default_interval = 256;
+
+  struct Entry {
+    uint64_t seq = 0;
+    uint64_t rtp_ts = 0;
+    uint64_t cap_ts = 0;
+    uint64_t offset = 0;
+  };
+
+  // keeps seq / rtp_ts unwrapped while walking packets in file order
+  struct Unwrapper {
+    uint64_t seq = 0;
+    uint64_t rtp_ts = 0;
+    bool started = false;
+
+    void update(const avTLVPacket& pkt) {
+      if (!started) {
+        seq = pkt.seq;
+        rtp_ts = pkt.rtp_ts;
+        started = true;
+      } else {
+        seq += static_cast<int16_t>(pkt.seq - static_cast<uint16_t>(seq));
+        rtp_ts += static_cast<int32_t>(pkt.rtp_ts - static_cast<uint32_t>(rtp_ts));
+      }
+    }
+  };
+
+  avTLVIndex() = default;
+
+  bool empty() const {
+    return entries_.empty();
+  }
+
+  int interval() const {
+    return interval_;
+  }
+
+  uint64_t dump_size() const {
+    return dump_size_;
+  }
+
+  const std::vector<Entry>& entries() const {
+    return entries_;
+  }
+
+  // returns number of entries, < 0 on malformed dump
+  int build(const uint8_t* data, uint64_t size, int interval = default_interval) {
+    Unwrapper uw;
+    avTLVPacket pkt;
+    uint64_t pos = 0;
+    uint64_t nr_pkts = 0;
+    int rc = 0;
+
+    if (interval <= 0) {
+      return INT_MIN;
+    }
+
+    entries_.clear();
+    interval_ = interval;
+    dump_size_ = size;
+
+    while ((rc = avTLVPacket::parse(data + pos, size - pos, pkt)) > 0) {
+      uw.update(pkt);
+      if (nr_pkts++ % interval == 0) {
+        entries_.push_back({uw.seq, uw.rtp_ts, pkt.cap_ts, pos});
+      }
+      pos += rc;
+    }
+
+    if (rc < 0) {
+      return -1;
+    }
+
+    return static_cast<int>(entries_.size());
+  }
+
+  // last entry whose key is <= |key|, NULL if |key| precedes the dump
+  const Entry* floor_by_seq(uint64_t seq) const {
+    return floor(seq, &Entry::seq);
+  }
+
+  const Entry* floor_by_rtp_ts(uint64_t rtp_ts) const {
+    return floor(rtp_ts, &Entry::rtp_ts);
+  }
+
+  const Entry* floor_by_cap_ts(uint64_t cap_ts) const {
+    return floor(cap_ts, &Entry::cap_ts);
+  }
+
+  bool save(const std::string& filename) const {
+    std::vector<uint8_t> buf;
+    bool ok = false;
+    int fd = -1;
+
+    buf.reserve(24 + entries_.size() * 32);
+    buf.insert(buf.end(), {'A', 'V', 'T', 'I'});
+    put_le(buf, version, 4);
+    put_le(buf, static_cast<uint32_t>(interval_), 4);
+    put_le(buf, static_cast<uint32_t>(entries_.size()), 4);
+    put_le(buf, dump_size_, 8);
+    for (const Entry& e : entries_) {
+      put_le(buf, e.seq, 8);
+      put_le(buf, e.rtp_ts, 8);
+      put_le(buf, e.cap_ts, 8);
+      put_le(buf, e.offset, 8);
+    }
+
+    fd = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+      return false;
+    }
+    ok = (write(fd, buf.data(), buf.size()) == static_cast<ssize_t>(buf.size()));
+    close(fd);
+
+    return ok;
+  }
+
+  // |dump_size| guards against a stale sidecar, pass 0 to skip the check
+  bool load(const std::string& filename, uint64_t dump_size = 0) {
+    std::vector<uint8_t> buf;
+    struct stat st;
+    uint32_t count = 0;
+    int fd = -1;
+    bool ok = false;
+
+    fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0) {
+      return false;
+    }
+    if (fstat(fd, &st) == 0 && st.st_size >= 24) {
+      buf.resize(st.st_size);
+      ok = (pread(fd, buf.data(), buf.size(), 0) == static_cast<ssize_t>(buf.size()));
+    }
+    close(fd);
+
+    if (!ok
+        || memcmp(buf.data(), "AVTI", 4) != 0
+        || get_le(&buf[4], 4) != version) {
+      return false;
+    }
+
+    count = static_cast<uint32_t>(get_le(&buf[12], 4));
+    if (buf.size() != 24 + static_cast<uint64_t>(count) * 32) {
+      return false;
+    }
+    if (dump_size && get_le(&buf[16], 8) != dump_size) {
+      return false;
+    }
+
+    interval_ = static_cast<int>(get_le(&buf[8], 4));
+    dump_size_ = get_le(&buf[16], 8);
+    entries_.resize(count);
+    for (uint32_t i = 0; i < count; i++) {
+      const uint8_t* p = &buf[24 + i * 32];
+      entries_[i].seq = get_le(p, 8);
+      entries_[i].rtp_ts = get_le(p + 8, 8);
+      entries_[i].cap_ts = get_le(p + 16, 8);
+      entries_[i].offset = get_le(p + 24, 8);
+    }
+
+    return true;
+  }
+
+  static std::string sidecar_name(const std::string& dump_filename) {
+    return dump_filename + ".idx";
+  }
+
+ private:
+  const Entry* floor(uint64_t key, uint64_t Entry::* field) const {
+    auto it = std::upper_bound(entries_.begin(), entries_.end(), key,
+                               [field](uint64_t k, const Entry& e) { return k < e.*field; });
+    return (it == entries_.begin()) ? NULL : &*(it - 1);
+  }
+
+  static void put_le(std::vector<uint8_t>& buf, uint64_t val, int nbytes) {
+    for (int i = 0; i < nbytes; i++) {
+      buf.push_back(static_cast<uint8_t>(val >> (i * 8)));
+    }
+  }
+
+  static uint64_t get_le(const uint8_t* p, int nbytes) {
+    uint64_t val = 0;
+    for (int i = nbytes - 1; i >= 0; i--) {
+      val = (val << 8) | p[i];
+    }
+    return val;
+  }
+
+  int interval_ = default_interval;
+  uint64_t dump_size_ = 0;
+  std::vector<Entry> entries_;
+};
+
+#endif /* tlv_index_hpp */
@@ -0,0 +1,225 @@
+//
+//  tlv_jitter_buffer.cpp
+//  avtool
+//
+//  Created by zhanwang-sky on 2023/11/20.
+//
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+#include "tlv_jitter_buffer.hpp"
+
+avTLVJitterBuffer::avTLVJitterBuffer()
+    : avTLVJitterBuffer(Config()) { }
+
+avTLVJitterBuffer::avTLVJitterBuffer(const Config& cfg)
+    : cfg_(cfg) {
+  uint32_t capacity = 1;
+
+  while (capacity < static_cast<uint32_t>(std::max(cfg_.capacity, 1))) {
+    capacity <<= 1;
+  }
+  // a seq distance must stay unambiguous
+  capacity = std::min<uint32_t>(capacity, 1u << 15);
+
+  cfg_.capacity = static_cast<int>(capacity);
+  cfg_.max_packet_len = std::max(cfg_.max_packet_len, avTLVPacket::header_len);
+  cfg_.max_delay_ms = std::max(cfg_.max_delay_ms, cfg_.target_delay_ms);
+  mask_ = capacity - 1;
+
+  slots_.resize(capacity);
+  storage_.resize(static_cast<size_t>(capacity) * cfg_.max_packet_len);
+
+  reset();
+}
+
+void avTLVJitterBuffer::reset() {
+  for (Slot& s : slots_) {
+    s.used = false;
+  }
+
+  started_ = false;
+  head_seq_ = 0;
+  high_seq_ = 0;
+  count_ = 0;
+
+  ext_rtp_ = 0;
+  head_rtp_ms_ = 0;
+  frame_ms_ = 20;
+  have_popped_ = false;
+  prev_pop_seq_ = 0;
+  prev_pop_rtp_ms_ = 0;
+
+  have_transit_ = false;
+  prev_transit_ms_ = 0;
+  offset_ms_ = 0;
+  jitter_ms_ = 0;
+  delay_ms_ = cfg_.target_delay_ms;
+}
+
+bool avTLVJitterBuffer::push(const avTLVPacket& pkt) {
+  int64_t rtp_ms = 0;
+  int dist = 0;
+
+  if (pkt.tlv_len > cfg_.max_packet_len) {
+    counters_.overflow++;
+    return false;
+  }
+
+  if (!started_) {
+    started_ = true;
+    head_seq_ = pkt.seq;
+    high_seq_ = pkt.seq;
+    ext_rtp_ = pkt.rtp_ts;
+  }
+
+  dist = static_cast<int16_t>(pkt.seq - head_seq_);
+  if (dist < -cfg_.capacity) {
+    // further back than the buffer reaches: a sender restart, not a late
+    // packet. the rtp_ts base changed with it, so does the transit offset
+    resync(pkt.seq);
+    have_transit_ = false;
+    dist = 0;
+  } else if (dist < 0) {
+    counters_.late++;
+    return false;
+  }
+
+  if (dist >= cfg_.capacity) {
+    // too far ahead to fit, resync on this packet and lose what is buffered
+    resync(pkt.seq);
+    dist = 0;
+  }
+
+  Slot& slot = slots_[pkt.seq & mask_];
+  if (slot.used) {
+    counters_.duplicate++;
+    return false;
+  }
+
+  if (static_cast<int16_t>(pkt.seq - high_seq_) < 0) {
+    counters_.reordered++;
+  } else {
+    high_seq_ = pkt.seq;
+  }
+
+  ext_rtp_ += static_cast<int32_t>(pkt.rtp_ts - static_cast<uint32_t>(ext_rtp_));
+  rtp_ms = ext_rtp_ * 1000 / cfg_.rtp_clock_rate;
+
+  uint8_t* data = &storage_[static_cast<size_t>(pkt.seq & mask_) * cfg_.max_packet_len];
+  memcpy(data, pkt.data, pkt.tlv_len);
+
+  slot.used = true;
+  slot.seq = pkt.seq;
+  slot.rtp_ms = rtp_ms;
+  slot.hdr = pkt;
+  slot.hdr.data = data;
+
+  if (dist == 0) {
+    head_rtp_ms_ = rtp_ms;
+  }
+
+  count_++;
+  counters_.pushed++;
+
+  update_jitter(static_cast<int64_t>(pkt.cap_ts) * 1000 / cfg_.cap_ts_per_sec, rtp_ms);
+
+  return true;
+}
+
+bool avTLVJitterBuffer::pop(uint64_t now, avTLVPacket& pkt) {
+  int64_t now_ms = static_cast<int64_t>(now) * 1000 / cfg_.cap_ts_per_sec;
+
+  while (count_ > 0) {
+    const Slot& s = slots_[head_seq_ & mask_];
+    bool present = s.used && s.seq == head_seq_;
+    int64_t due = (present ? s.rtp_ms : head_rtp_ms_) + offset_ms_ + delay_ms_;
+
+    if (now_ms < due) {
+      return false;
+    }
+
+    if (present) {
+      return pop_head(pkt);
+    }
+
+    // hole whose playout time has passed, give up on it
+    counters_.skipped++;
+    head_seq_++;
+    head_rtp_ms_ += frame_ms_;
+  }
+
+  return false;
+}
+
+bool avTLVJitterBuffer::drain(avTLVPacket& pkt) {
+  while (count_ > 0) {
+    const Slot& s = slots_[head_seq_ & mask_];
+    if (s.used && s.seq == head_seq_) {
+      return pop_head(pkt);
+    }
+    counters_.skipped++;
+    head_seq_++;
+    head_rtp_ms_ += frame_ms_;
+  }
+
+  return false;
+}
+
+void avTLVJitterBuffer::resync(uint16_t seq) {
+  counters_.resync++;
+  counters_.overflow += count_;
+  for (Slot& s : slots_) {
+    s.used = false;
+  }
+  count_ = 0;
+  head_seq_ = seq;
+  high_seq_ = seq;
+  have_popped_ = false;
+}
+
+bool avTLVJitterBuffer::pop_head(avTLVPacket& pkt) {
+  Slot& s = slots_[head_seq_ & mask_];
+
+  if (have_popped_) {
+    int dseq = static_cast<int16_t>(s.seq - prev_pop_seq_);
+    int64_t dms = s.rtp_ms - prev_pop_rtp_ms_;
+    if (dseq > 0 && dms > 0) {
+      frame_ms_ = std::max<int64_t>(dms / dseq, 1);
+    }
+  }
+  have_popped_ = true;
+  prev_pop_seq_ = s.seq;
+  prev_pop_rtp_ms_ = s.rtp_ms;
+
+  pkt = s.hdr;
+  s.used = false;
+  count_--;
+  counters_.popped++;
+
+  head_seq_ = s.seq + 1;
+  head_rtp_ms_ = s.rtp_ms + frame_ms_;
+
+  return true;
+}
+
+void avTLVJitterBuffer::update_jitter(int64_t arrival_ms, int64_t rtp_ms) {
+  int64_t transit = arrival_ms - rtp_ms;
+
+  if (!have_transit_) {
+    have_transit_ = true;
+    offset_ms_ = transit;
+  } else {
+    // RFC 3550 interarrival jitter
+    double d = std::fabs(static_cast<double>(transit - prev_transit_ms_));
+    jitter_ms_ += (d - jitter_ms_) / 16.0;
+    offset_ms_ = std::min(offset_ms_, transit);
+  }
+  prev_transit_ms_ = transit;
+
+  // enough headroom for ~3 sigma of jitter, within the configured bounds
+  delay_ms_ = std::clamp(static_cast<int>(std::lround(3.0 * jitter_ms_)),
+                         cfg_.target_delay_ms, cfg_.max_delay_ms);
+}
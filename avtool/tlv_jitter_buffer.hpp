@@ -0,0 +1,114 @@
+//
+//  tlv_jitter_buffer.hpp
+//  avtool
+//
+//  Created by zhanwang-sky on 2023/11/20.
+//
+
+#ifndef tlv_jitter_buffer_hpp
+#define tlv_jitter_buffer_hpp
+
+#include <cstdint>
+#include <vector>
+
+#include "tlv_packet.hpp"
+
+// Bounded-latency jitter buffer for live captures. Packets are kept in a
+// fixed ring indexed by seq (all storage allocated up front) and released
+// once their rtp_ts-derived playout time plus the current delay has passed.
+// The delay adapts to the cap_ts arrival jitter (RFC 3550 estimator) within
+// [target_delay_ms, max_delay_ms]. Holes are skipped, not filled, the
+// decoder side conceals them from the seq gap.
+class avTLVJitterBuffer {
+ public:
+  struct Config {
+    int capacity = 256;            // packets, rounded up to a power of 2
+    int max_packet_len = 1500;     // whole TLV, larger packets are dropped
+    int target_delay_ms = 40;      // initial / minimum delay
+    int max_delay_ms = 200;
+    int rtp_clock_rate = 48000;
+    int cap_ts_per_sec = 1000;     // cap_ts unit, milliseconds by default
+  };
+
+  struct Counters {
+    uint64_t pushed = 0;
+    uint64_t popped = 0;
+    uint64_t late = 0;        // arrived after its slot was played out
+    uint64_t duplicate = 0;
+    uint64_t reordered = 0;   // arrived after a higher seq
+    uint64_t skipped = 0;     // holes played out as missing
+    uint64_t overflow = 0;    // dropped, too far ahead or too large
+    uint64_t resync = 0;      // seq jumps (sender restarts) that flushed the buffer
+  };
+
+  avTLVJitterBuffer(const avTLVJitterBuffer&) = delete;
+  avTLVJitterBuffer& operator=(const avTLVJitterBuffer&) = delete;
+
+  avTLVJitterBuffer();
+
+  explicit avTLVJitterBuffer(const Config& cfg);
+
+  virtual ~avTLVJitterBuffer() = default;
+
+  // copies |pkt| in, returns false if it was dropped (see counters)
+  bool push(const avTLVPacket& pkt);
+
+  // release the next packet due at |now| (cap_ts units), returns false if
+  // nothing is due yet. |pkt| points into the ring, valid until next push()
+  bool pop(uint64_t now, avTLVPacket& pkt);
+
+  // release the next buffered packet regardless of time, e.g. at EOF
+  bool drain(avTLVPacket& pkt);
+
+  int size() const { return count_; }
+
+  double jitter_ms() const { return jitter_ms_; }
+
+  int delay_ms() const { return delay_ms_; }
+
+  const Counters& counters() const { return counters_; }
+
+  void reset();
+
+ private:
+  struct Slot {
+    bool used = false;
+    uint16_t seq = 0;
+    int64_t rtp_ms = 0;  // unwrapped rtp_ts in ms
+    avTLVPacket hdr;
+  };
+
+  bool pop_head(avTLVPacket& pkt);
+
+  // drop what is buffered and start over at |seq|
+  void resync(uint16_t seq);
+
+  void update_jitter(int64_t arrival_ms, int64_t rtp_ms);
+
+  Config cfg_;
+  uint32_t mask_ = 0;
+  std::vector<Slot> slots_;
+  std::vector<uint8_t> storage_;  // capacity * max_packet_len
+
+  bool started_ = false;
+  uint16_t head_seq_ = 0;   // next seq to play out
+  uint16_t high_seq_ = 0;   // highest seq pushed
+  int count_ = 0;
+
+  int64_t ext_rtp_ = 0;     // last pushed rtp_ts, unwrapped
+  int64_t head_rtp_ms_ = 0; // expected rtp_ms of the head
+  int64_t frame_ms_ = 20;   // last observed packet spacing
+  bool have_popped_ = false;
+  uint16_t prev_pop_seq_ = 0;
+  int64_t prev_pop_rtp_ms_ = 0;
+
+  bool have_transit_ = false;
+  int64_t prev_transit_ms_ = 0;
+  int64_t offset_ms_ = 0;   // min(arrival - rtp_ms), fastest path
+  double jitter_ms_ = 0;
+  int delay_ms_ = 0;
+
+  Counters counters_;
+};
+
+#endif /* tlv_jitter_buffer_hpp */
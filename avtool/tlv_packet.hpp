@@ -0,0 +1,113 @@
+//
+//  tlv_packet.hpp
+//  avtool
+//
+//  Created by zhanwang-sky on 2023/11/20.
+//
+
+#ifndef tlv_packet_hpp
+#define tlv_packet_hpp
+
+#include <cstddef>
+#include <cstdint>
+#include <span>
+
+// TLV header layout (little endian):
+//   [0..1] tlv_len (header included), [2] marker, [3..4] seq,
+//   [5..8] rtp_ts, [9..14] cap_ts (48 bits)
+struct avTLVPacket {
+  static constexpr int header_len = 15;
+
+  uint16_t tlv_len = 0;
+  uint8_t marker = 0;
+  uint16_t seq = 0;
+  uint32_t rtp_ts = 0;
+  uint64_t cap_ts = 0;
+
+  // points to the whole TLV (header included), never owned
+  const uint8_t* data = NULL;
+
+  std::span<const uint8_t> payload() const {
+    return {data + header_len, static_cast<size_t>(tlv_len - header_len)};
+  }
+
+  // returns tlv_len on success, 0 on EOF, < 0 on malformed data
+  static int parse(const uint8_t* buf, size_t avail, avTLVPacket& pkt) {
+    uint16_t tlv_len = 0;
+
+    if (avail == 0) {
+      // EOF
+      return 0;
+    }
+
+    if (avail < header_len) {
+      // malformed TLV header
+      return -1;
+    }
+
+    tlv_len = buf[0] | (buf[1] << 8);
+
+    if (tlv_len < header_len) {
+      // malformed TLV header
+      return -1;
+    }
+
+    if (avail < tlv_len) {
+      // early EOF
+      return -2;
+    }
+
+    pkt.tlv_len = tlv_len;
+
+    pkt.marker = buf[2];
+
+    pkt.seq = buf[3] | (buf[4] << 8);
+
+    pkt.rtp_ts = buf[8]; pkt.rtp_ts <<= 8;
+    pkt.rtp_ts |= buf[7]; pkt.rtp_ts <<= 8;
+    pkt.rtp_ts |= buf[6]; pkt.rtp_ts <<= 8;
+    pkt.rtp_ts |= buf[5];
+
+    pkt.cap_ts = buf[14]; pkt.cap_ts <<= 8;
+    pkt.cap_ts |= buf[13]; pkt.cap_ts <<= 8;
+    pkt.cap_ts |= buf[12]; pkt.cap_ts <<= 8;
+    pkt.cap_ts |= buf[11]; pkt.cap_ts <<= 8;
+    pkt.cap_ts |= buf[10]; pkt.cap_ts <<= 8;
+    pkt.cap_ts |= buf[9];
+
+    pkt.data = buf;
+
+    return tlv_len;
+  }
+
+  // the header of a TLV holding |payload_len| bytes into |buf|, for dump
+  // writers. returns tlv_len, -1 if the payload is too long
+  static int write_header(uint8_t* buf, size_t payload_len,
+                          uint8_t marker, uint16_t seq, uint32_t rtp_ts, uint64_t cap_ts) {
+    size_t tlv_len = header_len + payload_len;
+
+    if (tlv_len > UINT16_MAX) {
+      return -1;
+    }
+
+    buf[0] = tlv_len & 0xff;
+    buf[1] = (tlv_len >> 8) & 0xff;
+
+    buf[2] = marker;
+
+    buf[3] = seq & 0xff;
+    buf[4] = (seq >> 8) & 0xff;
+
+    for (int i = 0; i < 4; i++) {
+      buf[5 + i] = (rtp_ts >> (8 * i)) & 0xff;
+    }
+
+    for (int i = 0; i < 6; i++) {
+      buf[9 + i] = (cap_ts >> (8 * i)) & 0xff;
+    }
+
+    return static_cast<int>(tlv_len);
+  }
+};
+
+#endif /* tlv_packet_hpp */
@@ -8,120 +8,339 @@
 #ifndef tlv_reader_hpp
 #define tlv_reader_hpp
 
+#include <climits>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <iterator>
 #include <string>
 #include <fcntl.h>
 #include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
+#include "tlv_index.hpp"
+#include "tlv_packet.hpp"
+
+// Read-only mapping of a whole TLV dump, packets are handed out as views
+// into the mapping, no copy and no syscall per packet.
+class avTLVMapping {
+ public:
+  class iterator {
+   public:
+    using iterator_category = std::forward_iterator_tag;
+    using value_type = avTLVPacket;
+    using difference_type = std::ptrdiff_t;
+    using pointer = const avTLVPacket*;
+    using reference = const avTLVPacket&;
+
+    iterator() = default;
+
+    iterator(const uint8_t* cur, const uint8_t* end)
+        : cur_(cur), end_(end) {
+      load();
+    }
+
+    reference operator*() const { return pkt_; }
+    pointer operator->() const { return &pkt_; }
+
+    iterator& operator++() {
+      cur_ += pkt_.tlv_len;
+      load();
+      return *this;
+    }
+
+    iterator operator++(int) {
+      iterator tmp = *this;
+      ++(*this);
+      return tmp;
+    }
+
+    bool operator==(const iterator& rhs) const { return cur_ == rhs.cur_; }
+
+   private:
+    void load() {
+      if (cur_ && avTLVPacket::parse(cur_, end_ - cur_, pkt_) <= 0) {
+        // EOF or malformed tail, becomes end()
+        cur_ = NULL;
+      }
+    }
+
+    const uint8_t* cur_ = NULL;
+    const uint8_t* end_ = NULL;
+    avTLVPacket pkt_;
+  };
+
+  avTLVMapping(const avTLVMapping&) = delete;
+  avTLVMapping& operator=(const avTLVMapping&) = delete;
+
+  avTLVMapping(const std::string& filename) noexcept {
+    struct stat st;
+    int fd = open(filename.c_str(), O_RDONLY);
+
+    if (fd < 0) {
+      return;
+    }
+
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)
+        && static_cast<uint64_t>(st.st_size) <= SIZE_MAX) {
+      size_ = static_cast<size_t>(st.st_size);
+      if (size_ == 0) {
+        // nothing to map, but still a valid (empty) dump
+        opened_ = true;
+      } else {
+        void* addr = mmap(NULL, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (addr != MAP_FAILED) {
+          madvise(addr, size_, MADV_SEQUENTIAL);
+          base_ = static_cast<const uint8_t*>(addr);
+          opened_ = true;
+        } else {
+          size_ = 0;
+        }
+      }
+    }
+
+    // the mapping stays valid after close
+    close(fd);
+  }
+
+  avTLVMapping(avTLVMapping&& rhs) noexcept
+      : base_(rhs.base_), size_(rhs.size_), opened_(rhs.opened_) {
+    rhs.reset();
+  }
+
+  avTLVMapping& operator=(avTLVMapping&& rhs) noexcept {
+    if (this != &rhs) {
+      do_clean();
+
+      base_ = rhs.base_;
+      size_ = rhs.size_;
+      opened_ = rhs.opened_;
+
+      rhs.reset();
+    }
+
+    return *this;
+  }
+
+  virtual ~avTLVMapping() {
+    do_clean();
+  }
+
+  bool is_open() const {
+    return opened_;
+  }
+
+  const uint8_t* data() const {
+    return base_;
+  }
+
+  size_t size() const {
+    return size_;
+  }
+
+  iterator begin() const {
+    return base_ ? iterator(base_, base_ + size_) : iterator();
+  }
+
+  iterator end() const {
+    return iterator();
+  }
+
+ private:
+  void do_clean() {
+    if (base_) {
+      munmap(const_cast<uint8_t*>(base_), size_);
+    }
+    reset();
+  }
+
+  void reset() {
+    base_ = NULL;
+    size_ = 0;
+    opened_ = false;
+  }
+
+  const uint8_t* base_ = NULL;
+  size_t size_ = 0;
+  bool opened_ = false;
+};
+
+// Compatibility wrapper, copies each TLV out of the mapping.
 class avTLVReader {
  public:
-  static constexpr int header_len = 15;
+  static constexpr int header_len = avTLVPacket::header_len;
 
   avTLVReader(const avTLVReader&) = delete;
   avTLVReader& operator=(const avTLVReader&) = delete;
 
   avTLVReader(const std::string& filename) noexcept
-      : fd_(open(filename.c_str(), O_RDONLY)) { }
+      : map_(filename) { }
 
   avTLVReader(avTLVReader&& rhs) noexcept
-      : fd_(rhs.fd_), pos_(rhs.pos_) {
-    rhs.fd_ = -1;
+      : map_(std::move(rhs.map_)), index_(std::move(rhs.index_)), pos_(rhs.pos_) {
     rhs.pos_ = 0;
   }
 
   avTLVReader& operator=(avTLVReader&& rhs) noexcept {
     if (this != &rhs) {
-      do_clean();
-
-      fd_ = rhs.fd_;
+      map_ = std::move(rhs.map_);
+      index_ = std::move(rhs.index_);
       pos_ = rhs.pos_;
-      rhs.fd_ = -1;
       rhs.pos_ = 0;
     }
 
     return *this;
   }
 
-  virtual ~avTLVReader() {
-    do_clean();
-  }
+  virtual ~avTLVReader() = default;
 
   bool is_open() const {
-    return fd_ >= 0;
+    return map_.is_open();
   }
 
-  int read(uint8_t* buf, int buf_len,
-           uint8_t& marker, uint16_t& seq, uint32_t& rtp_ts, uint64_t& cap_ts) {
-    uint16_t tlv_len = 0;
-    ssize_t nbytes = 0;
+  const avTLVMapping& mapping() const {
+    return map_;
+  }
 
-    // sanity check
-    if (!buf || buf_len < header_len) {
-      return INT_MIN;
+  const avTLVIndex& index() const {
+    return index_;
+  }
+
+  uint64_t tell() const {
+    return pos_;
+  }
+
+  // |pos| must be a TLV boundary, e.g. avTLVIndex::Entry::offset
+  bool seek(uint64_t pos) {
+    if (!is_open() || pos > map_.size()) {
+      return false;
     }
+    pos_ = pos;
+    return true;
+  }
+
+  int build_index(int interval = avTLVIndex::default_interval) {
+    if (!is_open()) {
+      return INT_MIN + 1;
+    }
+    return index_.build(map_.data(), map_.size(), interval);
+  }
+
+  bool load_index(const std::string& filename) {
+    return is_open() && index_.load(filename, map_.size());
+  }
+
+  // Position the reader on the first packet whose key is >= the target,
+  // starting from the nearest index entry (or the file head without index).
+  // seq / rtp_ts are unwrapped, see avTLVIndex.
+  // returns 0 on success, -1 if no such packet, -2 on malformed dump
+  int seek_to_seq(uint64_t seq) {
+    return seek_by(index_.floor_by_seq(seq), seq,
+                   [](const avTLVIndex::Unwrapper& uw, const avTLVPacket&) { return uw.seq; });
+  }
+
+  int seek_to_rtp_ts(uint64_t rtp_ts) {
+    return seek_by(index_.floor_by_rtp_ts(rtp_ts), rtp_ts,
+                   [](const avTLVIndex::Unwrapper& uw, const avTLVPacket&) { return uw.rtp_ts; });
+  }
+
+  int seek_to_cap_ts(uint64_t cap_ts) {
+    return seek_by(index_.floor_by_cap_ts(cap_ts), cap_ts,
+                   [](const avTLVIndex::Unwrapper&, const avTLVPacket& pkt) { return pkt.cap_ts; });
+  }
+
+  // zero-copy variant, |pkt| stays valid as long as the reader lives
+  int next(avTLVPacket& pkt) {
+    int rc = 0;
 
     if (!is_open()) {
       // not opened
       return INT_MIN + 1;
     }
 
-    if ((nbytes = pread(fd_, buf, buf_len, pos_)) < 0) {
-      // read error
-      return INT_MIN + 2;
+    rc = avTLVPacket::parse(map_.data() + pos_, map_.size() - pos_, pkt);
+    if (rc > 0) {
+      pos_ += rc;
     }
 
-    if (nbytes == 0) {
-      // EOF
-      return 0;
+    return rc;
+  }
+
+  int read(uint8_t* buf, int buf_len,
+           uint8_t& marker, uint16_t& seq, uint32_t& rtp_ts, uint64_t& cap_ts) {
+    avTLVPacket pkt;
+    int rc = 0;
+
+    // sanity check
+    if (!buf || buf_len < header_len) {
+      return INT_MIN;
     }
 
-    if (nbytes < header_len) {
-      // malformed TLV header
-      return -1;
+    if (!is_open()) {
+      // not opened
+      return INT_MIN + 1;
     }
 
-    tlv_len = buf[0] | (buf[1] << 8);
+    rc = avTLVPacket::parse(map_.data() + pos_, map_.size() - pos_, pkt);
+    if (rc <= 0) {
+      return rc;
+    }
 
-    if (nbytes < tlv_len) {
-      if (nbytes < buf_len) {
-        // early EOF
-        return -2;
-      }
+    if (buf_len < rc) {
       // buffer too short
       return -3;
     }
 
-    marker = buf[2];
+    memcpy(buf, pkt.data, rc);
 
-    seq = buf[3] | (buf[4] << 8);
+    marker = pkt.marker;
+    seq = pkt.seq;
+    rtp_ts = pkt.rtp_ts;
+    cap_ts = pkt.cap_ts;
 
-    rtp_ts = buf[8]; rtp_ts <<= 8;
-    rtp_ts |= buf[7]; rtp_ts <<= 8;
-    rtp_ts |= buf[6]; rtp_ts <<= 8;
-    rtp_ts |= buf[5];
+    pos_ += rc;
 
-    cap_ts = buf[14]; cap_ts <<= 8;
-    cap_ts |= buf[13]; cap_ts <<= 8;
-    cap_ts |= buf[12]; cap_ts <<= 8;
-    cap_ts |= buf[11]; cap_ts <<= 8;
-    cap_ts |= buf[10]; cap_ts <<= 8;
-    cap_ts |= buf[9];
-
-    pos_ += tlv_len;
-
-    return tlv_len;
+    return rc;
   }
 
  private:
-  void do_clean() {
-    if (is_open()) {
-      close(fd_);
-      fd_ = -1;
+  template <typename KeyFn>
+  int seek_by(const avTLVIndex::Entry* entry, uint64_t target, KeyFn key) {
+    avTLVIndex::Unwrapper uw;
+    avTLVPacket pkt;
+    uint64_t pos = 0;
+    int rc = 0;
+
+    if (!is_open()) {
+      // not opened
+      return INT_MIN + 1;
     }
-    pos_ = 0;
+
+    if (entry) {
+      uw.seq = entry->seq;
+      uw.rtp_ts = entry->rtp_ts;
+      uw.started = true;
+      pos = entry->offset;
+    }
+
+    while ((rc = avTLVPacket::parse(map_.data() + pos, map_.size() - pos, pkt)) > 0) {
+      uw.update(pkt);
+      if (key(uw, pkt) >= target) {
+        pos_ = pos;
+        return 0;
+      }
+      pos += rc;
+    }
+
+    pos_ = pos;
+
+    return (rc == 0) ? -1 : -2;
   }
 
-  int fd_ = -1;
-  int pos_ = 0;
+  avTLVMapping map_;
+  avTLVIndex index_;
+  uint64_t pos_ = 0;
 };
 
 #endif /* tlv_reader_hpp */
@@ -0,0 +1,225 @@
+//
+//  tlv_stream_reader.cpp
+//  avtool
+//
+//  Created by zhanwang-sky on 2023/11/20.
+//
+
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cstring>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#if defined(__linux__)
+#include <sys/inotify.h>
+#endif
+
+#include "tlv_stream_reader.hpp"
+
+namespace {
+
+constexpr int poll_interval_ms = 50;
+
+int open_unix_socket(const std::string& path) {
+  struct sockaddr_un addr;
+  int fd = -1;
+
+  if (path.size() >= sizeof(addr.sun_path)) {
+    return -1;
+  }
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  memcpy(addr.sun_path, path.c_str(), path.size());
+
+  fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0) {
+    return -1;
+  }
+  if (connect(fd, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) < 0) {
+    close(fd);
+    return -1;
+  }
+
+  return fd;
+}
+
+}
+
+avTLVStreamReader::avTLVStreamReader(const std::string& filename,
+                                     bool follow,
+                                     int idle_timeout_ms,
+                                     int buffer_size) noexcept
+    : idle_timeout_ms_(idle_timeout_ms) {
+  struct stat st;
+
+  if (filename == "-") {
+    fd_ = STDIN_FILENO;
+  } else if (stat(filename.c_str(), &st) == 0 && S_ISSOCK(st.st_mode)) {
+    fd_ = open_unix_socket(filename);
+    owns_fd_ = true;
+  } else {
+    fd_ = open(filename.c_str(), O_RDONLY);
+    owns_fd_ = true;
+  }
+  if (fd_ < 0) {
+    return;
+  }
+
+  // only a regular file can grow behind a zero-length read
+  follow_ = follow && fstat(fd_, &st) == 0 && S_ISREG(st.st_mode);
+
+#if defined(__linux__)
+  if (follow_) {
+    notify_fd_ = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (notify_fd_ >= 0) {
+      watch_fd_ = inotify_add_watch(notify_fd_, filename.c_str(), IN_MODIFY | IN_CLOSE_WRITE);
+      if (watch_fd_ < 0) {
+        // fall back to polling
+        close(notify_fd_);
+        notify_fd_ = -1;
+      }
+    }
+  }
+#endif
+
+  try {
+    // a single TLV is at most UINT16_MAX bytes
+    buf_.resize(std::max(buffer_size, 2 * UINT16_MAX));
+  } catch (...) {
+    if (owns_fd_) {
+      close(fd_);
+    }
+    fd_ = -1;
+  }
+}
+
+avTLVStreamReader::~avTLVStreamReader() {
+  if (notify_fd_ >= 0) {
+    close(notify_fd_);
+    notify_fd_ = -1;
+  }
+  if (fd_ >= 0 && owns_fd_) {
+    close(fd_);
+  }
+  fd_ = -1;
+}
+
+bool avTLVStreamReader::is_open() const {
+  return fd_ >= 0;
+}
+
+bool avTLVStreamReader::is_stream(const std::string& filename) {
+  struct stat st;
+
+  if (filename == "-") {
+    return true;
+  }
+
+  return stat(filename.c_str(), &st) == 0 && !S_ISREG(st.st_mode);
+}
+
+int avTLVStreamReader::next(avTLVPacket& pkt) {
+  int rc = 0;
+
+  if (!is_open()) {
+    // not opened
+    return INT_MIN + 1;
+  }
+
+  while (true) {
+    rc = avTLVPacket::parse(&buf_[begin_], end_ - begin_, pkt);
+    if (rc > 0) {
+      begin_ += rc;
+      pos_ += rc;
+      return rc;
+    }
+
+    if (end_ - begin_ >= 2 && (buf_[begin_] | (buf_[begin_ + 1] << 8)) < avTLVPacket::header_len) {
+      // malformed TLV header
+      return -1;
+    }
+
+    // need more data, the packet is still incomplete
+    ssize_t n = fill();
+    if (n < 0) {
+      return INT_MIN + 2;
+    }
+    if (n == 0) {
+      // EOF, clean or in the middle of a packet
+      return rc;
+    }
+  }
+}
+
+ssize_t avTLVStreamReader::fill() {
+  if (begin_ > 0 && buf_.size() - end_ < UINT16_MAX) {
+    // keep the partial packet, make room behind it
+    memmove(&buf_[0], &buf_[begin_], end_ - begin_);
+    end_ -= begin_;
+    begin_ = 0;
+  }
+
+  while (true) {
+    ssize_t n = read(fd_, &buf_[end_], buf_.size() - end_);
+    if (n > 0) {
+      end_ += n;
+      return n;
+    }
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+    if (!follow_ || !wait_for_data()) {
+      return 0;
+    }
+  }
+}
+
+bool avTLVStreamReader::wait_for_data() {
+  // bytes read from the file so far
+  uint64_t size = pos_ + (end_ - begin_);
+  int waited_ms = 0;
+
+  while (true) {
+    // also catches writes that landed before the watch could see them
+    struct stat st;
+    if (fstat(fd_, &st) < 0) {
+      return false;
+    }
+    if (static_cast<uint64_t>(st.st_size) > size) {
+      return true;
+    }
+
+    if (idle_timeout_ms_ >= 0 && waited_ms >= idle_timeout_ms_) {
+      return false;
+    }
+
+    int wait_ms = poll_interval_ms;
+    if (idle_timeout_ms_ >= 0) {
+      wait_ms = std::min(wait_ms, idle_timeout_ms_ - waited_ms);
+    }
+
+    if (notify_fd_ >= 0) {
+      struct pollfd pfd = { notify_fd_, POLLIN, 0 };
+      if (poll(&pfd, 1, wait_ms) > 0) {
+        // drain the events, fstat() above tells what changed
+        char events[4096];
+        while (read(notify_fd_, events, sizeof(events)) > 0) { }
+      }
+    } else {
+      // no change notification, sleep and look again
+      poll(NULL, 0, wait_ms);
+    }
+
+    waited_ms += wait_ms;
+  }
+}
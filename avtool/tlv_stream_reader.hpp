@@ -0,0 +1,71 @@
+//
+//  tlv_stream_reader.hpp
+//  avtool
+//
+//  Created by zhanwang-sky on 2023/11/20.
+//
+
+#ifndef tlv_stream_reader_hpp
+#define tlv_stream_reader_hpp
+
+#include <string>
+#include <vector>
+
+#include "tlv_packet.hpp"
+
+// Sequential TLV reader on plain read(), for inputs that cannot be mapped
+// or pread: stdin ("-"), FIFOs and UNIX stream sockets. Packets are parsed
+// out of a buffer that is refilled (and compacted) as they are consumed.
+//
+// With |follow| set, EOF on a regular file is not final: the reader waits
+// for the dump to grow (inotify on Linux, polling elsewhere) and gives up
+// once nothing was appended for |idle_timeout_ms|, e.g. after the call
+// being captured has ended. A negative timeout waits forever.
+class avTLVStreamReader {
+ public:
+  static constexpr int default_buffer_size = 1 << 17;
+  static constexpr int default_idle_timeout_ms = 10000;
+
+  avTLVStreamReader(const avTLVStreamReader&) = delete;
+  avTLVStreamReader& operator=(const avTLVStreamReader&) = delete;
+
+  avTLVStreamReader(const std::string& filename,
+                    bool follow = false,
+                    int idle_timeout_ms = default_idle_timeout_ms,
+                    int buffer_size = default_buffer_size) noexcept;
+
+  virtual ~avTLVStreamReader();
+
+  bool is_open() const;
+
+  // true if |filename| has to go through this reader (not a regular file)
+  static bool is_stream(const std::string& filename);
+
+  // same return codes as avTLVReader::next(),
+  // |pkt| stays valid until the next call
+  int next(avTLVPacket& pkt);
+
+  // bytes consumed so far
+  uint64_t tell() const { return pos_; }
+
+ private:
+  // read more data behind |end_|, returns bytes read, 0 on (final) EOF, < 0 on error
+  ssize_t fill();
+
+  // follow mode, wait until the file grows, returns false on timeout / error
+  bool wait_for_data();
+
+  int fd_ = -1;
+  bool owns_fd_ = false;
+  bool follow_ = false;
+  int idle_timeout_ms_ = 0;
+  int notify_fd_ = -1;
+  int watch_fd_ = -1;
+
+  std::vector<uint8_t> buf_;
+  size_t begin_ = 0;
+  size_t end_ = 0;
+  uint64_t pos_ = 0;
+};
+
+#endif /* tlv_stream_reader_hpp */